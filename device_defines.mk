@@ -95,6 +95,18 @@ ifeq ($(MR_CONTINUOUS_FB_UPDATE),true)
     LOCAL_CFLAGS += -DMR_CONTINUOUS_FB_UPDATE
 endif
 
+ifeq ($(MR_GENERIC_FB_USE_VSYNC),true)
+    LOCAL_CFLAGS += -DMR_GENERIC_FB_USE_VSYNC
+endif
+
+ifeq ($(MR_FB_ZERO_COPY),true)
+    LOCAL_CFLAGS += -DMR_FB_ZERO_COPY
+endif
+
+ifneq ($(MR_TEXT_CACHE_KB),)
+    LOCAL_CFLAGS += -DMR_TEXT_CACHE_KB=$(MR_TEXT_CACHE_KB)
+endif
+
 LOCAL_CFLAGS += -DPLATFORM_SDK_VERSION=$(PLATFORM_SDK_VERSION)
 
 ifeq ($(MR_USE_MROM_FSTAB),true)
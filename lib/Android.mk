@@ -6,8 +6,15 @@ common_SRC_FILES := \
     colors.c \
     containers.c \
     framebuffer.c \
+    framebuffer_blend.c \
+    framebuffer_capture.c \
+    framebuffer_damage.c \
     framebuffer_generic.c \
     framebuffer_png.c \
+    framebuffer_render.c \
+    framebuffer_rotate.c \
+    framebuffer_shape.c \
+    framebuffer_stats.c \
     framebuffer_truetype.c \
     fstab.c \
     inject.c \
@@ -16,6 +23,7 @@ common_SRC_FILES := \
     keyboard.c \
     mrom_data.c \
     notification_card.c \
+    perf_hud.c \
     progressdots.c \
     tabview.c \
     touch_tracker.c \
@@ -37,6 +45,19 @@ ifeq ($(MR_INPUT_TYPE),)
 endif
 common_SRC_FILES += input_$(MR_INPUT_TYPE).c
 
+ifeq ($(MR_FB_HEADLESS),true)
+    common_C_FLAGS += -DMR_FB_HEADLESS
+    common_SRC_FILES += framebuffer_headless.c
+endif
+
+ifeq ($(MR_FB_DRM),true)
+    common_C_FLAGS += -DMR_FB_DRM
+    common_SRC_FILES += framebuffer_drm.c
+ifneq ($(MR_FB_DRM_BUFFERS),)
+    common_C_FLAGS += -DMR_FB_DRM_BUFFERS=$(MR_FB_DRM_BUFFERS)
+endif
+endif
+
 ifeq ($(MR_USE_QCOM_OVERLAY),true)
     common_C_FLAGS += -DMR_USE_QCOM_OVERLAY
     common_SRC_FILES += framebuffer_qcom_overlay.c
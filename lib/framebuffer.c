@@ -33,9 +33,11 @@
 #include <pthread.h>
 #include <png.h>
 #include <math.h>
+#include <limits.h>
 
 #include "log.h"
 #include "framebuffer.h"
+#include "framebuffer_priv.h"
 #include "util.h"
 #include "containers.h"
 #include "animation.h"
@@ -71,25 +73,107 @@ static fb_context_t fb_ctx = {
 };
 
 static fb_context_t **inactive_ctx = NULL;
-static uint8_t **fb_rot_helpers = NULL;
+
+// White rect shown after a screenshot, protected by fb_ctx.mutex. It is
+// removed before the context is pushed away, so it never ends up in one.
+static fb_rect *fb_flash_rect = NULL;
+
+// Damage accumulated since the last frame, protected by fb_ctx.mutex
+static fb_damage fb_frame_damage;
+// Damage of the last few presented frames, the impls are multi-buffered
+// and their back buffers need to catch up on what they've missed.
+#define FB_MAX_BUFFERS 4
+static fb_damage fb_present_history[FB_MAX_BUFFERS];
+static int fb_present_history_idx = 0;
+
+// With zero-copy, frames are composited straight into the impl's back
+// buffer and fb.buffer points to the buffer which is on screen, there is
+// no buffer of our own. Otherwise, fb.buffer is fb_own_buffer and it is
+// copied into the impl on update.
+static int fb_zero_copy = 0;
+static px_type *fb_own_buffer = NULL;
+
+// Length of one display refresh. Starts as a guess from the video mode and
+// is refined by measuring the time between vsyncs, if the impl has them.
+#define FB_VSYNC_LOG_AFTER 120
+static uint32_t fb_frame_interval_us = 16667;
+static int fb_vsync_supported = 0;
+static int fb_vsync_samples = 0;
+static struct timespec fb_last_vsync;
+
+// Surface of a layer, see fb_layer
+struct fb_layer_cache
+{
+    px_type *surface;   // display layout
+    int surface_size;   // in pixels
+    fb_item_pos pos;    // logical area held by the surface
+    fb_item_pos dev;    // pos in display coordinates
+    uint32_t background;
+    fb_damage damage;   // areas of the surface which must be re-rendered
+};
+
+/*
+ * Snapshot of the items a frame needs, taken while fb_ctx.mutex is locked.
+ * The frame is rendered from it after the mutex is released, so that
+ * the UI can keep changing the items in the meantime. Only the items which
+ * touch the damaged areas are copied. The data the copies point to stays
+ * alive until the frame is done, see fb_destroy_item() and fb_defer_free().
+ */
+typedef struct
+{
+    fb_item_header *it; // copy of the item
+    fb_item_pos parent;
+} fb_scene_item;
+
+typedef struct
+{
+    fb_layer *layer; // only its cache is used, it belongs to the draw thread
+    uint32_t background;
+    fb_damage damage;
+} fb_scene_layer;
+
+static struct
+{
+    fb_scene_item *items; // in the list order
+    int items_cnt;
+    int items_alloc;
+    uint8_t *arena;
+    size_t arena_size;
+    fb_scene_layer *layers;
+    int layers_cnt;
+    int layers_alloc;
+    uint32_t background_color;
+    int rendering;
+    void **dead_items;
+    void **dead_data;
+} fb_scene;
+
+static pthread_cond_t fb_scene_done_cond = PTHREAD_COND_INITIALIZER;
+
 static pthread_t fb_draw_thread;
 static pthread_mutex_t fb_update_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t fb_draw_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t fb_draw_cond = PTHREAD_COND_INITIALIZER;
+// signalled when fb_draw_requested is set, protected by fb_draw_mutex
+static pthread_cond_t fb_draw_wake_cond = PTHREAD_COND_INITIALIZER;
 static atomic_int fb_draw_requested = ATOMIC_VAR_INIT(0);
 static volatile int fb_draw_run = 0;
 static void *fb_draw_thread_work(void*);
+static void fb_wake_draw_thread(void);
 
 static void fb_destroy_item(void *item); // private!
-static inline void fb_cpy_fb_with_rotation(px_type *dst, px_type *src);
-static inline void fb_rotate_90deg(px_type *dst, px_type *src);
-static inline void fb_rotate_270deg(px_type *dst, px_type *src);
-static inline void fb_rotate_180deg(px_type *dst, px_type *src);
+static void fb_free_item(void *item);
+static void fb_cpy_fb_rect(px_type *dst, px_type *src, const fb_item_pos *r);
+static void fb_pos_to_device(const fb_item_pos *p, fb_item_pos *res);
+static void fb_target_set(px_type *buffer, int stride, int dev_x, int dev_y);
+static void fb_rm_shape(fb_shape *s);
+static void fb_screenshot_flash_end(void);
+static void fb_present(const fb_damage *damage);
 
 int fb_open_impl(void)
 {
     struct fb_impl **itr;
-    struct fb_impl *impls[FB_IMPL_CNT];
+    struct fb_impl *impls[FB_IMPL_CNT+1] = { NULL };
 
 #define ADD_IMPL(ID, N) \
     extern struct fb_impl fb_impl_ ## N; \
@@ -99,8 +183,17 @@ int fb_open_impl(void)
 #ifdef MR_USE_QCOM_OVERLAY
     ADD_IMPL(FB_IMPL_QCOM_OVERLAY, qcom_overlay);
 #endif
+#ifdef MR_FB_HEADLESS
+    ADD_IMPL(FB_IMPL_HEADLESS, headless);
+#endif
+#ifdef MR_FB_DRM
+    ADD_IMPL(FB_IMPL_DRM, drm);
+#endif
 
-    if(fb_force_generic)
+    // the non-fbdev impls fill vi and fi themselves
+    if(fb.fd < 0)
+        itr = &impls[FB_IMPL_GENERIC+1];
+    else if(fb_force_generic)
         itr = &impls[FB_IMPL_GENERIC];
     else
         itr = impls;
@@ -119,19 +212,82 @@ int fb_open_impl(void)
     return -1;
 }
 
+static void fb_vsync_init(void)
+{
+    const uint64_t line = fb.vi.xres + fb.vi.left_margin + fb.vi.right_margin + fb.vi.hsync_len;
+    const uint64_t frame = fb.vi.yres + fb.vi.upper_margin + fb.vi.lower_margin + fb.vi.vsync_len;
+
+    // pixclock is in picoseconds, many drivers leave it at 0
+    fb_frame_interval_us = 16667;
+    if(fb.vi.pixclock != 0)
+    {
+        const uint64_t interval = (fb.vi.pixclock * line * frame) / 1000000;
+        if(interval >= 4000 && interval <= 50000)
+            fb_frame_interval_us = interval;
+    }
+
+    fb_vsync_supported = (fb.impl->wait_vsync != NULL);
+    fb_vsync_samples = 0;
+    fb_last_vsync.tv_sec = 0;
+    fb_last_vsync.tv_nsec = 0;
+}
+
+// Returns -1 if vsync is not available and a timer has to be used instead
+static int fb_wait_vsync(void)
+{
+    struct timespec now;
+    int64_t diff;
+
+    if(!fb_vsync_supported)
+        return -1;
+
+    if(fb.impl->wait_vsync(&fb) < 0)
+    {
+        INFO("Display doesn't support waiting for vsync, using timer\n");
+        fb_vsync_supported = 0;
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    diff = ((int64_t)(now.tv_sec - fb_last_vsync.tv_sec))*1000000 + (now.tv_nsec - fb_last_vsync.tv_nsec)/1000;
+    fb_last_vsync = now;
+
+    // Only consecutive refreshes are useful for the estimate, ignore
+    // the ones where vsync wasn't waited for in between
+    if(diff < fb_frame_interval_us*3/2 && diff > fb_frame_interval_us/2)
+    {
+        fb_frame_interval_us = (fb_frame_interval_us*7 + diff)/8;
+        if(++fb_vsync_samples == FB_VSYNC_LOG_AFTER)
+            INFO("Measured display refresh rate: %.2f Hz\n", fb_get_refresh_rate());
+    }
+    return 0;
+}
+
+float fb_get_refresh_rate(void)
+{
+    return 1000000.f / fb_frame_interval_us;
+}
+
 int fb_open(int rotation)
 {
     memset(&fb, 0, sizeof(struct framebuffer));
 
     fb.fd = open("/dev/graphics/fb0", O_RDWR | O_CLOEXEC);
-    if (fb.fd < 0)
-        return -1;
-
-    if(ioctl(fb.fd, FBIOGET_VSCREENINFO, &fb.vi) < 0)
-        goto fail;
+    if (fb.fd >= 0)
+    {
+        if(ioctl(fb.fd, FBIOGET_VSCREENINFO, &fb.vi) < 0)
+            goto fail;
 
-    if(ioctl(fb.fd, FBIOGET_FSCREENINFO, &fb.fi) < 0)
-        goto fail;
+        if(ioctl(fb.fd, FBIOGET_FSCREENINFO, &fb.fi) < 0)
+            goto fail;
+    }
+#if defined(MR_FB_DRM) || defined(MR_FB_HEADLESS)
+    // kernels with only DRM may not have fbdev emulation and a host has
+    // no display at all, these implementations fill vi and fi themselves
+#else
+    else
+        return -1;
+#endif
 
     /*
      * No FBIOPUT_VSCREENINFO ioctl must be called here. Flo's display drivers
@@ -172,10 +328,21 @@ int fb_open(int rotation)
     fb.vi.xres_virtual = fb.fi.line_length / PIXEL_SIZE;
 #endif
 
-    fb.stride = (fb_rotation%180 == 0) ? fb.vi.xres_virtual : fb.vi.yres;
+    // fb.buffer has the display's layout, rotation is done while drawing
+    fb.stride = fb.vi.xres_virtual;
     fb.size = fb.vi.xres_virtual*fb.vi.yres*PIXEL_SIZE;
-    fb.buffer = malloc(fb.size);
+
+#ifdef MR_FB_ZERO_COPY
+    // the first frame is cleared right in the impl's buffer
+    fb_zero_copy = 1;
+    fb.buffer = fb.impl->get_frame_dest(&fb);
+#else
+    fb_zero_copy = 0;
+    fb_own_buffer = malloc(fb.size);
+    fb.buffer = fb_own_buffer;
+#endif
     fb_memset(fb.buffer, fb_convert_color(BLACK), fb.size);
+    fb_target_set(fb.buffer, fb.stride, 0, 0);
 
 #if 0
     fb_dump_info();
@@ -186,30 +353,45 @@ int fb_open(int rotation)
 
     fb_set_brightness(MULTIROM_DEFAULT_BRIGHTNESS);
 
-    fb_update();
+    fb_vsync_init();
+
+    memset(fb_present_history, 0, sizeof(fb_present_history));
+    fb_present_history_idx = 0;
+    fb_damage_set_full(&fb_frame_damage);
+
+    if(fb_zero_copy)
+        fb_present(&fb_frame_damage);
+    else
+        fb_update();
+
+    fb_render_pool_start();
 
     fb_draw_run = 1;
     pthread_create(&fb_draw_thread, NULL, fb_draw_thread_work, NULL);
     return 0;
 
 fail:
-    close(fb.fd);
+    if(fb.fd >= 0)
+        close(fb.fd);
     return -1;
 }
 
 void fb_close(void)
 {
     fb_draw_run = 0;
+    fb_wake_draw_thread();
     pthread_join(fb_draw_thread, NULL);
 
-    free(fb_rot_helpers);
-    fb_rot_helpers = NULL;
+    fb_render_pool_stop();
 
     fb.impl->close(&fb);
     fb.impl = NULL;
 
-    close(fb.fd);
-    free(fb.buffer);
+    if(fb.fd >= 0)
+        close(fb.fd);
+    fb.fd = -1;
+    free(fb_own_buffer);
+    fb_own_buffer = NULL;
     fb.buffer = NULL;
 }
 
@@ -275,88 +457,184 @@ void fb_force_generic_impl(int force)
     fb_force_generic = force;
 }
 
-void fb_update(void)
+// Adds what the back buffer has missed: it was last presented
+// num_buffers-1 frames ago, so it needs everything those frames changed.
+static void fb_add_history_damage(fb_damage *region)
+{
+    int i;
+    for(i = 0; i < fb.num_buffers - 1 && i < FB_MAX_BUFFERS; ++i)
+        fb_damage_add_damage(region, &fb_present_history[(fb_present_history_idx + FB_MAX_BUFFERS - i) % FB_MAX_BUFFERS]);
+}
+
+static void fb_present(const fb_damage *damage)
 {
-    fb_cpy_fb_with_rotation(fb.impl->get_frame_dest(&fb), fb.buffer);
+    struct timespec start, end;
+    fb_item_pos dev[FB_DAMAGE_MAX_RECTS];
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
     fb.impl->update(&fb);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fb_stats_add_present(((int64_t)(end.tv_sec - start.tv_sec))*1000000 + (end.tv_nsec - start.tv_nsec)/1000);
+
+    // fb.buffer holds the whole frame now, in zero-copy mode too
+    if(fb_capture_is_active())
+    {
+        for(i = 0; i < damage->count; ++i)
+            fb_pos_to_device(&damage->rects[i], &dev[i]);
+        fb_capture_frame(fb.buffer, fb.stride, dev, damage->count);
+    }
+
+    fb_present_history_idx = (fb_present_history_idx + 1) % FB_MAX_BUFFERS;
+    fb_present_history[fb_present_history_idx] = *damage;
+}
+
+static void fb_update_damaged(const fb_damage *damage)
+{
+    int i;
+    px_type *dst;
+    fb_damage region = *damage;
+
+    fb_add_history_damage(&region);
+
+    dst = fb.impl->get_frame_dest(&fb);
+    if(dst != fb.buffer)
+    {
+        for(i = 0; i < region.count; ++i)
+            fb_cpy_fb_rect(dst, fb.buffer, &region.rects[i]);
+    }
+
+    // in zero-copy mode, fb.buffer follows the buffer on screen
+    if(fb_zero_copy)
+        fb.buffer = dst;
+
+    fb_present(damage);
+}
+
+void fb_update(void)
+{
+    fb_damage full;
+    fb_damage_set_full(&full);
+    fb_update_damaged(&full);
 }
 
-void fb_cpy_fb_with_rotation(px_type *dst, px_type *src)
+/*
+ * The rasterizers draw into fb_target, which is fb.buffer or the surface
+ * of a layer which is being re-rendered. Both have the display's layout,
+ * the rasterizers map the logical (rotated) coordinates of the items to it
+ * themselves so that no rotation pass is needed. Logical pixel [x, y] is
+ * at buffer + origin + x*step_x + y*step_y, display pixel [x, y] is at
+ * buffer + offset + x + y*stride.
+ */
+static struct
 {
+    px_type *buffer;
+    int stride;
+    int offset;
+    int origin;
+    int step_x;
+    int step_y;
+} fb_target;
+
+// buffer holds display pixels from [dev_x, dev_y] onwards, stride px per row
+static void fb_target_set(px_type *buffer, int stride, int dev_x, int dev_y)
+{
+    const int s = stride;
+    const int w = fb_width;
+    const int h = fb_height;
+
+    fb_target.buffer = buffer;
+    fb_target.stride = stride;
+    fb_target.offset = -(dev_y*stride + dev_x);
+
     switch(fb_rotation)
     {
+        default:
         case 0:
-            memcpy(dst, src, fb.vi.xres_virtual * fb.vi.yres * PIXEL_SIZE);
+            fb_target.origin = 0;
+            fb_target.step_x = 1;
+            fb_target.step_y = s;
             break;
         case 90:
-            fb_rotate_90deg(dst, src);
+            fb_target.origin = h - 1;
+            fb_target.step_x = s;
+            fb_target.step_y = -1;
             break;
         case 180:
-            fb_rotate_180deg(dst, src);
+            fb_target.origin = (h - 1)*s + w - 1;
+            fb_target.step_x = -1;
+            fb_target.step_y = -s;
             break;
         case 270:
-            fb_rotate_270deg(dst, src);
+            fb_target.origin = (w - 1)*s;
+            fb_target.step_x = -s;
+            fb_target.step_y = 1;
             break;
     }
+    fb_target.origin += fb_target.offset;
 }
 
-void fb_rotate_90deg(px_type *dst, px_type *src)
+static inline px_type *fb_px_addr(int x, int y)
 {
-    uint32_t i;
-    int32_t x;
-
-    if(!fb_rot_helpers)
-        fb_rot_helpers = malloc(fb_height*sizeof(px_type*));
-
-    px_type **helpers = (px_type**)fb_rot_helpers;
+    return fb_target.buffer + (fb_target.origin + x*fb_target.step_x + y*fb_target.step_y);
+}
 
-    helpers[0] = src;
-    for(i = 1; i < fb_height; ++i)
-        helpers[i] = helpers[i-1] + fb.stride;
+static inline px_type *fb_device_addr(int x, int y)
+{
+    return fb_target.buffer + (fb_target.offset + x + y*fb_target.stride);
+}
 
-    const int padding = fb.vi.xres_virtual - fb.vi.xres;
-    for(i = 0; i < fb_width; ++i)
+// Maps logical rectangle p to display coordinates
+static void fb_pos_to_device(const fb_item_pos *p, fb_item_pos *res)
+{
+    switch(fb_rotation)
     {
-        for(x = fb_height-1; x >= 0; --x)
-            *dst++ = *(helpers[x]++);
-        dst += padding;
+        default:
+        case 0:
+            *res = *p;
+            break;
+        case 90:
+            res->x = fb_height - p->y - p->h;
+            res->y = p->x;
+            res->w = p->h;
+            res->h = p->w;
+            break;
+        case 180:
+            res->x = fb_width - p->x - p->w;
+            res->y = fb_height - p->y - p->h;
+            res->w = p->w;
+            res->h = p->h;
+            break;
+        case 270:
+            res->x = p->y;
+            res->y = fb_width - p->x - p->w;
+            res->w = p->h;
+            res->h = p->w;
+            break;
     }
 }
 
-void fb_rotate_270deg(px_type *dst, px_type *src)
+// Copies logical rectangle r, both buffers are in the display's layout
+static void fb_cpy_fb_rect(px_type *dst, px_type *src, const fb_item_pos *r)
 {
-    if(!fb_rot_helpers)
-        fb_rot_helpers = malloc(fb_height*sizeof(px_type*));
+    int y;
+    fb_item_pos d;
 
-    uint32_t i, x;
-    px_type **helpers = (px_type**)fb_rot_helpers;
+    fb_pos_to_device(r, &d);
 
-    helpers[0] = src + fb_width-1;
-    for(i = 1; i < fb_height; ++i)
-        helpers[i] = helpers[i-1] + fb.stride;
-
-    const int padding = fb.vi.xres_virtual - fb.vi.xres;
-    for(i = 0; i < fb_width; ++i)
+    if(d.x == 0 && d.w == (int)fb.vi.xres)
     {
-        for(x = 0; x < fb_height; ++x)
-            *dst++ = *(helpers[x]--);
-        dst += padding;
+        memcpy(dst + d.y*fb.stride, src + d.y*fb.stride, fb.stride * d.h * PIXEL_SIZE);
+        return;
     }
-}
-
-void fb_rotate_180deg(px_type *dst, px_type *src)
-{
-    uint32_t i, x;
-    int len = fb.vi.xres_virtual * fb.vi.yres;
-    src += len;
 
-    const int padding = fb.vi.xres_virtual - fb.vi.xres;
-    for(i = 0; i < fb_height; ++i)
+    dst += d.y*fb.stride + d.x;
+    src += d.y*fb.stride + d.x;
+    for(y = 0; y < d.h; ++y)
     {
-        src -= padding;
-        for(x = 0; x < fb_width; ++x)
-            *dst++ = *(--src);
-        dst += padding;
+        memcpy(dst, src, d.w*PIXEL_SIZE);
+        dst += fb.stride;
+        src += fb.stride;
     }
 }
 
@@ -375,6 +653,38 @@ int fb_clone(char **buff)
 void fb_fill(uint32_t color)
 {
     fb_memset(fb.buffer, fb_convert_color(color), fb.size);
+    fb_damage_all();
+}
+
+// Fills display rectangle d, blending the color if alpha isn't 0xFF
+static void fb_fill_device_rect(const fb_item_pos *d, px_type color, uint8_t alpha)
+{
+    int y;
+    px_type *bits = fb_device_addr(d->x, d->y);
+
+    if(alpha == 0xFF && d->w == fb_target.stride)
+    {
+        fb_memset(bits, color, d->w*d->h*PIXEL_SIZE);
+        return;
+    }
+
+    for(y = 0; y < d->h; ++y)
+    {
+#ifndef MR_DISABLE_ALPHA
+        if(alpha != 0xFF)
+            fb_blend_rect_row(bits, color, alpha, d->w);
+        else
+#endif
+            fb_memset(bits, color, d->w*PIXEL_SIZE);
+        bits += fb_target.stride;
+    }
+}
+
+static void fb_fill_pos(const fb_item_pos *p, px_type color)
+{
+    fb_item_pos d;
+    fb_pos_to_device(p, &d);
+    fb_fill_device_rect(&d, color, 0xFF);
 }
 
 px_type fb_convert_color(uint32_t c)
@@ -408,7 +718,13 @@ uint32_t fb_convert_color_img(uint32_t clr)
 
 void fb_set_background(uint32_t color)
 {
-    fb_ctx.background_color = color;
+    fb_items_lock();
+    if(fb_ctx.background_color != color)
+    {
+        fb_ctx.background_color = color;
+        fb_damage_set_full(&fb_frame_damage);
+    }
+    fb_items_unlock();
 }
 
 void fb_batch_start(void)
@@ -458,37 +774,64 @@ static void fb_ctx_put_it_after(fb_item_header *new_it, fb_item_header *prev_it)
     prev_it->next = new_it;
 }
 
+// Returns index of the level's bucket or of the position where
+// it should be inserted if it does not exist
+static int fb_ctx_find_level(int level, int *found)
+{
+    int lo = 0, hi = fb_ctx.levels_cnt, mid;
+
+    while(lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if(fb_ctx.levels[mid].level < level)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *found = (lo < fb_ctx.levels_cnt && fb_ctx.levels[lo].level == level);
+    return lo;
+}
+
 void fb_ctx_add_item(void *item)
 {
     fb_item_header *h = item;
+    fb_level_bucket *b;
+    int idx, found;
 
     fb_items_lock();
 
-    if(!fb_ctx.first_item)
-        fb_ctx.first_item = item;
+    idx = fb_ctx_find_level(h->level, &found);
+    if(found)
+    {
+        b = &fb_ctx.levels[idx];
+        fb_ctx_put_it_after(h, b->last);
+    }
     else
     {
-        fb_item_header *itr = fb_ctx.first_item;
-        while(1)
-        {
-            if(itr->level > h->level)
-            {
-                if(itr == fb_ctx.first_item)
-                    fb_ctx.first_item = h;
-                fb_ctx_put_it_before(h, itr);
-                itr = NULL;
-                break;
-            }
+        fb_ctx.levels = realloc(fb_ctx.levels, sizeof(fb_level_bucket)*(fb_ctx.levels_cnt+1));
+        memmove(&fb_ctx.levels[idx+1], &fb_ctx.levels[idx], sizeof(fb_level_bucket)*(fb_ctx.levels_cnt - idx));
+        ++fb_ctx.levels_cnt;
+
+        b = &fb_ctx.levels[idx];
+        b->level = h->level;
+        b->count = 0;
+        b->first = h;
+
+        if(idx > 0)
+            fb_ctx_put_it_after(h, fb_ctx.levels[idx-1].last);
+        else if(fb_ctx.first_item)
+            fb_ctx_put_it_before(h, fb_ctx.first_item);
+    }
 
-            if(itr->next)
-                itr = itr->next;
-            else
-                break;
-        }
+    b->last = h;
+    ++b->count;
 
-        if(itr)
-            fb_ctx_put_it_after(h, itr);
-    }
+    if(!h->prev)
+        fb_ctx.first_item = h;
+    if(!h->next)
+        fb_ctx.last_item = h;
+    ++fb_ctx.item_count;
 
     fb_items_unlock();
 }
@@ -496,18 +839,102 @@ void fb_ctx_add_item(void *item)
 void fb_ctx_rm_item(void *item)
 {
     fb_item_header *h = item;
+    fb_level_bucket *b;
+    int idx, found;
 
     fb_items_lock();
 
+    idx = fb_ctx_find_level(h->level, &found);
+    if(found)
+    {
+        b = &fb_ctx.levels[idx];
+        if(--b->count == 0)
+        {
+            --fb_ctx.levels_cnt;
+            memmove(&fb_ctx.levels[idx], &fb_ctx.levels[idx+1], sizeof(fb_level_bucket)*(fb_ctx.levels_cnt - idx));
+        }
+        else
+        {
+            if(b->first == h)
+                b->first = h->next;
+            if(b->last == h)
+                b->last = h->prev;
+        }
+    }
+
     if(!h->prev)
         fb_ctx.first_item = h->next;
     else
         h->prev->next = h->next;
 
-    if(h->next)
+    if(!h->next)
+        fb_ctx.last_item = h->prev;
+    else
         h->next->prev = h->prev;
 
+    h->prev = h->next = NULL;
+    --fb_ctx.item_count;
+
+    fb_damage_add_pos(&fb_frame_damage, &h->drawn_pos);
+    if(h->layer)
+        fb_damage_add_pos(&h->layer->cache->damage, &h->drawn_pos);
+    memset(&h->drawn_pos, 0, sizeof(h->drawn_pos));
+    // fb_rm_layer() only reaches the members which are in the context
+    h->layer = NULL;
+
+    fb_items_unlock();
+}
+
+void *fb_find_item(int id)
+{
+    fb_item_header *it;
+
+    fb_items_lock();
+    for(it = fb_ctx.first_item; it && it->id != id; it = it->next);
+    fb_items_unlock();
+    return it;
+}
+
+int fb_item_count(int level)
+{
+    int idx, found, res = 0;
+
+    fb_items_lock();
+    idx = fb_ctx_find_level(level, &found);
+    if(found)
+        res = fb_ctx.levels[idx].count;
+    fb_items_unlock();
+    return res;
+}
+
+int fb_item_level_counts(int *levels, int *counts, int max)
+{
+    int i, res;
+
+    fb_items_lock();
+    res = fb_ctx.levels_cnt;
+    for(i = 0; i < res && i < max; ++i)
+    {
+        levels[i] = fb_ctx.levels[i].level;
+        counts[i] = fb_ctx.levels[i].count;
+    }
     fb_items_unlock();
+    return res;
+}
+
+// Moves the item list from src to dst, src is left empty
+static void fb_ctx_move_items(fb_context_t *dst, fb_context_t *src)
+{
+    dst->first_item = src->first_item;
+    dst->last_item = src->last_item;
+    dst->item_count = src->item_count;
+    dst->levels = src->levels;
+    dst->levels_cnt = src->levels_cnt;
+
+    src->first_item = src->last_item = NULL;
+    src->item_count = 0;
+    src->levels = NULL;
+    src->levels_cnt = 0;
 }
 
 void fb_remove_item(void *item)
@@ -526,18 +953,55 @@ void fb_remove_item(void *item)
         case FB_IT_LINE:
             fb_rm_line((fb_line*)item);
             break;
+        case FB_IT_SHAPE:
+            fb_rm_shape((fb_shape*)item);
+            break;
+        case FB_IT_LAYER:
+            fb_rm_layer((fb_layer*)item);
+            break;
     }
 }
 
+// The draw thread may be rendering a snapshot which points to the item's
+// data, it is freed once the frame is done. fb_ctx.mutex must be locked.
+static void fb_retire_item(void *item)
+{
+    if(item == fb_flash_rect)
+        fb_flash_rect = NULL;
+
+    if(fb_scene.rendering)
+        list_add(&fb_scene.dead_items, item);
+    else
+        fb_free_item(item);
+}
+
 void fb_destroy_item(void *item)
 {
     anim_cancel_for(item, 0);
 
+    fb_items_lock();
+    ((fb_item_header*)item)->layer = NULL;
+    fb_retire_item(item);
+    fb_items_unlock();
+}
+
+static void fb_free_item(void *item)
+{
     switch(((fb_item_header*)item)->type)
     {
         case FB_IT_RECT:
         case FB_IT_LINE:
             break;
+        case FB_IT_SHAPE:
+            fb_shape_mask_release(((fb_shape*)item)->mask);
+            break;
+        case FB_IT_LAYER:
+        {
+            fb_layer *l = (fb_layer*)item;
+            free(l->cache->surface);
+            free(l->cache);
+            break;
+        }
         case FB_IT_IMG:
         {
             fb_img *i = (fb_img*)item;
@@ -563,7 +1027,7 @@ void fb_destroy_item(void *item)
     free(item);
 }
 
-static inline void clamp_to_parent(void *it, int *min_x, int *max_x, int *min_y, int *max_y)
+static inline void clamp_to_parent(void *it, const fb_item_pos *clip, int *min_x, int *max_x, int *min_y, int *max_y)
 {
     fb_item_header *h = it;
 
@@ -588,236 +1052,708 @@ static inline void clamp_to_parent(void *it, int *min_x, int *max_x, int *min_y,
         parent_h = imin(parent_y + parent_h, fb_height) - parent_y;
     }
 
+    if(clip != &DEFAULT_FB_PARENT)
+    {
+        parent_w = imin(parent_x + parent_w, clip->x + clip->w);
+        parent_h = imin(parent_y + parent_h, clip->y + clip->h);
+        parent_x = imax(parent_x, clip->x);
+        parent_y = imax(parent_y, clip->y);
+        parent_w -= parent_x;
+        parent_h -= parent_y;
+    }
+
     *min_x = h->x >= parent_x ? 0 : parent_x - h->x;
     *min_y = h->y >= parent_y ? 0 : parent_y - h->y;
     *max_x = imin(h->w, parent_x + parent_w - h->x);
     *max_y = imin(h->h, parent_y + parent_h - h->y);
 }
 
-void fb_draw_rect(fb_rect *r)
+// Computes the on-screen area the item covers. Returns 0 if it is not visible.
+static int fb_item_get_bounds(fb_item_header *it, fb_item_pos *res)
 {
-    const uint8_t alpha = (r->color >> 24) & 0xFF;
-    const uint8_t inv_alpha = 0xFF - ((r->color >> 24) & 0xFF);
-    const px_type color = fb_convert_color(r->color);
-
-    if(alpha == 0)
-        return;
-
-#if defined(RECOVERY_RGBX) || defined(RECOVERY_ABGR)
-    const uint32_t premult_color_rb = ((color & 0xFF00FF) * (alpha)) >> 8;
-    const uint32_t premult_color_g = ((color & 0x00FF00) * (alpha)) >> 8;
-#elif defined(RECOVERY_BGRA)
-    const uint32_t premult_color_rb = (((color >> 8) & 0xFF00FF) * (alpha)) >> 8;
-    const uint32_t premult_color_g = (((color >> 8) & 0x00FF00) * (alpha)) >> 8;
-#elif defined(RECOVERY_RGB_565)
-    const uint8_t alpha5b = (alpha >> 3) + 1;
-    const uint8_t alpha6b = (alpha >> 2) + 1;
-    const uint8_t inv_alpha5b = 32 - alpha5b;
-    const uint8_t inv_alpha6b = 64 - alpha6b;
-    const uint16_t premult_color_rb = ((color & 0xF81F) * alpha5b) >> 5;
-    const uint16_t premult_color_g = ((color & 0x7E0) * alpha6b) >> 6;
-#endif
-
     int min_x, max_x, min_y, max_y;
-    clamp_to_parent(r, &min_x, &max_x, &min_y, &max_y);
-    const int rendered_w = max_x - min_x;
 
-    if(rendered_w <= 0)
-        return;
-
-    const int w = rendered_w*PIXEL_SIZE;
-
-    px_type *bits = fb.buffer + (fb.stride*(r->y + min_y)) + r->x + min_x;
-
-    int i, x;
-    uint8_t *comps_bits;
-    const uint8_t *comps_clr = (uint8_t*)&color;
-    for(i = min_y; i < max_y; ++i)
+    switch(it->type)
     {
-        if(alpha == 0xFF)
+        case FB_IT_RECT:
+            if((((fb_rect*)it)->color >> 24) == 0)
+                break;
+            // fallthrough
+        case FB_IT_SHAPE:
+        case FB_IT_IMG:
+        case FB_IT_LAYER:
+            clamp_to_parent(it, &DEFAULT_FB_PARENT, &min_x, &max_x, &min_y, &max_y);
+            res->x = it->x + min_x;
+            res->y = it->y + min_y;
+            res->w = max_x - min_x;
+            res->h = max_y - min_y;
+            if(res->w > 0 && res->h > 0)
+                return 1;
+            break;
+        case FB_IT_LINE:
         {
-            fb_memset(bits, color, w);
-            bits += fb.stride;
+            fb_line *l = (fb_line*)it;
+            fb_item_pos p;
+            p.x = imin(l->x, l->x2) - l->thickness;
+            p.y = imin(l->y, l->y2) - l->thickness;
+            p.w = iabs(l->x2 - l->x) + l->thickness*2 + 1;
+            p.h = iabs(l->y2 - l->y) + l->thickness*2 + 1;
+            if(fb_pos_intersect(&p, &DEFAULT_FB_PARENT, res))
+                return 1;
+            break;
         }
-        // Do the blending
-        else
+    }
+
+    memset(res, 0, sizeof(fb_item_pos));
+    return 0;
+}
+
+// Everything except for the position which can affect how the item looks
+static uint32_t fb_item_get_sig(fb_item_header *it)
+{
+    switch(it->type)
+    {
+        case FB_IT_RECT:
+            return ((fb_rect*)it)->color;
+        case FB_IT_IMG:
+            return ((uint32_t)(uintptr_t)((fb_img*)it)->data)*31 + ((fb_img*)it)->color;
+        case FB_IT_SHAPE:
+            return ((fb_shape*)it)->color*31 + ((fb_shape*)it)->radius2;
+        case FB_IT_LAYER:
+            return ((fb_layer*)it)->background;
+        case FB_IT_LINE:
         {
-#ifdef MR_DISABLE_ALPHA
-            fb_memset(bits, color, w);
-            bits += fb.stride;
-#else
-            for(x = 0; x < rendered_w; ++x)
-            {
-  #ifdef RECOVERY_RGBX || defined(RECOVERY_ABGR)
-                const uint32_t rb = (premult_color_rb & 0xFF00FF) + ((inv_alpha * (*bits & 0xFF00FF)) >> 8);
-                const uint32_t g = (premult_color_g & 0x00FF00) + ((inv_alpha * (*bits & 0x00FF00)) >> 8);
-                *bits = 0xFF000000 | (rb & 0xFF00FF) | (g & 0x00FF00);
-  #elif defined(RECOVERY_BGRA)
-                const uint32_t rb = (premult_color_rb & 0xFF00FF) + ((inv_alpha * ((*bits >> 8) & 0xFF00FF)) >> 8);
-                const uint32_t g = (premult_color_g & 0x00FF00) + ((inv_alpha * ((*bits >> 8) & 0x00FF00)) >> 8);
-                *bits = 0xFF000000 | (rb & 0xFF00FF) | (g & 0x00FF00);
-  #elif defined(RECOVERY_RGB_565)
-                const uint16_t rb = (premult_color_rb & 0xF81F) + ((inv_alpha5b * (*bits & 0xF81F)) >> 5);
-                const uint16_t g = (premult_color_g & 0x7E0) + ((inv_alpha6b * (*bits & 0x7E0)) >> 6);
-                *bits = (rb & 0xF81F) | (g & 0x7E0);
-  #else
-    #error "No alpha blending implementation for this format!"
-  #endif
-                ++bits;
-            }
-            bits += fb.stride - rendered_w;
-#endif // MR_DISABLE_ALPHA
+            fb_line *l = (fb_line*)it;
+            uint32_t sig = l->color;
+            sig = sig*31 + l->x;
+            sig = sig*31 + l->y;
+            sig = sig*31 + l->x2;
+            sig = sig*31 + l->y2;
+            sig = sig*31 + l->thickness;
+            sig = sig*31 + l->antialias;
+            return sig;
         }
     }
+    return 0;
 }
 
-static inline int blend_png(int value1, int value2, int alpha) {
-    int r = (0xFF-alpha)*value1 + alpha*value2;
-    return (r+1 + (r >> 8)) >> 8; // divide by 255
+void fb_item_damage(void *item)
+{
+    fb_item_header *it = item;
+    fb_item_pos p;
+
+    fb_items_lock();
+    fb_damage_add_pos(&fb_frame_damage, &it->drawn_pos);
+    if(fb_item_get_bounds(it, &p))
+        fb_damage_add_pos(&fb_frame_damage, &p);
+    fb_items_unlock();
 }
 
-void fb_draw_img(fb_img *i)
+void fb_damage_all(void)
 {
-    int y, x;
-    const int w = i->w*PIXEL_SIZE;
-    uint8_t alpha;
-    uint8_t *comps_img, *comps_bits;
-
-#if PIXEL_SIZE == 4
-    const uint8_t max_alpha = 0xFF;
-#elif PIXEL_SIZE == 2
-    const uint8_t max_alpha = 31;
-#endif
+    fb_items_lock();
+    fb_damage_set_full(&fb_frame_damage);
+    fb_items_unlock();
+}
 
-    int min_x, max_x, min_y, max_y;
-    clamp_to_parent(i, &min_x, &max_x, &min_y, &max_y);
-    const int rendered_w = max_x - min_x;
+// fb_ctx.mutex must be locked
+static void fb_ctx_collect_damage(void)
+{
+    fb_item_header *it;
+    fb_item_pos p;
+    uint32_t sig;
 
-    if(rendered_w <= 0)
-        return;
+    for(it = fb_ctx.first_item; it; it = it->next)
+    {
+        fb_item_get_bounds(it, &p);
+        sig = fb_item_get_sig(it);
 
-    px_type *bits = fb.buffer + (fb.stride*(i->y + min_y)) + i->x + min_x;
-    px_type *img = (px_type*)(((uint32_t*)i->data) + (min_y * i->w) + min_x);
+        if(sig == it->drawn_sig && memcmp(&p, &it->drawn_pos, sizeof(fb_item_pos)) == 0)
+            continue;
 
-    for(y = min_y; y < max_y; ++y)
-    {
-        for(x = min_x; x < max_x; ++x)
+        fb_damage_add_pos(&fb_frame_damage, &it->drawn_pos);
+        fb_damage_add_pos(&fb_frame_damage, &p);
+        if(it->layer)
         {
-            // Colors, 0xAABBGGRR
-#if PIXEL_SIZE == 4
-            alpha = PX_GET_A(*img);
-#elif PIXEL_SIZE == 2
-            alpha = ((uint8_t*)img)[2];
+            fb_damage_add_pos(&it->layer->cache->damage, &it->drawn_pos);
+            fb_damage_add_pos(&it->layer->cache->damage, &p);
+        }
+        it->drawn_pos = p;
+        it->drawn_sig = sig;
+    }
+}
+
+static void fb_draw_rect_clipped(fb_rect *r, const fb_item_pos *clip)
+{
+    const uint8_t alpha = (r->color >> 24) & 0xFF;
+    const px_type color = fb_convert_color(r->color);
+    int min_x, max_x, min_y, max_y;
+    fb_item_pos p, d;
+
+    if(alpha == 0)
+        return;
+
+    clamp_to_parent(r, clip, &min_x, &max_x, &min_y, &max_y);
+    p.x = r->x + min_x;
+    p.y = r->y + min_y;
+    p.w = max_x - min_x;
+    p.h = max_y - min_y;
+
+    if(p.w <= 0 || p.h <= 0)
+        return;
+
+    fb_pos_to_device(&p, &d);
+    fb_fill_device_rect(&d, color, alpha);
+}
+
+void fb_draw_rect(fb_rect *r)
+{
+    fb_draw_rect_clipped(r, &DEFAULT_FB_PARENT);
+}
+
+static inline void fb_draw_img_row(px_type *bits, const px_type *img, int len)
+{
+#ifdef MR_DISABLE_ALPHA
+    int x;
+    for(x = 0; x < len; ++x)
+    {
+  #if PIXEL_SIZE == 4
+        if(PX_GET_A(img[x]) != 0)
+            bits[x] = img[x];
+  #elif PIXEL_SIZE == 2
+        if(((uint8_t*)(img + x*2))[2] != 0)
+            bits[x] = img[x*2];
+  #endif
+    }
+#else
+    fb_blend_img_row(bits, img, len);
+#endif
+}
+
+static inline void fb_draw_coverage_row(px_type *bits, px_type color, const uint8_t *mask, int len)
+{
+#ifdef MR_DISABLE_ALPHA
+    int x;
+    for(x = 0; x < len; ++x)
+        if(mask[x] != 0)
+            bits[x] = color;
+#else
+    fb_blend_coverage_row(bits, color, mask, len);
 #endif
-            // fully opaque
-            if(alpha == max_alpha)
+}
+
+// Rotated images are read along the display's rows into a small buffer
+#define FB_IMG_GATHER_LEN 256
+
+static void fb_draw_img_clipped(fb_img *i, const fb_item_pos *clip)
+{
+    int x, y, col, len;
+    int min_x, max_x, min_y, max_y;
+    int src, col_step, row_step;
+    fb_item_pos p, d;
+    uint32_t row[FB_IMG_GATHER_LEN];
+    uint8_t mask_row[FB_IMG_GATHER_LEN];
+    const uint32_t *data = (const uint32_t*)i->data;
+    const uint8_t *mask = (const uint8_t*)i->data;
+    const uint32_t *s;
+    const uint8_t *m;
+    px_type *bits;
+
+    clamp_to_parent(i, clip, &min_x, &max_x, &min_y, &max_y);
+    p.x = i->x + min_x;
+    p.y = i->y + min_y;
+    p.w = max_x - min_x;
+    p.h = max_y - min_y;
+
+    if(p.w <= 0 || p.h <= 0)
+        return;
+
+    fb_pos_to_device(&p, &d);
+
+    // Image pixels are 32 bits in all formats and text pixels are 8 bits,
+    // see fb_img. Find the one drawn at the top left corner of d and how
+    // the image is walked along the display's rows and columns.
+    switch(fb_rotation)
+    {
+        default:
+        case 0:
+            src = min_y*i->w + min_x;
+            col_step = 1;
+            row_step = i->w;
+            break;
+        case 90:
+            src = (max_y - 1)*i->w + min_x;
+            col_step = -i->w;
+            row_step = 1;
+            break;
+        case 180:
+            src = (max_y - 1)*i->w + max_x - 1;
+            col_step = -1;
+            row_step = -i->w;
+            break;
+        case 270:
+            src = min_y*i->w + max_x - 1;
+            col_step = i->w;
+            row_step = -1;
+            break;
+    }
+
+    bits = fb_device_addr(d.x, d.y);
+    for(y = 0; y < d.h; ++y)
+    {
+        for(col = 0; col < d.w; col += len)
+        {
+            len = col_step == 1 ? d.w : imin(d.w - col, FB_IMG_GATHER_LEN);
+            if(i->img_type == FB_IMG_TYPE_TEXT)
             {
-                *bits = *img;
+                m = mask + src + col*col_step;
+                if(col_step != 1)
+                {
+                    for(x = 0; x < len; ++x)
+                        mask_row[x] = m[x*col_step];
+                    m = mask_row;
+                }
+                fb_draw_coverage_row(bits + col, i->color, m, len);
             }
-            // do the blending
-            else if(alpha != 0x00)
+            else
             {
-#ifdef MR_DISABLE_ALPHA
-                *bits = *img;
-#else
-  #if PIXEL_SIZE == 4
-                comps_bits = (uint8_t*)bits;
-                comps_img = (uint8_t*)img;
-                comps_bits[PX_IDX_R] = blend_png(comps_bits[PX_IDX_R], comps_img[PX_IDX_R], comps_img[PX_IDX_A]);
-                comps_bits[PX_IDX_G] = blend_png(comps_bits[PX_IDX_G], comps_img[PX_IDX_G], comps_img[PX_IDX_A]);
-                comps_bits[PX_IDX_B] = blend_png(comps_bits[PX_IDX_B], comps_img[PX_IDX_B], comps_img[PX_IDX_A]);
-                comps_bits[PX_IDX_A] = 0xFF;
-  #else
-                const uint8_t alpha5b = alpha;
-                const uint8_t alpha6b = ((uint8_t*)img)[3];
-                *bits = (((31-alpha5b)*(*bits & 0x1F)            + (alpha5b*(*img & 0x1F))) / 31) |
-                        ((((63-alpha6b)*((*bits & 0x7E0) >> 5)   + (alpha6b*((*img & 0x7E0) >> 5))) / 63) << 5) |
-                        ((((31-alpha5b)*((*bits & 0xF800) >> 11) + (alpha5b*((*img & 0xF800) >> 11))) / 31) << 11);
-  #endif // PIXEL_SIZE
-#endif // MR_DISABLE_ALPHA
+                s = data + src + col*col_step;
+                if(col_step != 1)
+                {
+                    for(x = 0; x < len; ++x)
+                        row[x] = s[x*col_step];
+                    s = row;
+                }
+                fb_draw_img_row(bits + col, (const px_type*)s, len);
             }
+        }
+        bits += fb_target.stride;
+        src += row_step;
+    }
+}
 
-            ++bits;
-#if PIXEL_SIZE == 4
-            ++img;
-#elif PIXEL_SIZE == 2
-            img += 2;
+void fb_draw_img(fb_img *i)
+{
+    fb_draw_img_clipped(i, &DEFAULT_FB_PARENT);
+}
+
+// Blends len pixels of logical row y with color, scaled by per-pixel
+// coverage from mask. mask can be NULL for a fully covered span.
+static void fb_blend_span(int x, int y, int len, px_type color, uint8_t alpha, const uint8_t *mask)
+{
+    int i;
+    fb_item_pos p, d;
+#ifndef MR_DISABLE_ALPHA
+    px_type *dst;
+#endif
+
+    if(len <= 0)
+        return;
+
+    if(!mask)
+    {
+        p.x = x;
+        p.y = y;
+        p.w = len;
+        p.h = 1;
+        fb_pos_to_device(&p, &d);
+        fb_fill_device_rect(&d, color, alpha);
+        return;
+    }
+
+#ifdef MR_DISABLE_ALPHA
+    for(i = 0; i < len; ++i)
+        if(mask[i] >= 0x80)
+            *fb_px_addr(x + i, y) = color;
+#else
+    dst = fb_px_addr(x, y);
+    if(fb_target.step_x == 1)
+        fb_blend_mask_row(dst, color, alpha, mask, len);
+    else
+    {
+        for(i = 0; i < len; ++i, dst += fb_target.step_x)
+            fb_blend_mask_row(dst, color, alpha, mask + i, 1);
+    }
 #endif
+}
+
+static int64_t isqrt64(int64_t v)
+{
+    int64_t res = 0, bit = 1LL << 62;
+
+    while(bit > v)
+        bit >>= 2;
+
+    while(bit != 0)
+    {
+        if(v >= res + bit)
+        {
+            v -= res + bit;
+            res = (res >> 1) + bit;
         }
-        bits += fb.stride - rendered_w;
-        img = (px_type*)(((uint32_t*)img) + (i->w - rendered_w));
+        else
+            res >>= 1;
+        bit >>= 2;
     }
+    return res;
 }
 
-// from http://members.chello.at/~easyfilter/bresenham.html
-void fb_draw_line(fb_line *l)
+static inline int64_t floor_div(int64_t n, int64_t d)
+{
+    int64_t q = n / d;
+    if((n % d) != 0 && ((n < 0) != (d < 0)))
+        --q;
+    return q;
+}
+
+// Narrows [*from, *to] down to the values of x for which lo <= a*x + b <= hi
+static void fb_line_solve(int64_t a, int64_t b, int64_t lo, int64_t hi, int *from, int *to)
+{
+    int64_t x_lo, x_hi;
+
+    if(a == 0)
+    {
+        if(b < lo || b > hi)
+            *to = *from - 1;
+        return;
+    }
+
+    if(a > 0)
+    {
+        x_lo = -floor_div(b - lo, a);
+        x_hi = floor_div(hi - b, a);
+    }
+    else
+    {
+        x_lo = -floor_div(hi - b, -a);
+        x_hi = floor_div(b - lo, -a);
+    }
+
+    if(x_lo > *from)
+        *from = x_lo;
+    if(x_hi < *to)
+        *to = x_hi;
+}
+
+enum
+{
+    CS_LEFT   = 0x01,
+    CS_RIGHT  = 0x02,
+    CS_TOP    = 0x04,
+    CS_BOTTOM = 0x08,
+};
+
+static int fb_line_outcode(int x, int y, const fb_item_pos *r)
 {
-    const px_type px = fb_convert_color(l->color);
+    int res = 0;
+    if(x < r->x)
+        res |= CS_LEFT;
+    else if(x >= r->x + r->w)
+        res |= CS_RIGHT;
+    if(y < r->y)
+        res |= CS_TOP;
+    else if(y >= r->y + r->h)
+        res |= CS_BOTTOM;
+    return res;
+}
+
+// Cohen-Sutherland, returns 0 if the segment lies outside of r
+static int fb_line_clip(int *x0, int *y0, int *x1, int *y1, const fb_item_pos *r)
+{
+    int code0 = fb_line_outcode(*x0, *y0, r);
+    int code1 = fb_line_outcode(*x1, *y1, r);
+    int code, x, y;
+
+    while(1)
+    {
+        if(!(code0 | code1))
+            return 1;
+        if(code0 & code1)
+            return 0;
+
+        code = code0 ? code0 : code1;
+        if(code & CS_TOP)
+        {
+            y = r->y;
+            x = *x0 + (int64_t)(*x1 - *x0)*(y - *y0)/(*y1 - *y0);
+        }
+        else if(code & CS_BOTTOM)
+        {
+            y = r->y + r->h - 1;
+            x = *x0 + (int64_t)(*x1 - *x0)*(y - *y0)/(*y1 - *y0);
+        }
+        else if(code & CS_LEFT)
+        {
+            x = r->x;
+            y = *y0 + (int64_t)(*y1 - *y0)*(x - *x0)/(*x1 - *x0);
+        }
+        else
+        {
+            x = r->x + r->w - 1;
+            y = *y0 + (int64_t)(*y1 - *y0)*(x - *x0)/(*x1 - *x0);
+        }
 
-    int x0 = imin(imax(l->x, l->parent->x), l->parent->x + l->parent->w);
-    int x1 = imin(imax(l->x2, l->parent->x), l->parent->x + l->parent->w);
-    int y0 = imin(imax(l->y, l->parent->y), l->parent->y + l->parent->h);
-    int y1 = imin(imax(l->y2, l->parent->y), l->parent->y + l->parent->h);
+        if(code == code0)
+        {
+            *x0 = x;
+            *y0 = y;
+            code0 = fb_line_outcode(x, y, r);
+        }
+        else
+        {
+            *x1 = x;
+            *y1 = y;
+            code1 = fb_line_outcode(x, y, r);
+        }
+    }
+}
 
-    int dx = abs(x1-x0);
-    int dy = abs(y1-y0);
-    const int sx = x0 < x1 ? 1 : -1;
-    const int sy = y0 < y1 ? 1 : -1;
+static inline int64_t line_abs64(int64_t v)
+{
+    return v < 0 ? -v : v;
+}
 
-    int err;
-    double e2 = sqrt((double)(dx*dx) + (double)(dy*dy));
+static inline uint8_t line_coverage(int64_t v, int64_t scale)
+{
+    if(v <= 0)
+        return 0;
+    if(v >= scale)
+        return 0xFF;
+    return (v*0xFF)/scale;
+}
 
-    if(e2 == 0.0)
+// Rasterizes the line as a rectangle thickness wide, centered on the
+// segment between the two pixel centers. For pixel [x, y]:
+//   t = ([x, y] - start) . d = distance along the segment * len
+//   s = ([x, y] - start) x d = distance from the segment * len
+// where d is the direction and len its length. Both are linear in x,
+// so every row is one span. With antialias, coverage falls off over
+// one pixel at the edges and half a pixel past the end points.
+static void fb_draw_line_clipped(fb_line *l, const fb_item_pos *clip)
+{
+    const uint8_t alpha = (l->color >> 24) & 0xFF;
+    const px_type color = fb_convert_color(l->color);
+    int x0 = l->x, y0 = l->y, x1 = l->x2, y1 = l->y2;
+    int cx0, cy0, cx1, cy1;
+    int y, from, to, in_from, in_to, margin;
+    int64_t dx, dy, len2, len, w2, bt, bs;
+    fb_item_pos area, ext, p, d;
+    uint8_t cov[FB_IMG_GATHER_LEN];
+
+    if(alpha == 0 || l->thickness <= 0 || !fb_pos_intersect(l->parent, clip, &area))
         return;
 
-    dx *= 255/e2;
-    dy *= 255/e2;
-    double th = 255*((double)(l->thickness - 1));
+    // draw the same pixels no matter which end the line starts at
+    if(x1 < x0 || (x1 == x0 && y1 < y0))
+    {
+        x0 = l->x2; y0 = l->y2;
+        x1 = l->x;  y1 = l->y;
+    }
+
+    dx = x1 - x0;
+    dy = y1 - y0;
+    len2 = dx*dx + dy*dy;
+    if(len2 == 0)
+        return;
+    len = isqrt64(len2);
+    w2 = isqrt64(len2*l->thickness*l->thickness); // 2 * half width * len
+
+    // Only rows around the visible part of the segment can be affected
+    margin = l->thickness/2 + 2;
+    ext.x = area.x - margin;
+    ext.y = area.y - margin;
+    ext.w = area.w + margin*2;
+    ext.h = area.h + margin*2;
+    cx0 = x0; cy0 = y0; cx1 = x1; cy1 = y1;
+    if(!fb_line_clip(&cx0, &cy0, &cx1, &cy1, &ext))
+        return;
 
-    if(dx < dy)
+    if(!l->antialias && (dx == 0 || dy == 0))
     {
-        x1 = (e2+th/2) / dy;
-        err = x1*dy - th/2;
-        for(x0 -= x1*sx; ; y0 += sy)
+        // axis-aligned lines are a single rectangle
+        int x_from = area.x, x_to = area.x + area.w - 1;
+        int y_from = area.y, y_to = area.y + area.h - 1;
+
+        if(dy == 0)
         {
-            x1 = x0;
-            for(e2 = dy-err-th; e2+dy < 255; e2 += dy)
-            {
-                x1 += sx;
-                *(fb.buffer + fb.stride*y0 + x1) = px;
-            }
-            if(y0 == y1)
-                break;
-            err += dx;
-            if(err > 255)
-            {
-                err -= dy;
-                x0 += sx;
-            }
+            fb_line_solve(dx, -(int64_t)x0*dx, 0, len2, &x_from, &x_to);
+            fb_line_solve(-2*dx, 2*(int64_t)y0*dx, -w2 + 1, w2, &y_from, &y_to);
+        }
+        else
+        {
+            fb_line_solve(2*dy, -2*(int64_t)x0*dy, -w2 + 1, w2, &x_from, &x_to);
+            fb_line_solve(dy, -(int64_t)y0*dy, 0, len2, &y_from, &y_to);
         }
+
+        p.x = x_from;
+        p.y = y_from;
+        p.w = x_to - x_from + 1;
+        p.h = y_to - y_from + 1;
+        if(p.w > 0 && p.h > 0)
+        {
+            fb_pos_to_device(&p, &d);
+            fb_fill_device_rect(&d, color, alpha);
+        }
+        return;
     }
-    else
+
+    for(y = imax(imin(cy0, cy1) - margin, area.y); y <= imin(imax(cy0, cy1) + margin, area.y + area.h - 1); ++y)
     {
-        y1 = (e2 + th/2) / dx;
-        err = y1*dx - th/2;
-        for(y0 -= y1*sy; ; x0 += sx)
+        // t = dx*x + bt, 2*s = 2*dy*x + bs
+        bt = -(int64_t)x0*dx + (y - y0)*dy;
+        bs = -2*((int64_t)x0*dy + (y - y0)*dx);
+
+        from = area.x;
+        to = area.x + area.w - 1;
+
+        if(!l->antialias)
+        {
+            fb_line_solve(dx, bt, 0, len2, &from, &to);
+            fb_line_solve(2*dy, bs, -w2 + 1, w2, &from, &to);
+            fb_blend_span(from, y, to - from + 1, color, alpha, NULL);
+            continue;
+        }
+
+        fb_line_solve(dx, bt, -len + 1, len2 + len - 1, &from, &to);
+        fb_line_solve(2*dy, bs, -w2 - len + 1, w2 + len - 1, &from, &to);
+        if(from > to)
+            continue;
+
+        // fully covered middle of the span
+        in_from = from;
+        in_to = to;
+        fb_line_solve(dx, bt, 0, len2, &in_from, &in_to);
+        fb_line_solve(2*dy, bs, -w2 + len, w2 - len, &in_from, &in_to);
+        if(in_from > in_to)
+            in_from = in_to = to + 1;
+        else
+            fb_blend_span(in_from, y, in_to - in_from + 1, color, alpha, NULL);
+
+        // edges, left of the middle and right of it
+        while(from <= to)
         {
-            y1 = y0;
-            for(e2 = dx - err - th; e2+dx < 255; e2 += dx)
+            int x, n;
+            int64_t t, s2;
+            uint8_t c;
+
+            if(from == in_from)
             {
-                y1 += sy;
-                *(fb.buffer + fb.stride*y1 + x0) = px;
+                from = in_to + 1;
+                continue;
             }
 
-            if(x0 == x1)
-                break;
-            err += dy;
-            if(err > 255)
+            n = imin(FB_IMG_GATHER_LEN, (from < in_from ? in_from : to + 1) - from);
+            for(x = 0; x < n; ++x)
             {
-                err -= dx;
-                y0 += sy;
+                t = dx*(from + x) + bt;
+                s2 = line_abs64(2*dy*(from + x) + bs);
+                c = line_coverage(w2 + len - s2, 2*len);
+                c = imin(c, line_coverage(t + len, len));
+                c = imin(c, line_coverage(len2 - t + len, len));
+                cov[x] = c;
             }
+            fb_blend_span(from, y, n, color, alpha, cov);
+            from += n;
+        }
+    }
+}
+
+void fb_draw_line(fb_line *l)
+{
+    fb_draw_line_clipped(l, &DEFAULT_FB_PARENT);
+}
+
+// Draws span [from, to) of the shape's row, clipped to [min_x, max_x).
+// All values are relative to the shape's x.
+static inline void fb_shape_span_clipped(fb_shape *s, int y, int from, int to, int min_x, int max_x,
+        px_type color, uint8_t alpha, const uint8_t *mask)
+{
+    const int start = imax(from, min_x);
+    const int end = imin(to, max_x);
+
+    if(start < end)
+        fb_blend_span(s->x + start, s->y + y, end - start, color, alpha, mask ? mask + (start - from) : NULL);
+}
+
+static void fb_draw_shape_clipped(fb_shape *s, const fb_item_pos *clip)
+{
+    const uint8_t alpha = (s->color >> 24) & 0xFF;
+    const px_type color = fb_convert_color(s->color);
+    const fb_shape_mask *m = s->mask;
+    const int c = m->size;
+    int min_x, max_x, min_y, max_y;
+    int y, cy, start, solid, left_end, right_start;
+    fb_item_pos p, d;
+
+    if(alpha == 0)
+        return;
+
+    clamp_to_parent(s, clip, &min_x, &max_x, &min_y, &max_y);
+    if(min_x >= max_x || min_y >= max_y)
+        return;
+
+    // rows between the top and bottom corners are one solid block
+    p.x = s->x + min_x;
+    p.y = s->y + imax(min_y, c);
+    p.w = max_x - min_x;
+    p.h = imin(max_y, s->h - c) - (p.y - s->y);
+    if(p.h > 0)
+    {
+        fb_pos_to_device(&p, &d);
+        fb_fill_device_rect(&d, color, alpha);
+    }
+
+    for(y = min_y; y < max_y; ++y)
+    {
+        if(y >= c && y < s->h - c)
+        {
+            y = s->h - c - 1;
+            continue;
         }
+
+        cy = (y < c) ? y : s->h - 1 - y;
+        start = m->span_start[cy];
+        solid = m->span_solid[cy];
+
+        // left corner, solid middle and the mirrored right corner. Narrow
+        // shapes have their corners overlap, the left one wins.
+        left_end = imin(c, s->w);
+        right_start = imax(s->w - c, left_end);
+
+        fb_shape_span_clipped(s, y, start, imin(solid, left_end), min_x, max_x,
+                color, alpha, m->coverage + cy*c + start);
+        fb_shape_span_clipped(s, y, solid, s->w - solid, min_x, max_x, color, alpha, NULL);
+
+        right_start = imax(s->w - solid, right_start);
+        fb_shape_span_clipped(s, y, right_start, s->w - start, min_x, max_x,
+                color, alpha, m->coverage_mirrored + cy*c + right_start - (s->w - c));
+    }
+}
+
+void fb_draw_shape(fb_shape *s)
+{
+    fb_draw_shape_clipped(s, &DEFAULT_FB_PARENT);
+}
+
+static void fb_draw_layer_clipped(fb_layer *l, const fb_item_pos *clip)
+{
+    const struct fb_layer_cache *c = l->cache;
+    const px_type *src;
+    px_type *dst;
+    fb_item_pos p, d;
+    int y;
+
+    if(!c->surface || !fb_pos_intersect(&c->pos, clip, &p))
+        return;
+
+    fb_pos_to_device(&p, &d);
+    dst = fb_device_addr(d.x, d.y);
+    src = c->surface + (d.y - c->dev.y)*c->dev.w + (d.x - c->dev.x);
+    for(y = 0; y < d.h; ++y)
+    {
+        memcpy(dst, src, d.w*PIXEL_SIZE);
+        dst += fb_target.stride;
+        src += c->dev.w;
     }
 }
 
@@ -904,24 +1840,40 @@ fb_img* fb_add_png_img_lvl(int level, int x, int y, int w, int h, const char *pa
     if(!data)
         return NULL;
 
-    return fb_add_img(level, x, y, w, h, FB_IMG_TYPE_PNG, data);
+    fb_img *result = fb_add_img(level, x, y, w, h, FB_IMG_TYPE_PNG, data);
+    result->opaque = fb_png_is_opaque(data);
+    return result;
+}
+
+static fb_shape *fb_add_shape(int level, int x, int y, int w, int h, int radius2, uint32_t color)
+{
+    fb_shape *res = mzalloc(sizeof(fb_shape));
+    res->id = fb_generate_item_id();
+    res->type = FB_IT_SHAPE;
+    res->parent = &DEFAULT_FB_PARENT;
+    res->level = level;
+    res->x = x;
+    res->y = y;
+    res->w = w;
+    res->h = h;
+    res->color = color;
+    res->radius2 = radius2;
+    res->mask = fb_shape_mask_get(radius2);
+    fb_ctx_add_item(res);
+    return res;
 }
 
 fb_circle *fb_add_circle_lvl(int level, int x, int y, int radius, uint32_t color)
 {
+    // centered on a pixel, so it is diameter+1 wide
     const int diameter = radius*2 + 1;
-    uint32_t *data = mzalloc(diameter * diameter * 4);
-    uint32_t px = fb_convert_color_img(color);
-
-    int rx, ry;
-    const int radius_check = radius*radius + radius*0.8;
-
-    for(ry = -radius; ry <= radius; ++ry)
-        for(rx = -radius; rx <= radius; ++rx)
-            if(rx*rx+ry*ry <= radius_check)
-                *(data + diameter*(radius + ry) + (radius+rx)) = px;
+    return fb_add_shape(level, x, y, diameter, diameter, diameter, color);
+}
 
-    return fb_add_img(level, x, y, diameter, diameter, FB_IMG_TYPE_GENERIC, data);
+fb_rrect *fb_add_rrect_lvl(int level, int x, int y, int w, int h, int radius, uint32_t color)
+{
+    const int radius2 = imax(1, imin(radius*2, imin(w, h)));
+    return fb_add_shape(level, x, y, w, h, radius2, color);
 }
 
 fb_line *fb_add_line_lvl(int level, int x1, int y1, int x2, int y2, int thickness, uint32_t color)
@@ -964,9 +1916,23 @@ void fb_rm_img(fb_img *i)
     fb_destroy_item(i);
 }
 
+static void fb_rm_shape(fb_shape *s)
+{
+    if(!s)
+        return;
+
+    fb_ctx_rm_item(s);
+    fb_destroy_item(s);
+}
+
 void fb_rm_circle(fb_circle *c)
 {
-    fb_rm_img(c);
+    fb_rm_shape(c);
+}
+
+void fb_rm_rrect(fb_rrect *r)
+{
+    fb_rm_shape(r);
 }
 
 void fb_rm_line(fb_line *l)
@@ -978,53 +1944,606 @@ void fb_rm_line(fb_line *l)
     fb_destroy_item(l);
 }
 
-void fb_clear(void)
+fb_layer *fb_add_layer_lvl(int level, int x, int y, int w, int h, uint32_t background)
 {
-    pthread_mutex_lock(&fb_ctx.mutex);
-    fb_item_header *it, *next;
-    for(it = fb_ctx.first_item; it; it = next)
-    {
-        next = it->next;
-        fb_destroy_item(it);
-    }
-    fb_ctx.first_item = NULL;
-    pthread_mutex_unlock(&fb_ctx.mutex);
+    fb_layer *res = mzalloc(sizeof(fb_layer));
+    res->id = fb_generate_item_id();
+    res->type = FB_IT_LAYER;
+    res->parent = &DEFAULT_FB_PARENT;
+    res->level = level;
+    res->x = x;
+    res->y = y;
+    res->w = w;
+    res->h = h;
+    // the surface is copied over whatever is below the layer
+    res->background = background | 0xFF000000;
+    res->cache = mzalloc(sizeof(struct fb_layer_cache));
+    fb_ctx_add_item(res);
+    return res;
+}
 
-    fb_png_drop_unused();
-    fb_text_drop_cache_unused();
+// fb_ctx.mutex must be locked
+static int fb_layer_adopt(fb_layer *layer, fb_item_header *it)
+{
+    if(it->layer || it->type == FB_IT_LAYER || it->type == FB_IT_LISTVIEW)
+        return -1;
+
+    it->layer = layer;
+    // it was drawn straight to the screen until now
+    fb_damage_add_pos(&fb_frame_damage, &it->drawn_pos);
+    fb_damage_add_pos(&layer->cache->damage, &it->drawn_pos);
+    return 0;
 }
 
-static void fb_draw(void)
+int fb_layer_add_item(fb_layer *layer, void *item)
 {
-    uint32_t i;
+    int res;
+#ifndef NDEBUG
     fb_item_header *it;
+#endif
 
-    fb_fill(fb_ctx.background_color);
+    if(!item)
+        return -1;
 
-    fb_batch_start();
+    fb_items_lock();
+#ifndef NDEBUG
+    // fb_rm_layer() could not reach it to clear its layer otherwise
+    for(it = fb_ctx.first_item; it && it != item; it = it->next);
+    assert(it);
+#endif
+    res = fb_layer_adopt(layer, item);
+    fb_items_unlock();
+    return res;
+}
+
+static int fb_ptr_cmp(const void *a, const void *b)
+{
+    const uintptr_t pa = (uintptr_t)*(void**)a;
+    const uintptr_t pb = (uintptr_t)*(void**)b;
+    return pa < pb ? -1 : pa > pb;
+}
+
+int fb_layer_add_items(fb_layer *layer, void *items)
+{
+    fb_item_header *it;
+    void **sorted;
+    int cnt, res = 0;
+
+    cnt = list_item_count(items);
+    if(cnt == 0)
+        return 0;
+
+    // the list may hold things which aren't fb items, so it is never
+    // dereferenced: the context's items are looked up in it instead
+    sorted = malloc(cnt*sizeof(void*));
+    memcpy(sorted, items, cnt*sizeof(void*));
+    qsort(sorted, cnt, sizeof(void*), fb_ptr_cmp);
+
+    fb_items_lock();
+    for(it = fb_ctx.first_item; it; it = it->next)
+    {
+        if(bsearch(&it, sorted, cnt, sizeof(void*), fb_ptr_cmp) && fb_layer_adopt(layer, it) == 0)
+            ++res;
+    }
+    fb_items_unlock();
+
+    free(sorted);
+    return res;
+}
+
+void fb_layer_rm_item(fb_layer *layer, void *item)
+{
+    fb_item_header *it;
+
+    fb_items_lock();
+    for(it = fb_ctx.first_item; it && it != item; it = it->next);
+
+    if(it && it->layer == layer)
+    {
+        it->layer = NULL;
+        fb_damage_add_pos(&fb_frame_damage, &it->drawn_pos);
+        fb_damage_add_pos(&layer->cache->damage, &it->drawn_pos);
+    }
+    fb_items_unlock();
+}
+
+void fb_layer_invalidate(fb_layer *layer)
+{
+    fb_items_lock();
+    fb_damage_add_pos(&fb_frame_damage, &layer->drawn_pos);
+    fb_damage_add_pos(&layer->cache->damage, &layer->drawn_pos);
+    fb_items_unlock();
+}
+
+void fb_rm_layer(fb_layer *l)
+{
+    fb_item_header *it;
+
+    if(!l)
+        return;
+
+    // the members stay and are drawn on their own again
+    fb_items_lock();
     for(it = fb_ctx.first_item; it; it = it->next)
     {
-        switch(it->type)
+        if(it->layer == l)
         {
-            case FB_IT_RECT:
-                fb_draw_rect((fb_rect*)it);
-                break;
-            case FB_IT_IMG:
-                fb_draw_img((fb_img*)it);
-                break;
-            case FB_IT_LISTVIEW:
-                listview_update_ui_args((listview*)it, 1, 1);
-                break;
-            case FB_IT_LINE:
-                fb_draw_line((fb_line*)it);
-                break;
+            it->layer = NULL;
+            fb_damage_add_pos(&fb_frame_damage, &it->drawn_pos);
+        }
+    }
+    fb_items_unlock();
+
+    fb_ctx_rm_item(l);
+    fb_destroy_item(l);
+}
+
+void fb_clear(void)
+{
+    pthread_mutex_lock(&fb_ctx.mutex);
+    fb_item_header *it, *next;
+    for(it = fb_ctx.first_item; it; it = next)
+    {
+        next = it->next;
+        anim_cancel_for(it, 0);
+        fb_retire_item(it);
+    }
+    fb_ctx.first_item = fb_ctx.last_item = NULL;
+    fb_ctx.item_count = 0;
+    free(fb_ctx.levels);
+    fb_ctx.levels = NULL;
+    fb_ctx.levels_cnt = 0;
+    fb_damage_set_full(&fb_frame_damage);
+
+    // the frame which is being rendered can still use the cached data
+    while(fb_scene.rendering)
+        pthread_cond_wait(&fb_scene_done_cond, &fb_ctx.mutex);
+    pthread_mutex_unlock(&fb_ctx.mutex);
+
+    fb_png_drop_unused();
+    fb_text_drop_cache_unused();
+}
+
+static void fb_draw_item_clipped(fb_item_header *it, const fb_item_pos *clip)
+{
+    switch(it->type)
+    {
+        case FB_IT_RECT:
+            fb_draw_rect_clipped((fb_rect*)it, clip);
+            break;
+        case FB_IT_IMG:
+            fb_draw_img_clipped((fb_img*)it, clip);
+            break;
+        case FB_IT_LINE:
+            fb_draw_line_clipped((fb_line*)it, clip);
+            break;
+        case FB_IT_SHAPE:
+            fb_draw_shape_clipped((fb_shape*)it, clip);
+            break;
+        case FB_IT_LAYER:
+            fb_draw_layer_clipped((fb_layer*)it, clip);
+            break;
+    }
+}
+
+static int fb_item_is_opaque(fb_item_header *it)
+{
+    switch(it->type)
+    {
+        case FB_IT_LAYER:
+            return 1;
+        case FB_IT_RECT:
+#ifdef MR_DISABLE_ALPHA
+            return (((fb_rect*)it)->color >> 24) != 0;
+#else
+            return (((fb_rect*)it)->color >> 24) == 0xFF;
+#endif
+        case FB_IT_IMG:
+            return ((fb_img*)it)->opaque;
+    }
+    return 0;
+}
+
+// Largest opaque areas of the items, used to skip drawing of anything
+// they cover completely.
+#define FB_MAX_OCCLUDERS 8
+
+typedef struct
+{
+    fb_item_pos pos;
+    int idx; // position of the item in the list
+} fb_occluder;
+
+typedef struct
+{
+    fb_occluder occ[FB_MAX_OCCLUDERS];
+    int count;
+} fb_occluders;
+
+static void fb_occluders_add(fb_occluders *o, const fb_item_pos *pos, int idx)
+{
+    int i, smallest = 0;
+
+    if(o->count < FB_MAX_OCCLUDERS)
+    {
+        o->occ[o->count].pos = *pos;
+        o->occ[o->count].idx = idx;
+        ++o->count;
+        return;
+    }
+
+    for(i = 1; i < o->count; ++i)
+        if(o->occ[i].pos.w*o->occ[i].pos.h < o->occ[smallest].pos.w*o->occ[smallest].pos.h)
+            smallest = i;
+
+    if(pos->w*pos->h > o->occ[smallest].pos.w*o->occ[smallest].pos.h)
+    {
+        o->occ[smallest].pos = *pos;
+        o->occ[smallest].idx = idx;
+    }
+}
+
+// Is pos covered by an opaque item which is drawn after the item at idx?
+static int fb_occluders_hide(fb_occluders *o, const fb_item_pos *pos, int idx)
+{
+    int i;
+    const fb_item_pos *p;
+
+    for(i = 0; i < o->count; ++i)
+    {
+        p = &o->occ[i].pos;
+        if(o->occ[i].idx > idx && pos->x >= p->x && pos->y >= p->y &&
+            pos->x + pos->w <= p->x + p->w && pos->y + pos->h <= p->y + p->h)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Size of the item's struct, 0 for items which aren't drawn
+static size_t fb_item_size(fb_item_header *it)
+{
+    switch(it->type)
+    {
+        case FB_IT_RECT:
+            return sizeof(fb_rect);
+        case FB_IT_IMG:
+            return sizeof(fb_img);
+        case FB_IT_LINE:
+            return sizeof(fb_line);
+        case FB_IT_SHAPE:
+            return sizeof(fb_shape);
+        case FB_IT_LAYER:
+            return sizeof(fb_layer);
+    }
+    return 0;
+}
+
+// the copies in the arena are kept aligned
+#define FB_SCENE_ALIGN(size) (((size) + 7) & ~((size_t)7))
+
+// Prepares the layer's surface for this frame and queues the parts
+// of it which must be re-rendered. fb_ctx.mutex must be locked.
+static void fb_scene_add_layer(fb_layer *l)
+{
+    struct fb_layer_cache *c = l->cache;
+    fb_scene_layer *sl;
+
+    if(l->drawn_pos.w <= 0 || l->drawn_pos.h <= 0)
+        return;
+
+    if(c->background != l->background || memcmp(&c->pos, &l->drawn_pos, sizeof(fb_item_pos)) != 0)
+    {
+        c->pos = l->drawn_pos;
+        fb_pos_to_device(&c->pos, &c->dev);
+        if(c->dev.w*c->dev.h > c->surface_size)
+        {
+            free(c->surface);
+            c->surface_size = c->dev.w*c->dev.h;
+            c->surface = malloc(c->surface_size*PIXEL_SIZE);
         }
+        c->background = l->background;
+        fb_damage_clear(&c->damage);
+        fb_damage_add_pos(&c->damage, &c->pos);
     }
+
+    if(fb_damage_is_empty(&c->damage))
+        return;
+
+    if(fb_scene.layers_cnt == fb_scene.layers_alloc)
+    {
+        fb_scene.layers_alloc = imax(4, fb_scene.layers_alloc*2);
+        fb_scene.layers = realloc(fb_scene.layers, fb_scene.layers_alloc*sizeof(fb_scene_layer));
+    }
+
+    sl = &fb_scene.layers[fb_scene.layers_cnt++];
+    sl->layer = l;
+    sl->background = l->background;
+    sl->damage = c->damage;
+    fb_damage_clear(&c->damage);
+}
+
+static int fb_scene_needs_item(fb_item_header *it, const fb_damage *damage)
+{
+    int i;
+
+    if(fb_item_size(it) == 0)
+        return 0;
+
+    if(!it->layer)
+        return fb_damage_intersects(damage, &it->drawn_pos);
+
+    for(i = 0; i < fb_scene.layers_cnt; ++i)
+        if(fb_scene.layers[i].layer == it->layer)
+            return fb_damage_intersects(&fb_scene.layers[i].damage, &it->drawn_pos);
+    return 0;
+}
+
+// fb_ctx.mutex must be locked
+static void fb_scene_build(const fb_damage *damage)
+{
+    fb_item_header *it;
+    fb_scene_item *si;
+    size_t size = 0, off = 0;
+    int cnt = 0;
+
+    // layers go first, their damage decides which members are needed
+    fb_scene.layers_cnt = 0;
+    for(it = fb_ctx.first_item; it; it = it->next)
+    {
+        if(it->type == FB_IT_LAYER)
+            fb_scene_add_layer((fb_layer*)it);
+    }
+
+    for(it = fb_ctx.first_item; it; it = it->next)
+    {
+        if(fb_scene_needs_item(it, damage))
+        {
+            size += FB_SCENE_ALIGN(fb_item_size(it));
+            ++cnt;
+        }
+    }
+
+    if(size > fb_scene.arena_size)
+    {
+        fb_scene.arena_size = size*3/2;
+        fb_scene.arena = realloc(fb_scene.arena, fb_scene.arena_size);
+    }
+
+    if(cnt > fb_scene.items_alloc)
+    {
+        fb_scene.items_alloc = cnt*3/2;
+        fb_scene.items = realloc(fb_scene.items, fb_scene.items_alloc*sizeof(fb_scene_item));
+    }
+
+    fb_scene.items_cnt = 0;
+    for(it = fb_ctx.first_item; it; it = it->next)
+    {
+        if(!fb_scene_needs_item(it, damage))
+            continue;
+
+        si = &fb_scene.items[fb_scene.items_cnt++];
+        si->it = (fb_item_header*)(fb_scene.arena + off);
+        memcpy(si->it, it, fb_item_size(it));
+        off += FB_SCENE_ALIGN(fb_item_size(it));
+
+        // parents are often other widgets which keep moving
+        if(it->parent != &DEFAULT_FB_PARENT)
+        {
+            si->parent = *it->parent;
+            si->it->parent = &si->parent;
+        }
+    }
+
+    fb_scene.background_color = fb_ctx.background_color;
+    fb_scene.rendering = 1;
+}
+
+// Frees whatever was waiting for the frame to finish
+static void fb_scene_release(void)
+{
+    void **dead_items, **dead_data;
+
+    fb_items_lock();
+    fb_scene.rendering = 0;
+    dead_items = fb_scene.dead_items;
+    dead_data = fb_scene.dead_data;
+    fb_scene.dead_items = NULL;
+    fb_scene.dead_data = NULL;
+    pthread_cond_broadcast(&fb_scene_done_cond);
+    fb_items_unlock();
+
+    list_clear(&dead_items, &fb_free_item);
+    list_clear(&dead_data, &free);
+}
+
+void fb_defer_free(void *data)
+{
+    if(fb_scene.rendering)
+        list_add(&fb_scene.dead_data, data);
+    else
+        free(data);
+}
+
+static void fb_draw_clipped(const fb_item_pos *clip, UNUSED void *data)
+{
+    fb_item_header *it;
+    fb_item_pos p;
+    fb_occluders occ;
+    int idx, first = 0;
+    uint32_t items = 0, blended_px = 0;
+
+    occ.count = 0;
+
+    // Go from the top item down, collect opaque areas and find the top-most
+    // item which covers whole clip - nothing below it is visible.
+    for(idx = fb_scene.items_cnt-1; idx >= 0; --idx)
+    {
+        it = fb_scene.items[idx].it;
+        if(it->layer || !fb_item_is_opaque(it) || !fb_pos_intersect(&it->drawn_pos, clip, &p))
+            continue;
+
+        if(p.w == clip->w && p.h == clip->h)
+        {
+            first = idx;
+            break;
+        }
+        fb_occluders_add(&occ, &p, idx);
+    }
+
+    if(idx < 0)
+        fb_fill_pos(clip, fb_convert_color(fb_scene.background_color));
+
+    for(idx = first; idx < fb_scene.items_cnt; ++idx)
+    {
+        it = fb_scene.items[idx].it;
+        if(it->layer || !fb_pos_intersect(&it->drawn_pos, clip, &p) || fb_occluders_hide(&occ, &p, idx))
+            continue;
+
+        fb_draw_item_clipped(it, clip);
+
+        ++items;
+        if(!fb_item_is_opaque(it))
+            blended_px += p.w*p.h;
+    }
+
+    fb_stats_add_items(items, blended_px);
+}
+
+// Renders the damaged parts of the layer's members into fb_target
+static void fb_layer_render_band(const fb_item_pos *clip, void *data)
+{
+    fb_scene_layer *sl = data;
+    fb_item_header *it;
+    fb_item_pos p;
+    int i;
+    uint32_t items = 0, blended_px = 0;
+
+    fb_fill_pos(clip, fb_convert_color(sl->background));
+
+    for(i = 0; i < fb_scene.items_cnt; ++i)
+    {
+        it = fb_scene.items[i].it;
+        if(it->layer != sl->layer || !fb_pos_intersect(&it->drawn_pos, clip, &p))
+            continue;
+
+        fb_draw_item_clipped(it, clip);
+
+        ++items;
+        if(!fb_item_is_opaque(it))
+            blended_px += p.w*p.h;
+    }
+
+    fb_stats_add_items(items, blended_px);
+}
+
+// Brings the surfaces of the layers up to date before they are copied
+// to the screen
+static void fb_scene_render_layers(void)
+{
+    fb_scene_layer *sl;
+    struct fb_layer_cache *c;
+    fb_item_pos p;
+    int i, x;
+
+    for(i = 0; i < fb_scene.layers_cnt; ++i)
+    {
+        sl = &fb_scene.layers[i];
+        c = sl->layer->cache;
+
+        fb_target_set(c->surface, c->dev.w, c->dev.x, c->dev.y);
+        for(x = 0; x < sl->damage.count; ++x)
+        {
+            if(fb_pos_intersect(&sl->damage.rects[x], &c->pos, &p))
+                fb_render_pool_run(fb_layer_render_band, sl, &p);
+        }
+    }
+}
+
+// Composites the frame right into the impl's back buffer. fb.buffer is
+// the front buffer at this point, the areas the back buffer has missed
+// are copied over from it first, except for those which get redrawn anyway.
+// fb_update_mutex must be locked.
+static void fb_draw_zero_copy(const fb_damage *damage)
+{
+    int i;
+    px_type *dst;
+    fb_damage stale;
+
+    dst = fb.impl->get_frame_dest(&fb);
+    if(dst != fb.buffer && !fb_damage_is_full(damage))
+    {
+        fb_damage_clear(&stale);
+        fb_add_history_damage(&stale);
+
+        for(i = 0; i < stale.count; ++i)
+        {
+            if(!fb_damage_covers(damage, &stale.rects[i]))
+                fb_cpy_fb_rect(dst, fb.buffer, &stale.rects[i]);
+        }
+    }
+
+    fb.buffer = dst;
+    fb_target_set(fb.buffer, fb.stride, 0, 0);
+    for(i = 0; i < damage->count; ++i)
+        fb_render_pool_run(fb_draw_clipped, NULL, &damage->rects[i]);
+
+    fb_present(damage);
+}
+
+static void fb_draw(void)
+{
+    int i;
+    fb_item_header *it;
+    fb_damage damage;
+
+    fb_stats_frame_begin();
+    fb_batch_start();
+
+    // listviews move their items around, so they must be laid out
+    // before the damaged areas are computed
+    for(it = fb_ctx.first_item; it; it = it->next)
+    {
+        if(it->type == FB_IT_LISTVIEW)
+            listview_update_ui_args((listview*)it, 1, 1);
+    }
+
+    fb_ctx_collect_damage();
+    damage = fb_frame_damage;
+    fb_damage_clear(&fb_frame_damage);
+
+    if(fb_damage_is_empty(&damage))
+    {
+        fb_batch_end();
+        return;
+    }
+
+    // The rest works with the snapshot, the items are free to change
+    fb_scene_build(&damage);
     fb_batch_end();
 
-    pthread_mutex_lock(&fb_update_mutex);
-    fb_update();
-    pthread_mutex_unlock(&fb_update_mutex);
+    fb_scene_render_layers();
+
+    if(fb_zero_copy)
+    {
+        pthread_mutex_lock(&fb_update_mutex);
+        fb_draw_zero_copy(&damage);
+        pthread_mutex_unlock(&fb_update_mutex);
+    }
+    else
+    {
+        fb_target_set(fb.buffer, fb.stride, 0, 0);
+        for(i = 0; i < damage.count; ++i)
+            fb_render_pool_run(fb_draw_clipped, NULL, &damage.rects[i]);
+
+        pthread_mutex_lock(&fb_update_mutex);
+        fb_update_damaged(&damage);
+        pthread_mutex_unlock(&fb_update_mutex);
+    }
+
+    fb_scene_release();
+    fb_stats_frame_end();
 }
 
 void fb_freeze(int freeze)
@@ -1048,10 +2567,12 @@ void fb_push_context(void)
 {
     fb_context_t *ctx = mzalloc(sizeof(fb_context_t));
 
+    fb_screenshot_flash_end();
+
     pthread_mutex_lock(&fb_ctx.mutex);
-    ctx->first_item = fb_ctx.first_item;
+    fb_ctx_move_items(ctx, &fb_ctx);
     ctx->background_color = fb_ctx.background_color;
-    fb_ctx.first_item = NULL;
+    fb_damage_set_full(&fb_frame_damage);
     pthread_mutex_unlock(&fb_ctx.mutex);
 
     list_add(&inactive_ctx, ctx);
@@ -1068,8 +2589,9 @@ void fb_pop_context(void)
     fb_context_t *ctx = inactive_ctx[idx];
 
     pthread_mutex_lock(&fb_ctx.mutex);
-    fb_ctx.first_item = ctx->first_item;
+    fb_ctx_move_items(&fb_ctx, ctx);
     fb_ctx.background_color = ctx->background_color;
+    fb_damage_set_full(&fb_frame_damage);
     pthread_mutex_unlock(&fb_ctx.mutex);
 
     list_rm_noreorder(&inactive_ctx, ctx, &free);
@@ -1077,57 +2599,92 @@ void fb_pop_context(void)
     fb_request_draw();
 }
 
-#define SLEEP_CONST 16
+// Reads fb_draw_requested without changing it
+static inline int fb_draw_is_requested(void)
+{
+    atomic_int expected = ATOMIC_VAR_INIT(1);
+    return atomic_compare_exchange_strong(&fb_draw_requested, &expected, 1);
+}
+
 void *fb_draw_thread_work(UNUSED void *cookie)
 {
     struct timespec last, curr;
-    uint32_t diff = 0, prevSleepTime = 0;
-    clock_gettime(CLOCK_MONOTONIC, &last);
+    uint32_t diff;
 
-    atomic_int expected = ATOMIC_VAR_INIT(1);
+    // don't delay the first frame
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    last.tv_sec -= 1;
 
+    pthread_mutex_lock(&fb_draw_mutex);
     while(fb_draw_run)
     {
-        clock_gettime(CLOCK_MONOTONIC, &curr);
-        diff = timespec_diff(&last, &curr);
-
-        expected.__val = 1; // might be reseted by atomic_compare_exchange_strong
-        pthread_mutex_lock(&fb_draw_mutex);
-        if(atomic_compare_exchange_strong(&fb_draw_requested, &expected, 0))
-        {
-            fb_draw();
-            pthread_cond_broadcast(&fb_draw_cond);
-            pthread_mutex_unlock(&fb_draw_mutex);
-        }
-        else
+        if(!fb_draw_is_requested())
         {
-            pthread_mutex_unlock(&fb_draw_mutex);
 #ifdef MR_CONTINUOUS_FB_UPDATE
-            pthread_mutex_lock(&fb_update_mutex);
-            fb_update();
-            pthread_mutex_unlock(&fb_update_mutex);
+            // the display has to be refreshed even if nothing changes
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += fb_frame_interval_us*1000;
+            if(deadline.tv_nsec >= 1000000000)
+            {
+                ++deadline.tv_sec;
+                deadline.tv_nsec -= 1000000000;
+            }
+
+            if(pthread_cond_timedwait(&fb_draw_wake_cond, &fb_draw_mutex, &deadline) == ETIMEDOUT)
+            {
+                pthread_mutex_unlock(&fb_draw_mutex);
+                pthread_mutex_lock(&fb_update_mutex);
+                fb_update();
+                pthread_mutex_unlock(&fb_update_mutex);
+                pthread_mutex_lock(&fb_draw_mutex);
+            }
+#else
+            // sleep until fb_request_draw()
+            pthread_cond_wait(&fb_draw_wake_cond, &fb_draw_mutex);
 #endif
+            continue;
         }
 
+        // Start drawing right after a vsync, so that the frame is shown on
+        // the next one. Without vsync, keep the frame rate in check with
+        // a timer while draws keep coming.
+        pthread_mutex_unlock(&fb_draw_mutex);
+        if(fb_wait_vsync() < 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &curr);
+            diff = timespec_diff(&last, &curr)*1000;
+            if(diff < fb_frame_interval_us)
+                usleep(fb_frame_interval_us - diff);
+        }
+        pthread_mutex_lock(&fb_draw_mutex);
 
-        last = curr;
-        if(diff <= SLEEP_CONST+prevSleepTime)
+        atomic_int expected = ATOMIC_VAR_INIT(1);
+        if(atomic_compare_exchange_strong(&fb_draw_requested, &expected, 0))
         {
-            prevSleepTime = SLEEP_CONST+prevSleepTime-diff;
-            usleep(prevSleepTime*1000);
+            clock_gettime(CLOCK_MONOTONIC, &last);
+            fb_draw();
+            pthread_cond_broadcast(&fb_draw_cond);
         }
-        else
-            prevSleepTime = 0;
     }
+    pthread_mutex_unlock(&fb_draw_mutex);
     return NULL;
 }
 
+static void fb_wake_draw_thread(void)
+{
+    pthread_mutex_lock(&fb_draw_mutex);
+    pthread_cond_signal(&fb_draw_wake_cond);
+    pthread_mutex_unlock(&fb_draw_mutex);
+}
+
 void fb_request_draw(void)
 {
     if(!fb_frozen)
     {
         atomic_int expected = ATOMIC_VAR_INIT(0);
-        atomic_compare_exchange_strong(&fb_draw_requested, &expected, 1);
+        if(atomic_compare_exchange_strong(&fb_draw_requested, &expected, 1))
+            fb_wake_draw_thread();
     }
 }
 
@@ -1137,16 +2694,106 @@ void fb_force_draw(void)
 
     pthread_mutex_lock(&fb_draw_mutex);
     atomic_compare_exchange_strong(&fb_draw_requested, &expected, 1);
+    pthread_cond_signal(&fb_draw_wake_cond);
     pthread_cond_wait(&fb_draw_cond, &fb_draw_mutex);
     pthread_mutex_unlock(&fb_draw_mutex);
 }
 
+/*
+ * Screenshots are copied with fb_clone() and encoded on their own thread,
+ * so the UI keeps running while the PNG is written. Only one screenshot
+ * is taken at a time.
+ */
+struct fb_screenshot_job
+{
+    char path[256];
+    char *buffer; // fb.buffer's copy, it has the display's layout
+    int xres, yres, stride;
+    int width, height, rotation;
+};
+
+static atomic_int fb_screenshot_running = ATOMIC_VAR_INIT(0);
+
+// screenshots are saved upright
+static int fb_save_logical_png(struct fb_screenshot_job *job)
+{
+    int res;
+    px_type *img;
+    fb_item_pos all = { 0, 0, job->xres, job->yres };
+
+    if(job->rotation == 0)
+        return fb_png_save_img(job->path, job->width, job->height, job->stride, (px_type*)job->buffer);
+
+    img = malloc(job->width*job->height*PIXEL_SIZE);
+    fb_rotate_rect(img, job->width, (px_type*)job->buffer, job->stride, job->xres, job->yres,
+            (360 - job->rotation) % 360, &all);
+    res = fb_png_save_img(job->path, job->width, job->height, job->width, img);
+    free(img);
+    return res;
+}
+
+// Flashes the screen white to show the screenshot was taken
+static void fb_screenshot_flash(void)
+{
+    fb_batch_start();
+    fb_flash_rect = fb_add_rect_lvl(INT_MAX, 0, 0, fb_width, fb_height, WHITE);
+    fb_batch_end();
+    fb_request_draw();
+    usleep(100000);
+
+    fb_screenshot_flash_end();
+    fb_request_draw();
+}
+
+// The rect is gone already if the screen was cleared in the meantime
+static void fb_screenshot_flash_end(void)
+{
+    fb_batch_start();
+    if(fb_flash_rect)
+        fb_rm_rect(fb_flash_rect);
+    fb_batch_end();
+}
+
+static void fb_screenshot_finished(void)
+{
+    atomic_int expected = ATOMIC_VAR_INIT(1);
+    atomic_compare_exchange_strong(&fb_screenshot_running, &expected, 0);
+}
+
+static void *fb_screenshot_thread_work(void *data)
+{
+    struct fb_screenshot_job *job = data;
+    int res, media_rw_id;
+
+    res = fb_save_logical_png(job);
+    free(job->buffer);
+
+    if(res >= 0)
+    {
+        media_rw_id = decode_uid("media_rw");
+        if(media_rw_id != -1)
+            chown(job->path, (uid_t)media_rw_id, (gid_t)media_rw_id);
+        chmod(job->path, 0664);
+
+        INFO("Screenshot saved to %s\n", job->path);
+        fb_screenshot_flash();
+    }
+    else
+        ERROR("Failed to take screenshot!\n");
+
+    free(job);
+    fb_screenshot_finished();
+    return NULL;
+}
+
 int fb_save_screenshot(void)
 {
     char *r;
-    int c, media_rw_id;
+    int c;
     char dir[256];
-    char path[256];
+    pthread_t thread;
+    struct fb_screenshot_job *job;
+    atomic_int expected = ATOMIC_VAR_INIT(0);
 
     strcpy(dir, mrom_dir());
     r = strrchr(dir, '/');
@@ -1157,39 +2804,42 @@ int fb_save_screenshot(void)
     }
     *r = 0;
     strcat(dir, "/Pictures/Screenshots");
-    mkdir_recursive_with_perms(path, 0775, "media_rw", "media_rw");
 
+    if(!atomic_compare_exchange_strong(&fb_screenshot_running, &expected, 1))
+    {
+        INFO("Screenshot is already being saved\n");
+        return -1;
+    }
+
+    mkdir_recursive_with_perms(dir, 0775, "media_rw", "media_rw");
+
+    job = mzalloc(sizeof(struct fb_screenshot_job));
     for(c = 0; c < 999; ++c)
     {
-        snprintf(path, sizeof(path), "%s/mrom_screenshot_%03d.png", dir, c);
-        if(access(path, F_OK) < 0)
+        snprintf(job->path, sizeof(job->path), "%s/mrom_screenshot_%03d.png", dir, c);
+        if(access(job->path, F_OK) < 0)
             break;
     }
 
+    // the draw thread renders into fb.buffer while holding fb_draw_mutex
     pthread_mutex_lock(&fb_draw_mutex);
-    if(fb_png_save_img(path, fb_width, fb_height, fb.stride, fb.buffer) >= 0)
-    {
-        media_rw_id = decode_uid("media_rw");
-        if(media_rw_id != -1)
-            chown(path, (uid_t)media_rw_id, (gid_t)media_rw_id);
-        chmod(path, 0664);
-
-        INFO("Screenshot saved to %s\n", path);
-
-        fb_fill(WHITE);
-        pthread_mutex_lock(&fb_update_mutex);
-        fb_update();
-        usleep(100000);
-        pthread_mutex_unlock(&fb_update_mutex);
-        pthread_mutex_unlock(&fb_draw_mutex);
-
-        fb_request_draw();
-        return 0;
-    }
-    else
+    fb_clone(&job->buffer);
+    pthread_mutex_unlock(&fb_draw_mutex);
+    job->xres = fb.vi.xres;
+    job->yres = fb.vi.yres;
+    job->stride = fb.stride;
+    job->width = fb_width;
+    job->height = fb_height;
+    job->rotation = fb_rotation;
+
+    if(pthread_create(&thread, NULL, fb_screenshot_thread_work, job) != 0)
     {
-        pthread_mutex_unlock(&fb_draw_mutex);
-        ERROR("Failed to take screenshot!\n");
+        ERROR("Failed to start screenshot thread\n");
+        free(job->buffer);
+        free(job);
+        fb_screenshot_finished();
         return -1;
     }
+    pthread_detach(thread);
+    return 0;
 }
@@ -72,6 +72,7 @@ struct framebuffer {
     uint32_t size;
     uint32_t stride;
     int fd;
+    int num_buffers;
     struct fb_fix_screeninfo fi;
     struct fb_var_screeninfo vi;
     struct fb_impl *impl;
@@ -86,15 +87,27 @@ struct fb_impl {
     void (*close)(struct framebuffer *fb);
     int (*update)(struct framebuffer *fb);
     void *(*get_frame_dest)(struct framebuffer *fb);
+    // optional, blocks until the next vertical refresh. Returns -1 if
+    // the display doesn't support it.
+    int (*wait_vsync)(struct framebuffer *fb);
 };
 
+// In the order they are tried in
 enum
 {
+    // these use /dev/graphics/fb0
 #ifdef MR_USE_QCOM_OVERLAY
     FB_IMPL_QCOM_OVERLAY,
 #endif
+    FB_IMPL_GENERIC, // must be the last fbdev one
 
-    FB_IMPL_GENERIC, // must be last
+    // these are tried if the fbdev ones fail or there is no fb0
+#ifdef MR_FB_DRM
+    FB_IMPL_DRM,
+#endif
+#ifdef MR_FB_HEADLESS
+    FB_IMPL_HEADLESS,
+#endif
 
     FB_IMPL_CNT
 };
@@ -126,6 +139,8 @@ int fb_open_impl(void);
 void fb_close(void);
 void fb_update(void);
 void fb_dump_info(void);
+void fb_rotate_benchmark(void);
+float fb_get_refresh_rate(void);
 int fb_get_vi_xres(void);
 int fb_get_vi_yres(void);
 void fb_force_generic_impl(int force);
@@ -136,6 +151,8 @@ enum
     FB_IT_IMG,
     FB_IT_LISTVIEW,
     FB_IT_LINE,
+    FB_IT_SHAPE,
+    FB_IT_LAYER,
 };
 
 enum
@@ -176,6 +193,7 @@ enum
 };
 
 struct fb_item_header;
+struct fb_layer;
 
 #define FB_ITEM_POS \
     int x, y; \
@@ -188,6 +206,8 @@ typedef struct
 
 extern fb_item_pos DEFAULT_FB_PARENT;
 
+// drawn_pos and drawn_sig describe the item as it was last composited,
+// fb_draw() compares them with the current state to find damaged areas.
 #define FB_ITEM_HEAD \
     FB_ITEM_POS \
     int id; \
@@ -195,7 +215,10 @@ extern fb_item_pos DEFAULT_FB_PARENT;
     int level; \
     fb_item_pos *parent; \
     struct fb_item_header *prev; \
-    struct fb_item_header *next;
+    struct fb_item_header *next; \
+    fb_item_pos drawn_pos; \
+    uint32_t drawn_sig; \
+    struct fb_layer *layer;
 
 struct fb_item_header
 {
@@ -223,6 +246,9 @@ typedef struct
  * [2]: (R | (G << 5) | (B << 11))
  * [3]: (alphaForRB | (alphaForG << 8))
  * ...
+ * Text (FB_IMG_TYPE_TEXT) is different, its data is 8-bit coverage, one
+ * byte per pixel, and it is drawn in color. The coverage is shared by
+ * all texts with the same content, so changing the color is free.
  */
 typedef struct
 {
@@ -231,10 +257,29 @@ typedef struct
     int img_type;
     px_type *data;
     void *extra;
+    int opaque; // all pixels in data have full alpha
+    px_type color; // of text, without alpha
 } fb_img;
 
 typedef fb_img fb_text;
-typedef fb_img fb_circle;
+
+/*
+ * Circles and rectangles with rounded corners, drawn anti-aliased. Corner
+ * coverage is computed once per radius and shared by all such shapes.
+ */
+typedef struct fb_shape_mask fb_shape_mask;
+
+typedef struct
+{
+    FB_ITEM_HEAD
+
+    uint32_t color;
+    int radius2; // corner radius in 1/2 of a pixel
+    fb_shape_mask *mask;
+} fb_shape;
+
+typedef fb_shape fb_circle;
+typedef fb_shape fb_rrect;
 
 typedef struct
 {
@@ -242,12 +287,43 @@ typedef struct
     int x2, y2;
     int thickness;
     uint32_t color;
+    int antialias;
 } fb_line;
 
+/*
+ * Layer caches how a group of items which rarely change looks. Its members
+ * are rendered into an offscreen surface over the opaque background only
+ * when one of them changes, otherwise the surface is just copied to the
+ * screen. Members are drawn at the layer's level in their list order and
+ * are clipped to the layer's area.
+ */
+struct fb_layer_cache;
+
+typedef struct fb_layer
+{
+    FB_ITEM_HEAD
+
+    uint32_t background;
+    struct fb_layer_cache *cache;
+} fb_layer;
+
+// Items of one level form a continuous run in the item list
+typedef struct
+{
+    int level;
+    int count;
+    fb_item_header *first;
+    fb_item_header *last;
+} fb_level_bucket;
+
 typedef struct
 {
     uint32_t background_color;
     fb_item_header *first_item;
+    fb_item_header *last_item;
+    int item_count;
+    fb_level_bucket *levels; // sorted by level
+    int levels_cnt;
     pthread_mutex_t mutex;
     volatile int batch_started;
     volatile pthread_t batch_thread;
@@ -268,6 +344,13 @@ typedef struct
 
 void fb_remove_item(void *item);
 int fb_generate_item_id(void);
+// Returns the item with this id if it is in the current context. The
+// result is only safe to use while the caller holds fb_batch_start().
+void *fb_find_item(int id);
+// Number of items at level, for profiling
+int fb_item_count(int level);
+// Fills up to max levels and their item counts, returns number of levels
+int fb_item_level_counts(int *levels, int *counts, int max);
 px_type fb_convert_color(uint32_t c);
 uint32_t fb_convert_color_img(uint32_t c);
 
@@ -278,9 +361,14 @@ void fb_text_set_color(fb_img *img, uint32_t color);
 void fb_text_set_size(fb_img *img, int size);
 void fb_text_set_content(fb_img *img, const char *text);
 char *fb_text_get_content(fb_img *img);
+// Distance of the first line's baseline from the top of the text
+int fb_text_get_baseline(fb_img *img);
 
+// Frees the glyphs and unused strings over the cache's budget
 void fb_text_drop_cache_unused(void);
 void fb_text_destroy(fb_img *i);
+// Prints how long layout of strings the UI shows takes, needs mrom_dir()
+void fb_text_benchmark(void);
 
 fb_rect *fb_add_rect_lvl(int level, int x, int y, int w, int h, uint32_t color);
 #define fb_add_rect(x, y, w, h, color) fb_add_rect_lvl(LEVEL_RECT, x, y, w, h, color)
@@ -293,24 +381,47 @@ fb_img *fb_add_png_img_lvl(int level, int x, int y, int w, int h, const char *pa
 fb_circle *fb_add_circle_lvl(int level, int x, int y, int radius, uint32_t color);
 #define fb_add_circle(x, y, radius, color) fb_add_circle_lvl(LEVEL_CIRCLE, x, y, radius, color)
 
+fb_rrect *fb_add_rrect_lvl(int level, int x, int y, int w, int h, int radius, uint32_t color);
+#define fb_add_rrect(x, y, w, h, radius, color) fb_add_rrect_lvl(LEVEL_RECT, x, y, w, h, radius, color)
+
 fb_line *fb_add_line_lvl(int level, int x1, int y1, int x2, int y2, int thickness, uint32_t color);
 #define fb_add_line(x1, y1, x2, y2, thickness, color) fb_add_line_lvl(LEVEL_LINE, x1, y1, x2, y2, thickness, color)
 
+fb_layer *fb_add_layer_lvl(int level, int x, int y, int w, int h, uint32_t background);
+// Item must be an item of the current context, it leaves the layer when it
+// is removed from the context. Returns -1 if it is not a drawable item or
+// if it already belongs to a layer.
+int fb_layer_add_item(fb_layer *layer, void *item);
+// Adds those of items (a list) which are drawable items of the current
+// context, so it can be called on anything which starts with FB_ITEM_POS.
+// Takes one pass over the context's items, returns how many were added.
+int fb_layer_add_items(fb_layer *layer, void *items);
+void fb_layer_rm_item(fb_layer *layer, void *item);
+void fb_layer_invalidate(fb_layer *layer);
+
 void fb_rm_text(fb_img *i);
 void fb_rm_rect(fb_rect *r);
 void fb_rm_img(fb_img *i);
 void fb_rm_circle(fb_circle *c);
+void fb_rm_rrect(fb_rrect *r);
 void fb_rm_line(fb_line *l);
+void fb_rm_layer(fb_layer *l);
 
 void fb_draw_rect(fb_rect *r);
 void fb_draw_img(fb_img *i);
 void fb_draw_line(fb_line *l);
+void fb_draw_shape(fb_shape *s);
 void fb_fill(uint32_t color);
+void fb_item_damage(void *item);
+void fb_damage_all(void);
 void fb_request_draw(void);
 void fb_force_draw(void);
 void fb_clear(void);
 void fb_freeze(int freeze);
 int fb_clone(char **buff);
+// Saves the screen to Pictures/Screenshots. Returns once the frame is
+// copied, the PNG is written on a background thread which flashes the
+// screen when it is done.
 int fb_save_screenshot(void);
 void fb_set_brightness(int val);
 
@@ -328,9 +439,56 @@ void fb_set_background(uint32_t color);
 
 px_type *fb_png_get(const char *path, int w, int h);
 void fb_png_release(px_type *data);
+int fb_png_is_opaque(px_type *data);
 void fb_png_drop_unused(void);
 int fb_png_save_img(const char *path, int w, int h, int stride, px_type *data);
 
+// Statistics of the frames drawn by the draw thread, framebuffer_stats.c
+typedef struct
+{
+    uint64_t time_us;      // start of the frame, CLOCK_MONOTONIC
+    uint32_t composite_us; // layout, snapshot and rendering
+    uint32_t present_us;   // handing the frame over to the display
+    uint32_t capture_us;   // copying the frame for fb_capture_*
+    uint32_t cpu_us;       // CPU time of the draw thread and the render pool
+    uint32_t pool_cpu_us;  // the part of cpu_us spent by the pool's threads
+    uint32_t items;        // items drawn
+    uint32_t blended_px;   // pixels of translucent items drawn
+    uint32_t cache_hits;   // text and PNG cache hits since the last frame
+} fb_frame_stats;
+
+enum
+{
+    FB_CACHE_TEXT,
+    FB_CACHE_PNG,
+
+    FB_CACHE_CNT
+};
+
+typedef struct
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions; // entries dropped to keep the cache within its budget
+    int entries;
+    int bytes;
+} fb_cache_stats;
+
+// Copies up to max most recent frames into dst, oldest first.
+// Returns the number of frames copied.
+int fb_stats_get_frames(fb_frame_stats *dst, int max);
+void fb_stats_get_cache(int cache, fb_cache_stats *res);
+// Writes percentiles of the recent frames to mrom_dir()/fb_stats.txt
+int fb_stats_dump(void);
+
+// Frame capture, see framebuffer_capture.c. Keeps copies of the presented
+// frames in a ring of budget_kb kilobytes. fb_capture_save() stops the
+// capture and writes the frames to mrom_dir()/fb_capture.raw and .idx.
+int fb_capture_start(int budget_kb);
+void fb_capture_stop(void);
+int fb_capture_is_active(void);
+int fb_capture_save(void);
+
 inline void center_text(fb_img *text, int targetX, int targetY, int targetW, int targetH);
 
 int vt_set_mode(int graphics);
@@ -0,0 +1,565 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+  #include <arm_neon.h>
+  #define FB_BLEND_NEON
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+  #define FB_BLEND_SSE2
+#endif
+
+#include "framebuffer.h"
+#include "framebuffer_priv.h"
+
+/*
+ * All kernels produce exactly the same output as the scalar versions, the
+ * vector loops only process the bulk of the row and leave the rest of it
+ * to the scalar code.
+ *
+ * All 32bit formats have alpha in the highest byte and the blending is
+ * done per byte, so they can share one implementation.
+ *
+ * Solid color:  c' = c*a/256 + d*(255 - a)/256, alpha byte is set to 0xFF
+ * Image pixels: c' = (s*a + d*(255 - a))/255, alpha byte is set to 0xFF
+ *               unless the image pixel is fully transparent.
+ * RGB565 works the same way, but with 5 and 6 bit alpha values and
+ * images carry them in the two bytes after each pixel.
+ */
+
+#if PIXEL_SIZE == 4
+
+static inline uint8_t blend_solid_comp(uint8_t premult, uint8_t d, uint8_t inv_alpha)
+{
+    return premult + ((d * inv_alpha) >> 8);
+}
+
+static inline uint8_t blend_img_comp(uint8_t d, uint8_t s, uint8_t alpha)
+{
+    const int r = (0xFF - alpha)*d + alpha*s;
+    return (r + 1 + (r >> 8)) >> 8; // divide by 255
+}
+
+void fb_blend_rect_row(px_type *dst, px_type color, uint8_t alpha, int count)
+{
+    int i, x = 0;
+    const uint8_t inv_alpha = 0xFF - alpha;
+    const uint8_t *comps_clr = (uint8_t*)&color;
+    uint8_t premult[4];
+    uint8_t *comps_bits;
+
+    for(i = 0; i < 4; ++i)
+        premult[i] = (comps_clr[i] * alpha) >> 8;
+    premult[PX_IDX_A] = 0;
+
+#if defined(FB_BLEND_NEON)
+    const uint8x8_t v_inv = vdup_n_u8(inv_alpha);
+    uint8x8x4_t px;
+
+    for(; x + 8 <= count; x += 8)
+    {
+        px = vld4_u8((uint8_t*)(dst + x));
+        for(i = 0; i < 4; ++i)
+        {
+            if(i == PX_IDX_A)
+                px.val[i] = vdup_n_u8(0xFF);
+            else
+                px.val[i] = vadd_u8(vdup_n_u8(premult[i]), vshrn_n_u16(vmull_u8(px.val[i], v_inv), 8));
+        }
+        vst4_u8((uint8_t*)(dst + x), px);
+    }
+#elif defined(FB_BLEND_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i v_inv = _mm_set1_epi16(inv_alpha);
+    const __m128i v_alpha_mask = _mm_set1_epi32(0xFF << PX_IDX_A*8);
+    const __m128i v_premult = _mm_set_epi16(premult[3], premult[2], premult[1], premult[0],
+            premult[3], premult[2], premult[1], premult[0]);
+    __m128i d, lo, hi;
+
+    for(; x + 4 <= count; x += 4)
+    {
+        d = _mm_loadu_si128((__m128i*)(dst + x));
+        lo = _mm_unpacklo_epi8(d, zero);
+        hi = _mm_unpackhi_epi8(d, zero);
+        lo = _mm_add_epi16(v_premult, _mm_srli_epi16(_mm_mullo_epi16(lo, v_inv), 8));
+        hi = _mm_add_epi16(v_premult, _mm_srli_epi16(_mm_mullo_epi16(hi, v_inv), 8));
+        d = _mm_or_si128(_mm_packus_epi16(lo, hi), v_alpha_mask);
+        _mm_storeu_si128((__m128i*)(dst + x), d);
+    }
+#endif
+
+    for(; x < count; ++x)
+    {
+        comps_bits = (uint8_t*)(dst + x);
+        comps_bits[PX_IDX_R] = blend_solid_comp(premult[PX_IDX_R], comps_bits[PX_IDX_R], inv_alpha);
+        comps_bits[PX_IDX_G] = blend_solid_comp(premult[PX_IDX_G], comps_bits[PX_IDX_G], inv_alpha);
+        comps_bits[PX_IDX_B] = blend_solid_comp(premult[PX_IDX_B], comps_bits[PX_IDX_B], inv_alpha);
+        comps_bits[PX_IDX_A] = 0xFF;
+    }
+}
+
+void fb_blend_img_row(px_type *dst, const px_type *src, int count)
+{
+    int x = 0;
+    uint8_t alpha;
+    uint8_t *comps_bits;
+    const uint8_t *comps_img;
+
+#if defined(FB_BLEND_NEON)
+    const uint8x8_t zero = vdup_n_u8(0);
+    const uint8x8_t v_max = vdup_n_u8(0xFF);
+    const uint16x8_t one = vdupq_n_u16(1);
+    uint8x8x4_t s, d;
+    uint8x8_t a, inv_a;
+    uint16x8_t r;
+    uint64_t a_all;
+    int i;
+
+    for(; x + 8 <= count; x += 8)
+    {
+        s = vld4_u8((const uint8_t*)(src + x));
+        a = s.val[PX_IDX_A];
+        a_all = vget_lane_u64(vreinterpret_u64_u8(a), 0);
+        if(a_all == 0)
+            continue;
+        if(a_all == UINT64_MAX)
+        {
+            vst4_u8((uint8_t*)(dst + x), s);
+            continue;
+        }
+
+        d = vld4_u8((uint8_t*)(dst + x));
+        inv_a = vmvn_u8(a);
+        for(i = 0; i < 4; ++i)
+        {
+            if(i == PX_IDX_A)
+                continue;
+            r = vmull_u8(d.val[i], inv_a);
+            r = vmlal_u8(r, s.val[i], a);
+            r = vaddq_u16(vaddq_u16(r, one), vshrq_n_u16(r, 8));
+            d.val[i] = vshrn_n_u16(r, 8);
+        }
+        d.val[PX_IDX_A] = vbsl_u8(vceq_u8(a, zero), d.val[PX_IDX_A], v_max);
+        vst4_u8((uint8_t*)(dst + x), d);
+    }
+#elif defined(FB_BLEND_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i v_max = _mm_set1_epi16(0xFF);
+    const __m128i v_alpha_mask = _mm_set1_epi32(0xFF << PX_IDX_A*8);
+    __m128i s, d, a32, transparent, s_lo, s_hi, d_lo, d_hi, a_lo, a_hi, r_lo, r_hi;
+    int mask;
+
+    for(; x + 4 <= count; x += 4)
+    {
+        s = _mm_loadu_si128((const __m128i*)(src + x));
+        a32 = _mm_srli_epi32(s, PX_IDX_A*8);
+        transparent = _mm_cmpeq_epi32(a32, zero);
+        mask = _mm_movemask_epi8(transparent);
+        if(mask == 0xFFFF)
+            continue;
+        if(_mm_movemask_epi8(_mm_cmpeq_epi32(a32, _mm_set1_epi32(0xFF))) == 0xFFFF)
+        {
+            _mm_storeu_si128((__m128i*)(dst + x), s);
+            continue;
+        }
+
+        d = _mm_loadu_si128((__m128i*)(dst + x));
+        s_lo = _mm_unpacklo_epi8(s, zero);
+        s_hi = _mm_unpackhi_epi8(s, zero);
+        d_lo = _mm_unpacklo_epi8(d, zero);
+        d_hi = _mm_unpackhi_epi8(d, zero);
+
+#define ALPHA_SHUF _MM_SHUFFLE(PX_IDX_A, PX_IDX_A, PX_IDX_A, PX_IDX_A)
+        a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, ALPHA_SHUF), ALPHA_SHUF);
+        a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, ALPHA_SHUF), ALPHA_SHUF);
+#undef ALPHA_SHUF
+
+        r_lo = _mm_add_epi16(_mm_mullo_epi16(d_lo, _mm_sub_epi16(v_max, a_lo)), _mm_mullo_epi16(s_lo, a_lo));
+        r_hi = _mm_add_epi16(_mm_mullo_epi16(d_hi, _mm_sub_epi16(v_max, a_hi)), _mm_mullo_epi16(s_hi, a_hi));
+        r_lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(r_lo, one), _mm_srli_epi16(r_lo, 8)), 8);
+        r_hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(r_hi, one), _mm_srli_epi16(r_hi, 8)), 8);
+
+        // Alpha of the blended result is the original one for transparent
+        // pixels, force it to 0xFF for the rest
+        d = _mm_or_si128(_mm_packus_epi16(r_lo, r_hi), _mm_andnot_si128(transparent, v_alpha_mask));
+        _mm_storeu_si128((__m128i*)(dst + x), d);
+    }
+#endif
+
+    for(; x < count; ++x)
+    {
+        comps_img = (const uint8_t*)(src + x);
+        alpha = comps_img[PX_IDX_A];
+
+        if(alpha == 0xFF)
+            dst[x] = src[x];
+        else if(alpha != 0)
+        {
+            comps_bits = (uint8_t*)(dst + x);
+            comps_bits[PX_IDX_R] = blend_img_comp(comps_bits[PX_IDX_R], comps_img[PX_IDX_R], alpha);
+            comps_bits[PX_IDX_G] = blend_img_comp(comps_bits[PX_IDX_G], comps_img[PX_IDX_G], alpha);
+            comps_bits[PX_IDX_B] = blend_img_comp(comps_bits[PX_IDX_B], comps_img[PX_IDX_B], alpha);
+            comps_bits[PX_IDX_A] = 0xFF;
+        }
+    }
+}
+
+#elif PIXEL_SIZE == 2
+
+void fb_blend_rect_row(px_type *dst, px_type color, uint8_t alpha, int count)
+{
+    int x = 0;
+    const uint8_t alpha5b = (alpha >> 3) + 1;
+    const uint8_t alpha6b = (alpha >> 2) + 1;
+    const uint8_t inv_alpha5b = 32 - alpha5b;
+    const uint8_t inv_alpha6b = 64 - alpha6b;
+    const uint16_t premult_color_rb = ((color & 0xF81F) * alpha5b) >> 5;
+    const uint16_t premult_color_g = ((color & 0x7E0) * alpha6b) >> 6;
+
+#if defined(FB_BLEND_NEON) || defined(FB_BLEND_SSE2)
+    const uint16_t premult_r = (((color >> 11) & 0x1F) * alpha5b) >> 5;
+    const uint16_t premult_g = (((color >> 5) & 0x3F) * alpha6b) >> 6;
+    const uint16_t premult_b = ((color & 0x1F) * alpha5b) >> 5;
+#endif
+
+#if defined(FB_BLEND_NEON)
+    const uint16x8_t v_inv5 = vdupq_n_u16(inv_alpha5b);
+    const uint16x8_t v_inv6 = vdupq_n_u16(inv_alpha6b);
+    const uint16x8_t v_pr = vdupq_n_u16(premult_r);
+    const uint16x8_t v_pg = vdupq_n_u16(premult_g);
+    const uint16x8_t v_pb = vdupq_n_u16(premult_b);
+    const uint16x8_t mask5 = vdupq_n_u16(0x1F);
+    const uint16x8_t mask6 = vdupq_n_u16(0x3F);
+    uint16x8_t d, r, g, b;
+
+    for(; x + 8 <= count; x += 8)
+    {
+        d = vld1q_u16(dst + x);
+        r = vshrq_n_u16(d, 11);
+        g = vandq_u16(vshrq_n_u16(d, 5), mask6);
+        b = vandq_u16(d, mask5);
+        r = vaddq_u16(v_pr, vshrq_n_u16(vmulq_u16(r, v_inv5), 5));
+        g = vaddq_u16(v_pg, vshrq_n_u16(vmulq_u16(g, v_inv6), 6));
+        b = vaddq_u16(v_pb, vshrq_n_u16(vmulq_u16(b, v_inv5), 5));
+        d = vorrq_u16(vorrq_u16(vshlq_n_u16(r, 11), vshlq_n_u16(g, 5)), b);
+        vst1q_u16(dst + x, d);
+    }
+#elif defined(FB_BLEND_SSE2)
+    const __m128i v_inv5 = _mm_set1_epi16(inv_alpha5b);
+    const __m128i v_inv6 = _mm_set1_epi16(inv_alpha6b);
+    const __m128i v_pr = _mm_set1_epi16(premult_r);
+    const __m128i v_pg = _mm_set1_epi16(premult_g);
+    const __m128i v_pb = _mm_set1_epi16(premult_b);
+    const __m128i mask5 = _mm_set1_epi16(0x1F);
+    const __m128i mask6 = _mm_set1_epi16(0x3F);
+    __m128i d, r, g, b;
+
+    for(; x + 8 <= count; x += 8)
+    {
+        d = _mm_loadu_si128((__m128i*)(dst + x));
+        r = _mm_srli_epi16(d, 11);
+        g = _mm_and_si128(_mm_srli_epi16(d, 5), mask6);
+        b = _mm_and_si128(d, mask5);
+        r = _mm_add_epi16(v_pr, _mm_srli_epi16(_mm_mullo_epi16(r, v_inv5), 5));
+        g = _mm_add_epi16(v_pg, _mm_srli_epi16(_mm_mullo_epi16(g, v_inv6), 6));
+        b = _mm_add_epi16(v_pb, _mm_srli_epi16(_mm_mullo_epi16(b, v_inv5), 5));
+        d = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(r, 11), _mm_slli_epi16(g, 5)), b);
+        _mm_storeu_si128((__m128i*)(dst + x), d);
+    }
+#endif
+
+    for(; x < count; ++x)
+    {
+        const uint16_t rb = (premult_color_rb & 0xF81F) + ((inv_alpha5b * (dst[x] & 0xF81F)) >> 5);
+        const uint16_t g = (premult_color_g & 0x7E0) + ((inv_alpha6b * (dst[x] & 0x7E0)) >> 6);
+        dst[x] = (rb & 0xF81F) | (g & 0x7E0);
+    }
+}
+
+// src has two extra bytes after each pixel, 5 and 6 bit alpha
+void fb_blend_img_row(px_type *dst, const px_type *src, int count)
+{
+    int x = 0;
+    uint8_t alpha5b, alpha6b;
+    const px_type *img;
+
+#if defined(FB_BLEND_NEON)
+    const uint16x8_t zero = vdupq_n_u16(0);
+    const uint16x8_t one = vdupq_n_u16(1);
+    const uint16x8_t max5 = vdupq_n_u16(31);
+    const uint16x8_t max6 = vdupq_n_u16(63);
+    const uint16x8_t mask8 = vdupq_n_u16(0xFF);
+    uint16x8x2_t s;
+    uint16x8_t d, a5, a6, r, g, b;
+    uint64x2_t a_all;
+
+#define BLEND_CH(res, d_ch, s_ch, a, max, shift) \
+    res = vaddq_u16(vmulq_u16(d_ch, vsubq_u16(max, a)), vmulq_u16(s_ch, a)); \
+    res = vshrq_n_u16(vaddq_u16(vaddq_u16(res, one), vshrq_n_u16(res, shift)), shift);
+
+    for(; x + 8 <= count; x += 8)
+    {
+        s = vld2q_u16(src + x*2);
+        a5 = vandq_u16(s.val[1], mask8);
+
+        a_all = vreinterpretq_u64_u16(a5);
+        if((vgetq_lane_u64(a_all, 0) | vgetq_lane_u64(a_all, 1)) == 0)
+            continue;
+
+        a_all = vreinterpretq_u64_u16(vceqq_u16(a5, max5));
+        if((vgetq_lane_u64(a_all, 0) & vgetq_lane_u64(a_all, 1)) == UINT64_MAX)
+        {
+            vst1q_u16(dst + x, s.val[0]);
+            continue;
+        }
+
+        a6 = vshrq_n_u16(s.val[1], 8);
+        d = vld1q_u16(dst + x);
+
+        BLEND_CH(r, vshrq_n_u16(d, 11), vshrq_n_u16(s.val[0], 11), a5, max5, 5);
+        BLEND_CH(g, vandq_u16(vshrq_n_u16(d, 5), max6), vandq_u16(vshrq_n_u16(s.val[0], 5), max6), a6, max6, 6);
+        BLEND_CH(b, vandq_u16(d, max5), vandq_u16(s.val[0], max5), a5, max5, 5);
+
+        r = vorrq_u16(vorrq_u16(vshlq_n_u16(r, 11), vshlq_n_u16(g, 5)), b);
+        // pixels with zero 5bit alpha are left untouched
+        d = vbslq_u16(vceqq_u16(a5, zero), d, r);
+        vst1q_u16(dst + x, d);
+    }
+#undef BLEND_CH
+#elif defined(FB_BLEND_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i max5 = _mm_set1_epi16(31);
+    const __m128i max6 = _mm_set1_epi16(63);
+    const __m128i mask8 = _mm_set1_epi16(0xFF);
+    __m128i s0, s1, s, ap, d, a5, a6, r, g, b, transparent;
+
+#define BLEND_CH(res, d_ch, s_ch, a, max, shift) \
+    res = _mm_add_epi16(_mm_mullo_epi16(d_ch, _mm_sub_epi16(max, a)), _mm_mullo_epi16(s_ch, a)); \
+    res = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(res, one), _mm_srli_epi16(res, shift)), shift);
+
+    for(; x + 8 <= count; x += 8)
+    {
+        s0 = _mm_loadu_si128((const __m128i*)(src + x*2));
+        s1 = _mm_loadu_si128((const __m128i*)(src + x*2 + 8));
+
+        // deinterleave colors and alpha pairs, sign extension makes
+        // packs_epi32 keep the 16bit values intact
+        ap = _mm_packs_epi32(_mm_srai_epi32(s0, 16), _mm_srai_epi32(s1, 16));
+        a5 = _mm_and_si128(ap, mask8);
+
+        transparent = _mm_cmpeq_epi16(a5, zero);
+        if(_mm_movemask_epi8(transparent) == 0xFFFF)
+            continue;
+
+        s = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(s0, 16), 16),
+                _mm_srai_epi32(_mm_slli_epi32(s1, 16), 16));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi16(a5, max5)) == 0xFFFF)
+        {
+            _mm_storeu_si128((__m128i*)(dst + x), s);
+            continue;
+        }
+
+        a6 = _mm_srli_epi16(ap, 8);
+        d = _mm_loadu_si128((__m128i*)(dst + x));
+
+        BLEND_CH(r, _mm_srli_epi16(d, 11), _mm_srli_epi16(s, 11), a5, max5, 5);
+        BLEND_CH(g, _mm_and_si128(_mm_srli_epi16(d, 5), max6), _mm_and_si128(_mm_srli_epi16(s, 5), max6), a6, max6, 6);
+        BLEND_CH(b, _mm_and_si128(d, max5), _mm_and_si128(s, max5), a5, max5, 5);
+
+        r = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(r, 11), _mm_slli_epi16(g, 5)), b);
+        // pixels with zero 5bit alpha are left untouched
+        d = _mm_or_si128(_mm_and_si128(transparent, d), _mm_andnot_si128(transparent, r));
+        _mm_storeu_si128((__m128i*)(dst + x), d);
+    }
+#undef BLEND_CH
+#endif
+
+    for(; x < count; ++x)
+    {
+        img = src + x*2;
+        alpha5b = ((uint8_t*)img)[2];
+
+        if(alpha5b == 31)
+            dst[x] = *img;
+        else if(alpha5b != 0)
+        {
+            alpha6b = ((uint8_t*)img)[3];
+            dst[x] = (((31-alpha5b)*(dst[x] & 0x1F)            + (alpha5b*(*img & 0x1F))) / 31) |
+                     ((((63-alpha6b)*((dst[x] & 0x7E0) >> 5)   + (alpha6b*((*img & 0x7E0) >> 5))) / 63) << 5) |
+                     ((((31-alpha5b)*((dst[x] & 0xF800) >> 11) + (alpha5b*((*img & 0xF800) >> 11))) / 31) << 11);
+        }
+    }
+}
+
+#endif // PIXEL_SIZE
+
+// Only used for edges of anti-aliased shapes, which are short, so it
+// reuses the solid color kernel pixel by pixel.
+void fb_blend_mask_row(px_type *dst, px_type color, uint8_t alpha, const uint8_t *mask, int count)
+{
+    int x, a;
+
+    for(x = 0; x < count; ++x)
+    {
+        a = alpha*mask[x];
+        a = (a + 1 + (a >> 8)) >> 8; // divide by 255
+
+        if(a == 0xFF)
+            dst[x] = color;
+        else if(a != 0)
+            fb_blend_rect_row(dst + x, color, a, 1);
+    }
+}
+
+#if PIXEL_SIZE == 4
+
+void fb_blend_coverage_row(px_type *dst, px_type color, const uint8_t *mask, int count)
+{
+    int x = 0;
+    uint8_t alpha;
+    uint8_t *comps_bits;
+    const uint8_t *comps_clr = (const uint8_t*)&color;
+    const px_type opaque = color | (((px_type)0xFF) << PX_IDX_A*8);
+
+#if defined(FB_BLEND_NEON)
+    const uint8x8_t zero = vdup_n_u8(0);
+    const uint8x8_t v_max = vdup_n_u8(0xFF);
+    const uint16x8_t one = vdupq_n_u16(1);
+    const uint32x4_t v_opaque = vdupq_n_u32(opaque);
+    uint8x8x4_t d;
+    uint8x8_t a, inv_a;
+    uint16x8_t r;
+    uint64_t a_all;
+    int i;
+
+    for(; x + 8 <= count; x += 8)
+    {
+        a = vld1_u8(mask + x);
+        a_all = vget_lane_u64(vreinterpret_u64_u8(a), 0);
+        if(a_all == 0)
+            continue;
+        if(a_all == UINT64_MAX)
+        {
+            vst1q_u32((uint32_t*)(dst + x), v_opaque);
+            vst1q_u32((uint32_t*)(dst + x + 4), v_opaque);
+            continue;
+        }
+
+        d = vld4_u8((uint8_t*)(dst + x));
+        inv_a = vmvn_u8(a);
+        for(i = 0; i < 4; ++i)
+        {
+            if(i == PX_IDX_A)
+                continue;
+            r = vmull_u8(d.val[i], inv_a);
+            r = vmlal_u8(r, vdup_n_u8(comps_clr[i]), a);
+            r = vaddq_u16(vaddq_u16(r, one), vshrq_n_u16(r, 8));
+            d.val[i] = vshrn_n_u16(r, 8);
+        }
+        d.val[PX_IDX_A] = vbsl_u8(vceq_u8(a, zero), d.val[PX_IDX_A], v_max);
+        vst4_u8((uint8_t*)(dst + x), d);
+    }
+#elif defined(FB_BLEND_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i v_max = _mm_set1_epi16(0xFF);
+    const __m128i v_alpha_mask = _mm_set1_epi32(0xFF << PX_IDX_A*8);
+    const __m128i v_opaque = _mm_set1_epi32(opaque);
+    const __m128i v_clr = _mm_unpacklo_epi8(_mm_set1_epi32(color), zero);
+    __m128i m, d, transparent, d_lo, d_hi, a_lo, a_hi, r_lo, r_hi;
+    uint32_t m4;
+
+    for(; x + 4 <= count; x += 4)
+    {
+        memcpy(&m4, mask + x, sizeof(m4));
+        if(m4 == 0)
+            continue;
+        if(m4 == UINT32_MAX)
+        {
+            _mm_storeu_si128((__m128i*)(dst + x), v_opaque);
+            continue;
+        }
+
+        // spread each pixel's coverage to its four 16bit lanes
+        m = _mm_unpacklo_epi8(_mm_cvtsi32_si128(m4), zero);
+        transparent = _mm_cmpeq_epi32(_mm_unpacklo_epi16(m, zero), zero);
+        m = _mm_unpacklo_epi16(m, m);
+        a_lo = _mm_unpacklo_epi32(m, m);
+        a_hi = _mm_unpackhi_epi32(m, m);
+
+        d = _mm_loadu_si128((__m128i*)(dst + x));
+        d_lo = _mm_unpacklo_epi8(d, zero);
+        d_hi = _mm_unpackhi_epi8(d, zero);
+
+        r_lo = _mm_add_epi16(_mm_mullo_epi16(d_lo, _mm_sub_epi16(v_max, a_lo)), _mm_mullo_epi16(v_clr, a_lo));
+        r_hi = _mm_add_epi16(_mm_mullo_epi16(d_hi, _mm_sub_epi16(v_max, a_hi)), _mm_mullo_epi16(v_clr, a_hi));
+        r_lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(r_lo, one), _mm_srli_epi16(r_lo, 8)), 8);
+        r_hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(r_hi, one), _mm_srli_epi16(r_hi, 8)), 8);
+
+        // Zero coverage leaves the pixel as it was, alpha of the rest is 0xFF
+        d = _mm_or_si128(_mm_packus_epi16(r_lo, r_hi), _mm_andnot_si128(transparent, v_alpha_mask));
+        _mm_storeu_si128((__m128i*)(dst + x), d);
+    }
+#endif
+
+    for(; x < count; ++x)
+    {
+        alpha = mask[x];
+
+        if(alpha == 0xFF)
+            dst[x] = opaque;
+        else if(alpha != 0)
+        {
+            comps_bits = (uint8_t*)(dst + x);
+            comps_bits[PX_IDX_R] = blend_img_comp(comps_bits[PX_IDX_R], comps_clr[PX_IDX_R], alpha);
+            comps_bits[PX_IDX_G] = blend_img_comp(comps_bits[PX_IDX_G], comps_clr[PX_IDX_G], alpha);
+            comps_bits[PX_IDX_B] = blend_img_comp(comps_bits[PX_IDX_B], comps_clr[PX_IDX_B], alpha);
+            comps_bits[PX_IDX_A] = 0xFF;
+        }
+    }
+}
+
+#elif PIXEL_SIZE == 2
+
+#define COVERAGE_CHUNK 64
+
+// The pixels are expanded to the image format in chunks, with the 5 and 6
+// bit alpha values rounded the way text images used to store them.
+void fb_blend_coverage_row(px_type *dst, px_type color, const uint8_t *mask, int count)
+{
+    px_type img[COVERAGE_CHUNK*2];
+    int x, i, len;
+
+    for(x = 0; x < count; x += len)
+    {
+        len = count - x < COVERAGE_CHUNK ? count - x : COVERAGE_CHUNK;
+        for(i = 0; i < len; ++i)
+        {
+            img[i*2] = color;
+            ((uint8_t*)(img + i*2 + 1))[0] = ((((mask[x+i]*100)/0xFF)*31)/100);
+            ((uint8_t*)(img + i*2 + 1))[1] = ((((mask[x+i]*100)/0xFF)*63)/100);
+        }
+        fb_blend_img_row(dst + x, img, len);
+    }
+}
+
+#endif // PIXEL_SIZE
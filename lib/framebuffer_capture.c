@@ -0,0 +1,338 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "framebuffer.h"
+#include "framebuffer_priv.h"
+#include "mrom_data.h"
+#include "util.h"
+
+/*
+ * Frame capture, for recording UI sessions. The draw thread copies the
+ * damaged rectangles of each presented frame into a ring of a fixed size,
+ * the oldest frames are dropped to make space for new ones. A frame with
+ * the whole screen (a key frame) is copied every FB_CAPTURE_KEY_INTERVAL
+ * frames, and also as soon as the last one is dropped from the ring, so
+ * that the frames which are left can be pieced back together.
+ *
+ * fb_capture_save() writes, starting with the oldest key frame:
+ *
+ *   fb_capture.raw  the rectangles' pixels, one after another, RGB888
+ *   fb_capture.idx  text index: screen size and rotation, then one line
+ *                   "<frame> <time_us> <offset> <x> <y> <w> <h>" for each
+ *                   rectangle, offset is into fb_capture.raw
+ *
+ * Rectangles are in the display's layout, like fb.buffer is. The index's
+ * rotation is fb_rotation, frames are turned upright the same way
+ * fb_save_screenshot() does it.
+ */
+
+#define FB_CAPTURE_MAX_FRAMES 1024
+#define FB_CAPTURE_KEY_INTERVAL 120
+
+struct fb_capture_frame
+{
+    uint64_t time_us;
+    uint32_t offset; // into the ring's data
+    uint32_t size;
+    int key;
+    int rect_cnt;
+    fb_item_pos rects[FB_DAMAGE_MAX_RECTS];
+};
+
+struct fb_capture_ring
+{
+    uint8_t *data;
+    uint32_t data_size;
+    uint32_t pos; // where the next frame goes
+    struct fb_capture_frame *frames;
+    int first;
+    int count;
+    int key_cnt;
+    int width, height, rotation;
+    uint32_t since_key;
+
+    // cost of the copies
+    uint32_t captured;
+    uint32_t dropped;
+    uint64_t copied_bytes;
+    uint64_t total_us;
+    uint32_t max_us;
+};
+
+static struct fb_capture_ring cap;
+static volatile int cap_active = 0;
+static pthread_mutex_t cap_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void fb_capture_ring_free(struct fb_capture_ring *r)
+{
+    free(r->data);
+    free(r->frames);
+    memset(r, 0, sizeof(struct fb_capture_ring));
+}
+
+static void fb_capture_evict(void)
+{
+    if(cap.frames[cap.first].key)
+        --cap.key_cnt;
+    cap.first = (cap.first + 1) % FB_CAPTURE_MAX_FRAMES;
+    --cap.count;
+}
+
+// Returns offset of size free bytes in the ring, dropping the oldest
+// frames which are in the way.
+static uint32_t fb_capture_alloc(uint32_t size)
+{
+    struct fb_capture_frame *f;
+
+    if(cap.pos + size > cap.data_size)
+    {
+        // the frames at the end of the ring are the oldest ones
+        while(cap.count && cap.frames[cap.first].offset >= cap.pos)
+            fb_capture_evict();
+        cap.pos = 0;
+    }
+
+    while(cap.count)
+    {
+        f = &cap.frames[cap.first];
+        if(f->offset >= cap.pos + size || f->offset + f->size <= cap.pos)
+            break;
+        fb_capture_evict();
+    }
+
+    if(cap.count == FB_CAPTURE_MAX_FRAMES)
+        fb_capture_evict();
+
+    cap.pos += size;
+    return cap.pos - size;
+}
+
+int fb_capture_start(int budget_kb)
+{
+    int res = -1;
+
+    pthread_mutex_lock(&cap_mutex);
+    if(cap_active)
+        goto exit;
+
+    fb_capture_ring_free(&cap);
+    cap.data_size = budget_kb*1024;
+    cap.data = malloc(cap.data_size);
+    cap.frames = malloc(FB_CAPTURE_MAX_FRAMES*sizeof(struct fb_capture_frame));
+    if(!cap.data || !cap.frames)
+    {
+        ERROR("Failed to allocate %d kB for frame capture\n", budget_kb);
+        fb_capture_ring_free(&cap);
+        goto exit;
+    }
+
+    cap.width = fb_get_vi_xres();
+    cap.height = fb_get_vi_yres();
+    cap.rotation = fb_rotation;
+    cap.since_key = FB_CAPTURE_KEY_INTERVAL;
+    cap_active = 1;
+    res = 0;
+
+    INFO("Frame capture started, %d kB\n", budget_kb);
+exit:
+    pthread_mutex_unlock(&cap_mutex);
+    return res;
+}
+
+void fb_capture_stop(void)
+{
+    pthread_mutex_lock(&cap_mutex);
+    cap_active = 0;
+    fb_capture_ring_free(&cap);
+    pthread_mutex_unlock(&cap_mutex);
+}
+
+int fb_capture_is_active(void)
+{
+    return cap_active;
+}
+
+void fb_capture_frame(const px_type *buffer, int stride, const fb_item_pos *rects, int rect_cnt)
+{
+    struct timespec start, end;
+    struct fb_capture_frame f;
+    uint8_t *dst;
+    const px_type *src;
+    uint32_t us;
+    int i, y;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_mutex_lock(&cap_mutex);
+    if(!cap_active)
+    {
+        pthread_mutex_unlock(&cap_mutex);
+        return;
+    }
+
+    f.time_us = ((uint64_t)start.tv_sec)*1000000 + start.tv_nsec/1000;
+    f.key = (rect_cnt == 1 && rects[0].w == cap.width && rects[0].h == cap.height);
+
+    if(f.key || cap.since_key >= FB_CAPTURE_KEY_INTERVAL)
+    {
+        f.key = 1;
+        f.rect_cnt = 1;
+        f.rects[0].x = f.rects[0].y = 0;
+        f.rects[0].w = cap.width;
+        f.rects[0].h = cap.height;
+    }
+    else
+    {
+        f.rect_cnt = imin(rect_cnt, FB_DAMAGE_MAX_RECTS);
+        memcpy(f.rects, rects, f.rect_cnt*sizeof(fb_item_pos));
+    }
+
+    f.size = 0;
+    for(i = 0; i < f.rect_cnt; ++i)
+        f.size += f.rects[i].w*f.rects[i].h*PIXEL_SIZE;
+
+    if(f.size > cap.data_size)
+    {
+        // does not fit at all, the next frame must be a key frame again
+        ++cap.dropped;
+        cap.since_key = FB_CAPTURE_KEY_INTERVAL;
+        pthread_mutex_unlock(&cap_mutex);
+        return;
+    }
+
+    f.offset = fb_capture_alloc(f.size);
+    cap.frames[(cap.first + cap.count) % FB_CAPTURE_MAX_FRAMES] = f;
+    ++cap.count;
+    cap.key_cnt += f.key;
+
+    dst = cap.data + f.offset;
+    for(i = 0; i < f.rect_cnt; ++i)
+    {
+        src = buffer + f.rects[i].y*stride + f.rects[i].x;
+        for(y = 0; y < f.rects[i].h; ++y)
+        {
+            memcpy(dst, src, f.rects[i].w*PIXEL_SIZE);
+            dst += f.rects[i].w*PIXEL_SIZE;
+            src += stride;
+        }
+    }
+
+    if(f.key)
+        cap.since_key = 1;
+    else if(cap.key_cnt == 0)
+        cap.since_key = FB_CAPTURE_KEY_INTERVAL;
+    else
+        ++cap.since_key;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    us = ((int64_t)(end.tv_sec - start.tv_sec))*1000000 + (end.tv_nsec - start.tv_nsec)/1000;
+
+    ++cap.captured;
+    cap.copied_bytes += f.size;
+    cap.total_us += us;
+    cap.max_us = imax(cap.max_us, us);
+    pthread_mutex_unlock(&cap_mutex);
+
+    fb_stats_add_capture(us);
+}
+
+int fb_capture_save(void)
+{
+    struct fb_capture_ring r;
+    struct fb_capture_frame *f;
+    char path[256];
+    FILE *raw = NULL, *idx = NULL;
+    uint8_t *row = NULL;
+    const px_type *src;
+    uint64_t offset = 0;
+    int i, n, y, first_key = -1, res = -1;
+
+    // Take the ring over, the draw thread can go on while it is written
+    pthread_mutex_lock(&cap_mutex);
+    r = cap;
+    memset(&cap, 0, sizeof(cap));
+    cap_active = 0;
+    pthread_mutex_unlock(&cap_mutex);
+
+    if(!r.data)
+    {
+        ERROR("Frame capture is not running\n");
+        return -1;
+    }
+
+    for(i = 0; i < r.count && first_key == -1; ++i)
+        if(r.frames[(r.first + i) % FB_CAPTURE_MAX_FRAMES].key)
+            first_key = i;
+
+    snprintf(path, sizeof(path), "%s/fb_capture.raw", mrom_dir());
+    raw = fopen(path, "we");
+    snprintf(path, sizeof(path), "%s/fb_capture.idx", mrom_dir());
+    idx = fopen(path, "we");
+    if(!raw || !idx)
+    {
+        ERROR("Failed to open %s/fb_capture.* for writing\n", mrom_dir());
+        goto exit;
+    }
+
+    fprintf(idx, "size %d %d\n", r.width, r.height);
+    fprintf(idx, "rotation %d\n", r.rotation);
+    fprintf(idx, "format rgb888\n");
+    fprintf(idx, "frames %d\n", first_key == -1 ? 0 : r.count - first_key);
+    fprintf(idx, "# captured %u, dropped %u, copied %llu bytes, %llu us total, %u us avg, %u us max\n",
+            r.captured, r.dropped, (unsigned long long)r.copied_bytes, (unsigned long long)r.total_us,
+            r.captured ? (uint32_t)(r.total_us/r.captured) : 0, r.max_us);
+
+    row = malloc(r.width*3);
+    for(i = first_key; i != -1 && i < r.count; ++i)
+    {
+        f = &r.frames[(r.first + i) % FB_CAPTURE_MAX_FRAMES];
+        src = (const px_type*)(r.data + f->offset);
+        for(n = 0; n < f->rect_cnt; ++n)
+        {
+            fprintf(idx, "%d %llu %llu %d %d %d %d\n", i - first_key, (unsigned long long)f->time_us,
+                    (unsigned long long)offset, f->rects[n].x, f->rects[n].y, f->rects[n].w, f->rects[n].h);
+
+            for(y = 0; y < f->rects[n].h; ++y)
+            {
+                fb_png_convert_row(row, src, f->rects[n].w);
+                fwrite(row, 3, f->rects[n].w, raw);
+                src += f->rects[n].w;
+            }
+            offset += f->rects[n].w*f->rects[n].h*3;
+        }
+    }
+
+    INFO("Frame capture saved to %s/fb_capture.*: %d frames, copies took %u us on average, %u us at most\n",
+            mrom_dir(), first_key == -1 ? 0 : r.count - first_key,
+            r.captured ? (uint32_t)(r.total_us/r.captured) : 0, r.max_us);
+    res = 0;
+exit:
+    if(raw)
+        fclose(raw);
+    if(idx)
+        fclose(idx);
+    free(row);
+    fb_capture_ring_free(&r);
+    return res;
+}
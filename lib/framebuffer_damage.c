@@ -0,0 +1,198 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "framebuffer.h"
+#include "framebuffer_priv.h"
+#include "util.h"
+
+static inline int pos_area(const fb_item_pos *p)
+{
+    return p->w * p->h;
+}
+
+static inline void pos_union(const fb_item_pos *a, const fb_item_pos *b, fb_item_pos *res)
+{
+    const int x = imin(a->x, b->x);
+    const int y = imin(a->y, b->y);
+    res->w = imax(a->x + a->w, b->x + b->w) - x;
+    res->h = imax(a->y + a->h, b->y + b->h) - y;
+    res->x = x;
+    res->y = y;
+}
+
+static inline int pos_contains(const fb_item_pos *a, const fb_item_pos *b)
+{
+    return b->x >= a->x && b->y >= a->y &&
+            b->x + b->w <= a->x + a->w && b->y + b->h <= a->y + a->h;
+}
+
+int fb_pos_intersect(const fb_item_pos *a, const fb_item_pos *b, fb_item_pos *res)
+{
+    const int x = imax(a->x, b->x);
+    const int y = imax(a->y, b->y);
+    const int w = imin(a->x + a->w, b->x + b->w) - x;
+    const int h = imin(a->y + a->h, b->y + b->h) - y;
+
+    if(w <= 0 || h <= 0)
+        return 0;
+
+    res->x = x;
+    res->y = y;
+    res->w = w;
+    res->h = h;
+    return 1;
+}
+
+void fb_damage_clear(fb_damage *d)
+{
+    d->count = 0;
+}
+
+void fb_damage_set_full(fb_damage *d)
+{
+    d->rects[0].x = 0;
+    d->rects[0].y = 0;
+    d->rects[0].w = fb_width;
+    d->rects[0].h = fb_height;
+    d->count = 1;
+}
+
+int fb_damage_is_full(const fb_damage *d)
+{
+    return d->count == 1 && d->rects[0].x == 0 && d->rects[0].y == 0 &&
+            d->rects[0].w == (int)fb_width && d->rects[0].h == (int)fb_height;
+}
+
+static void fb_damage_rm_at(fb_damage *d, int idx)
+{
+    --d->count;
+    if(idx != d->count)
+        d->rects[idx] = d->rects[d->count];
+}
+
+// Merge rectangles which are cheaper to process as one. Called after
+// rects[idx] grew, so only that one has to be checked against the rest.
+static void fb_damage_merge_from(fb_damage *d, int idx)
+{
+    int i;
+    fb_item_pos u;
+
+    for(i = 0; i < d->count; ++i)
+    {
+        if(i == idx)
+            continue;
+
+        pos_union(&d->rects[idx], &d->rects[i], &u);
+        if(pos_area(&u) > pos_area(&d->rects[idx]) + pos_area(&d->rects[i]))
+            continue;
+
+        d->rects[idx] = u;
+        fb_damage_rm_at(d, i);
+        if(idx == d->count)
+            idx = i;
+        i = -1; // start over, the grown rect might now touch others
+    }
+}
+
+void fb_damage_add(fb_damage *d, int x, int y, int w, int h)
+{
+    int i, best = 0, best_growth = -1;
+    fb_item_pos u;
+    const fb_item_pos screen = { 0, 0, fb_width, fb_height };
+    fb_item_pos p = { x, y, w, h };
+
+    if(!fb_pos_intersect(&p, &screen, &p))
+        return;
+
+    for(i = 0; i < d->count; ++i)
+    {
+        if(pos_contains(&d->rects[i], &p))
+            return;
+
+        pos_union(&d->rects[i], &p, &u);
+        if(pos_area(&u) <= pos_area(&d->rects[i]) + pos_area(&p))
+        {
+            d->rects[i] = u;
+            fb_damage_merge_from(d, i);
+            return;
+        }
+
+        if(best_growth == -1 || pos_area(&u) - pos_area(&d->rects[i]) < best_growth)
+        {
+            best_growth = pos_area(&u) - pos_area(&d->rects[i]);
+            best = i;
+        }
+    }
+
+    if(d->count < FB_DAMAGE_MAX_RECTS)
+    {
+        d->rects[d->count++] = p;
+        return;
+    }
+
+    pos_union(&d->rects[best], &p, &d->rects[best]);
+    fb_damage_merge_from(d, best);
+}
+
+void fb_damage_add_pos(fb_damage *d, const fb_item_pos *p)
+{
+    fb_damage_add(d, p->x, p->y, p->w, p->h);
+}
+
+void fb_damage_add_damage(fb_damage *d, const fb_damage *src)
+{
+    int i;
+    for(i = 0; i < src->count; ++i)
+        fb_damage_add_pos(d, &src->rects[i]);
+}
+
+void fb_damage_get_bounds(const fb_damage *d, fb_item_pos *res)
+{
+    int i;
+
+    if(d->count == 0)
+    {
+        memset(res, 0, sizeof(fb_item_pos));
+        return;
+    }
+
+    *res = d->rects[0];
+    for(i = 1; i < d->count; ++i)
+        pos_union(res, &d->rects[i], res);
+}
+
+int fb_damage_covers(const fb_damage *d, const fb_item_pos *p)
+{
+    int i;
+    for(i = 0; i < d->count; ++i)
+        if(pos_contains(&d->rects[i], p))
+            return 1;
+    return 0;
+}
+
+int fb_damage_intersects(const fb_damage *d, const fb_item_pos *p)
+{
+    int i;
+    fb_item_pos tmp;
+    for(i = 0; i < d->count; ++i)
+        if(fb_pos_intersect(&d->rects[i], p, &tmp))
+            return 1;
+    return 0;
+}
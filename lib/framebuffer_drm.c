@@ -0,0 +1,558 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <linux/fb.h>
+#include <drm/drm.h>
+#include <drm/drm_mode.h>
+#include <drm/drm_fourcc.h>
+
+#include "framebuffer.h"
+#include "log.h"
+#include "util.h"
+
+/*
+ * Framebuffer implementation for kernels which only have DRM. Frames are
+ * drawn into KMS dumb buffers and shown with page flips. wait_vsync waits
+ * for the event of the last page flip, so the draw thread starts a new
+ * frame right after the previous one got on screen.
+ *
+ * The first /dev/dri/cardN which has dumb buffers, a connected output and
+ * lets us become DRM master is used, MROM_DRM_DEVICE picks one instead.
+ * It works with the vkms virtual driver on a Linux host too:
+ *
+ *   modprobe vkms
+ *   MROM_DRM_DEVICE=/dev/dri/card1 <anything built with MR_FB_DRM>
+ */
+
+#ifdef MR_FB_DRM_BUFFERS
+#define NUM_BUFFERS MR_FB_DRM_BUFFERS
+#else
+#define NUM_BUFFERS 3
+#endif
+
+#define MAX_CARDS 8
+
+#if defined(RECOVERY_BGRA)
+#define DRM_PX_FORMAT DRM_FORMAT_XRGB8888
+#elif defined(RECOVERY_RGBX) || defined(RECOVERY_ABGR)
+#define DRM_PX_FORMAT DRM_FORMAT_XBGR8888
+#elif defined(RECOVERY_RGB_565)
+#define DRM_PX_FORMAT DRM_FORMAT_RGB565
+#else
+#error "Unknown pixel format"
+#endif
+
+struct fb_drm_buffer {
+    uint32_t handle;
+    uint32_t fb_id;
+    uint32_t pitch;
+    uint64_t size;
+    px_type *mem;
+};
+
+struct fb_drm_data {
+    int fd;
+    uint32_t connector_id;
+    uint32_t crtc_id;
+    int crtc_idx;
+    struct drm_mode_modeinfo mode;
+    struct drm_mode_crtc saved_crtc;
+    struct fb_drm_buffer buffers[NUM_BUFFERS];
+    int active_buff;  // the last one returned by get_frame_dest
+    int front_buff;   // the one on screen
+    int flip_pending; // the one being flipped to, -1 if none
+};
+
+static int drm_open_card(const char *path)
+{
+    struct drm_get_cap cap = { .capability = DRM_CAP_DUMB_BUFFER };
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+
+    // whoever has the card open already (e.g. a desktop) keeps it
+    if(ioctl(fd, DRM_IOCTL_SET_MASTER, 0) < 0)
+    {
+        INFO("DRM: can't become master of %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+
+    if(ioctl(fd, DRM_IOCTL_GET_CAP, &cap) < 0 || cap.value == 0)
+    {
+        INFO("DRM: %s doesn't have dumb buffers\n", path);
+        goto fail;
+    }
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+static int drm_get_connector(int fd, uint32_t id, struct drm_mode_get_connector *conn,
+        struct drm_mode_modeinfo **modes, uint32_t **encoders)
+{
+    uint32_t count_modes, count_encoders;
+
+    memset(conn, 0, sizeof(*conn));
+    conn->connector_id = id;
+    if(ioctl(fd, DRM_IOCTL_MODE_GETCONNECTOR, conn) < 0)
+        return -1;
+
+    count_modes = conn->count_modes;
+    count_encoders = conn->count_encoders;
+    *modes = calloc(imax(count_modes, 1), sizeof(struct drm_mode_modeinfo));
+    *encoders = calloc(imax(count_encoders, 1), sizeof(uint32_t));
+    conn->modes_ptr = (uintptr_t)*modes;
+    conn->encoders_ptr = (uintptr_t)*encoders;
+    conn->count_props = 0;
+    conn->props_ptr = 0;
+    conn->prop_values_ptr = 0;
+
+    // the kernel copies nothing if a hotplug in between added modes,
+    // such connector is skipped
+    if(ioctl(fd, DRM_IOCTL_MODE_GETCONNECTOR, conn) < 0 ||
+        conn->count_modes > count_modes || conn->count_encoders > count_encoders)
+    {
+        free(*modes);
+        free(*encoders);
+        return -1;
+    }
+    return 0;
+}
+
+// Returns index of a CRTC in crtcs which can drive the connector
+static int drm_find_crtc(int fd, const struct drm_mode_get_connector *conn,
+        const uint32_t *encoders, const uint32_t *crtcs, int crtc_cnt)
+{
+    struct drm_mode_get_encoder enc;
+    uint32_t i;
+    int c;
+
+    // keep the CRTC the connector already uses, if any
+    if(conn->encoder_id)
+    {
+        memset(&enc, 0, sizeof(enc));
+        enc.encoder_id = conn->encoder_id;
+        if(ioctl(fd, DRM_IOCTL_MODE_GETENCODER, &enc) >= 0 && enc.crtc_id)
+        {
+            for(c = 0; c < crtc_cnt; ++c)
+                if(crtcs[c] == enc.crtc_id)
+                    return c;
+        }
+    }
+
+    for(i = 0; i < conn->count_encoders; ++i)
+    {
+        memset(&enc, 0, sizeof(enc));
+        enc.encoder_id = encoders[i];
+        if(ioctl(fd, DRM_IOCTL_MODE_GETENCODER, &enc) < 0)
+            continue;
+
+        for(c = 0; c < crtc_cnt; ++c)
+            if(enc.possible_crtcs & (1 << c))
+                return c;
+    }
+    return -1;
+}
+
+static int drm_find_output(struct fb_drm_data *data)
+{
+    struct drm_mode_card_res res;
+    struct drm_mode_get_connector conn;
+    struct drm_mode_modeinfo *modes;
+    uint32_t *connectors = NULL, *crtcs = NULL, *encoders;
+    uint32_t i, m;
+    int crtc_idx, found = -1;
+
+    memset(&res, 0, sizeof(res));
+    if(ioctl(data->fd, DRM_IOCTL_MODE_GETRESOURCES, &res) < 0)
+        return -1;
+
+    connectors = calloc(imax(res.count_connectors, 1), sizeof(uint32_t));
+    crtcs = calloc(imax(res.count_crtcs, 1), sizeof(uint32_t));
+    res.connector_id_ptr = (uintptr_t)connectors;
+    res.crtc_id_ptr = (uintptr_t)crtcs;
+    res.count_fbs = res.count_encoders = 0;
+    res.fb_id_ptr = res.encoder_id_ptr = 0;
+
+    if(ioctl(data->fd, DRM_IOCTL_MODE_GETRESOURCES, &res) < 0)
+        goto exit;
+
+    for(i = 0; i < res.count_connectors && found == -1; ++i)
+    {
+        if(drm_get_connector(data->fd, connectors[i], &conn, &modes, &encoders) < 0)
+            continue;
+
+        if(conn.connection == 1 && conn.count_modes > 0)
+        {
+            crtc_idx = drm_find_crtc(data->fd, &conn, encoders, crtcs, res.count_crtcs);
+            if(crtc_idx >= 0)
+            {
+                data->connector_id = conn.connector_id;
+                data->crtc_id = crtcs[crtc_idx];
+                data->crtc_idx = crtc_idx;
+
+                data->mode = modes[0];
+                for(m = 0; m < conn.count_modes; ++m)
+                {
+                    if(modes[m].type & DRM_MODE_TYPE_PREFERRED)
+                    {
+                        data->mode = modes[m];
+                        break;
+                    }
+                }
+                found = 0;
+            }
+        }
+
+        free(modes);
+        free(encoders);
+    }
+
+exit:
+    free(connectors);
+    free(crtcs);
+    return found;
+}
+
+static int drm_create_buffer(struct fb_drm_data *data, struct fb_drm_buffer *buf)
+{
+    struct drm_mode_create_dumb create;
+    struct drm_mode_map_dumb map;
+    struct drm_mode_fb_cmd2 cmd;
+    void *mem;
+
+    memset(&create, 0, sizeof(create));
+    create.width = data->mode.hdisplay;
+    create.height = data->mode.vdisplay;
+    create.bpp = PIXEL_SIZE*8;
+    if(ioctl(data->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0)
+    {
+        ERROR("DRM: failed to create dumb buffer: %s\n", strerror(errno));
+        return -1;
+    }
+
+    buf->handle = create.handle;
+    buf->pitch = create.pitch;
+    buf->size = create.size;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.width = create.width;
+    cmd.height = create.height;
+    cmd.pixel_format = DRM_PX_FORMAT;
+    cmd.handles[0] = buf->handle;
+    cmd.pitches[0] = buf->pitch;
+    if(ioctl(data->fd, DRM_IOCTL_MODE_ADDFB2, &cmd) < 0)
+    {
+        ERROR("DRM: failed to add framebuffer: %s\n", strerror(errno));
+        return -1;
+    }
+    buf->fb_id = cmd.fb_id;
+
+    memset(&map, 0, sizeof(map));
+    map.handle = buf->handle;
+    if(ioctl(data->fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0)
+    {
+        ERROR("DRM: failed to map dumb buffer: %s\n", strerror(errno));
+        return -1;
+    }
+
+    mem = mmap(0, buf->size, PROT_READ | PROT_WRITE, MAP_SHARED, data->fd, map.offset);
+    if(mem == MAP_FAILED)
+    {
+        ERROR("DRM: mmap failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    buf->mem = mem;
+    memset(buf->mem, 0, buf->size);
+    return 0;
+}
+
+static void drm_destroy_buffer(struct fb_drm_data *data, struct fb_drm_buffer *buf)
+{
+    struct drm_mode_destroy_dumb destroy;
+
+    if(buf->mem)
+        munmap(buf->mem, buf->size);
+    if(buf->fb_id)
+        ioctl(data->fd, DRM_IOCTL_MODE_RMFB, &buf->fb_id);
+    if(buf->handle)
+    {
+        memset(&destroy, 0, sizeof(destroy));
+        destroy.handle = buf->handle;
+        ioctl(data->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    }
+    memset(buf, 0, sizeof(*buf));
+}
+
+// Reads events until the pending page flip is done
+static int drm_wait_flip(struct fb_drm_data *data)
+{
+    char buff[1024];
+    struct pollfd fds = { .fd = data->fd, .events = POLLIN };
+    struct drm_event *ev;
+    struct drm_event_vblank *vb;
+    int len, i, r;
+
+    while(data->flip_pending != -1)
+    {
+        // a flip which is not done in a second is never going to be
+        r = poll(&fds, 1, 1000);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r <= 0)
+        {
+            ERROR("DRM: page flip did not finish\n");
+            data->front_buff = data->flip_pending;
+            data->flip_pending = -1;
+            return -1;
+        }
+
+        len = read(data->fd, buff, sizeof(buff));
+        for(i = 0; i + (int)sizeof(struct drm_event) <= len; i += ev->length)
+        {
+            ev = (struct drm_event*)(buff + i);
+            if(ev->length < sizeof(struct drm_event))
+                break;
+
+            if(ev->type == DRM_EVENT_FLIP_COMPLETE)
+            {
+                vb = (struct drm_event_vblank*)ev;
+                data->front_buff = (int)vb->user_data;
+                data->flip_pending = -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void drm_set_vi(struct framebuffer *fb, struct fb_drm_data *data)
+{
+    const struct drm_mode_modeinfo *m = &data->mode;
+
+    memset(&fb->vi, 0, sizeof(fb->vi));
+    memset(&fb->fi, 0, sizeof(fb->fi));
+
+    fb->vi.xres = m->hdisplay;
+    fb->vi.yres = m->vdisplay;
+    fb->vi.xres_virtual = data->buffers[0].pitch / PIXEL_SIZE;
+    fb->vi.yres_virtual = m->vdisplay * NUM_BUFFERS;
+    fb->vi.bits_per_pixel = PIXEL_SIZE * 8;
+
+    // fb_vsync_init() derives the frame interval from these
+    if(m->clock)
+        fb->vi.pixclock = 1000000000 / m->clock;
+    fb->vi.right_margin = m->hsync_start - m->hdisplay;
+    fb->vi.hsync_len = m->hsync_end - m->hsync_start;
+    fb->vi.left_margin = m->htotal - m->hsync_end;
+    fb->vi.lower_margin = m->vsync_start - m->vdisplay;
+    fb->vi.vsync_len = m->vsync_end - m->vsync_start;
+    fb->vi.upper_margin = m->vtotal - m->vsync_end;
+
+    fb->fi.line_length = data->buffers[0].pitch;
+    fb->fi.smem_len = fb->fi.line_length * fb->vi.yres_virtual;
+    strcpy(fb->fi.id, "drm");
+}
+
+static void impl_close(struct framebuffer *fb);
+
+static int impl_open(struct framebuffer *fb)
+{
+    struct fb_drm_data *data;
+    struct drm_mode_crtc crtc;
+    const char *dev = getenv("MROM_DRM_DEVICE");
+    char path[64];
+    int i;
+
+    data = mzalloc(sizeof(struct fb_drm_data));
+    data->fd = -1;
+    data->flip_pending = -1;
+    fb->impl_data = data;
+
+    if(dev)
+    {
+        data->fd = drm_open_card(dev);
+        if(data->fd >= 0 && drm_find_output(data) < 0)
+        {
+            ERROR("DRM: %s has no connected output\n", dev);
+            close(data->fd);
+            data->fd = -1;
+        }
+    }
+    else
+    {
+        for(i = 0; i < MAX_CARDS && data->fd < 0; ++i)
+        {
+            snprintf(path, sizeof(path), "/dev/dri/card%d", i);
+            data->fd = drm_open_card(path);
+            if(data->fd >= 0 && drm_find_output(data) < 0)
+            {
+                close(data->fd);
+                data->fd = -1;
+            }
+        }
+    }
+
+    if(data->fd < 0)
+        goto fail;
+
+    memset(&data->saved_crtc, 0, sizeof(data->saved_crtc));
+    data->saved_crtc.crtc_id = data->crtc_id;
+    ioctl(data->fd, DRM_IOCTL_MODE_GETCRTC, &data->saved_crtc);
+
+    for(i = 0; i < NUM_BUFFERS; ++i)
+        if(drm_create_buffer(data, &data->buffers[i]) < 0)
+            goto fail;
+
+    memset(&crtc, 0, sizeof(crtc));
+    crtc.crtc_id = data->crtc_id;
+    crtc.fb_id = data->buffers[0].fb_id;
+    crtc.set_connectors_ptr = (uintptr_t)&data->connector_id;
+    crtc.count_connectors = 1;
+    crtc.mode = data->mode;
+    crtc.mode_valid = 1;
+    if(ioctl(data->fd, DRM_IOCTL_MODE_SETCRTC, &crtc) < 0)
+    {
+        ERROR("DRM: failed to set mode %s: %s\n", data->mode.name, strerror(errno));
+        goto fail;
+    }
+
+    drm_set_vi(fb, data);
+    fb->num_buffers = NUM_BUFFERS;
+
+    INFO("DRM: %s %dx%d@%d, pitch %u, %d buffers\n", data->mode.name, data->mode.hdisplay,
+            data->mode.vdisplay, data->mode.vrefresh, data->buffers[0].pitch, NUM_BUFFERS);
+    return 0;
+
+fail:
+    impl_close(fb);
+    return -1;
+}
+
+static void impl_close(struct framebuffer *fb)
+{
+    struct fb_drm_data *data = fb->impl_data;
+    int i;
+
+    if(!data)
+        return;
+
+    if(data->fd >= 0)
+    {
+        drm_wait_flip(data);
+
+        // give the display back the way we found it
+        if(data->saved_crtc.mode_valid)
+        {
+            data->saved_crtc.set_connectors_ptr = (uintptr_t)&data->connector_id;
+            data->saved_crtc.count_connectors = 1;
+            ioctl(data->fd, DRM_IOCTL_MODE_SETCRTC, &data->saved_crtc);
+        }
+
+        for(i = 0; i < NUM_BUFFERS; ++i)
+            drm_destroy_buffer(data, &data->buffers[i]);
+
+        ioctl(data->fd, DRM_IOCTL_DROP_MASTER, 0);
+        close(data->fd);
+    }
+
+    free(data);
+    fb->impl_data = NULL;
+}
+
+static int impl_update(struct framebuffer *fb)
+{
+    struct fb_drm_data *data = fb->impl_data;
+    struct drm_mode_crtc_page_flip flip;
+
+    // only one flip can be queued at a time
+    drm_wait_flip(data);
+
+    fb->vi.yoffset = data->active_buff * fb->vi.yres;
+
+    memset(&flip, 0, sizeof(flip));
+    flip.crtc_id = data->crtc_id;
+    flip.fb_id = data->buffers[data->active_buff].fb_id;
+    flip.flags = DRM_MODE_PAGE_FLIP_EVENT;
+    flip.user_data = data->active_buff;
+    if(ioctl(data->fd, DRM_IOCTL_MODE_PAGE_FLIP, &flip) < 0)
+    {
+        ERROR("DRM: page flip failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    data->flip_pending = data->active_buff;
+    return 0;
+}
+
+static int impl_wait_vsync(struct framebuffer *fb)
+{
+    struct fb_drm_data *data = fb->impl_data;
+    union drm_wait_vblank vbl;
+
+    if(data->flip_pending != -1)
+        return drm_wait_flip(data);
+
+    // nothing was presented since the last one, wait for a vblank instead
+    memset(&vbl, 0, sizeof(vbl));
+    vbl.request.type = _DRM_VBLANK_RELATIVE;
+    if(data->crtc_idx == 1)
+        vbl.request.type |= _DRM_VBLANK_SECONDARY;
+    else if(data->crtc_idx > 1)
+        vbl.request.type |= (data->crtc_idx << _DRM_VBLANK_HIGH_CRTC_SHIFT) & _DRM_VBLANK_HIGH_CRTC_MASK;
+    vbl.request.sequence = 1;
+
+    if(ioctl(data->fd, DRM_IOCTL_WAIT_VBLANK, &vbl) < 0)
+        return -1;
+    return 0;
+}
+
+static void *impl_get_frame_dest(struct framebuffer *fb)
+{
+    struct fb_drm_data *data = fb->impl_data;
+
+    data->active_buff = (data->active_buff + 1) % NUM_BUFFERS;
+
+    // with double buffering, the next buffer is still on screen until
+    // the pending flip is done
+    if(data->active_buff == data->front_buff && data->flip_pending != -1)
+        drm_wait_flip(data);
+
+    return data->buffers[data->active_buff].mem;
+}
+
+const struct fb_impl fb_impl_drm = {
+    .name = "DRM",
+    .impl_id = FB_IMPL_DRM,
+
+    .open = impl_open,
+    .close = impl_close,
+    .update = impl_update,
+    .get_frame_dest = impl_get_frame_dest,
+    .wait_vsync = impl_wait_vsync,
+};
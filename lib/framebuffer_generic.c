@@ -24,6 +24,7 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <string.h>
+#include <errno.h>
 #include <linux/fb.h>
 
 #include "framebuffer.h"
@@ -122,6 +123,7 @@ static int impl_open(struct framebuffer *fb)
     data->mapped[1] = (px_type*) (((uint8_t*)mapped) + (fb->vi.yres * fb->fi.line_length));
 
     fb->impl_data = data;
+    fb->num_buffers = NUM_BUFFERS;
 
 #ifdef TW_SCREEN_BLANK_ON_BOOT
     ioctl(fb->fd, FBIOBLANK, FB_BLANK_POWERDOWN);
@@ -158,6 +160,19 @@ static int impl_update(struct framebuffer *fb)
     return 0;
 }
 
+#ifdef MR_GENERIC_FB_USE_VSYNC
+static int impl_wait_vsync(struct framebuffer *fb)
+{
+    uint32_t crtc = 0;
+    if(ioctl(fb->fd, FBIO_WAITFORVSYNC, &crtc) < 0)
+    {
+        ERROR("FBIO_WAITFORVSYNC failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+#endif
+
 static void *impl_get_frame_dest(struct framebuffer *fb)
 {
     struct fb_generic_data *data = fb->impl_data;
@@ -173,4 +188,7 @@ const struct fb_impl fb_impl_generic = {
     .close = impl_close,
     .update = impl_update,
     .get_frame_dest = impl_get_frame_dest,
+#ifdef MR_GENERIC_FB_USE_VSYNC
+    .wait_vsync = impl_wait_vsync,
+#endif
 };
@@ -0,0 +1,236 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <linux/fb.h>
+
+#include "framebuffer.h"
+#include "log.h"
+#include "util.h"
+
+/*
+ * Framebuffer implementation without a display. Frames are presented
+ * into memory, so the UI can run on a host machine, e.g. to measure
+ * frame times. It is used when all the other implementations fail,
+ * e.g. because there is no /dev/graphics/fb0. It is configured by
+ * environment variables:
+ *
+ *   MROM_HEADLESS_RES       resolution, "1080x1920" by default
+ *   MROM_HEADLESS_HZ        refresh rate of the simulated vsync, 60 by
+ *                           default, 0 disables vsync
+ *   MROM_HEADLESS_DUMP      "png" or "raw" to save every presented frame
+ *   MROM_HEADLESS_DUMP_DIR  where to save the frames, /tmp by default
+ *
+ * The pixel format is the one MultiROM was compiled with. Raw frames
+ * are the bare pixels, without the stride padding.
+ */
+
+#define NUM_BUFFERS 2
+#define DEFAULT_W 1080
+#define DEFAULT_H 1920
+#define DEFAULT_HZ 60
+#define DEFAULT_DUMP_DIR "/tmp"
+
+enum
+{
+    DUMP_NONE,
+    DUMP_PNG,
+    DUMP_RAW,
+};
+
+struct fb_headless_data {
+    px_type *mem;
+    px_type *buffers[NUM_BUFFERS];
+    int active_buff;
+    int dump;
+    char dump_dir[128];
+    uint32_t frame_cnt;
+    int64_t vsync_period_ns;
+    struct timespec vsync_start;
+};
+
+static int env_int(const char *name, int def)
+{
+    const char *val = getenv(name);
+    return val ? atoi(val) : def;
+}
+
+static int impl_open(struct framebuffer *fb)
+{
+    int w = DEFAULT_W, h = DEFAULT_H, hz;
+    const char *res = getenv("MROM_HEADLESS_RES");
+    const char *dump = getenv("MROM_HEADLESS_DUMP");
+    const char *dump_dir = getenv("MROM_HEADLESS_DUMP_DIR");
+    struct fb_headless_data *data;
+
+    if(res && (sscanf(res, "%dx%d", &w, &h) != 2 || w <= 0 || h <= 0))
+    {
+        ERROR("Invalid MROM_HEADLESS_RES \"%s\"\n", res);
+        return -1;
+    }
+
+    hz = env_int("MROM_HEADLESS_HZ", DEFAULT_HZ);
+
+    memset(&fb->vi, 0, sizeof(fb->vi));
+    memset(&fb->fi, 0, sizeof(fb->fi));
+
+    fb->vi.xres = fb->vi.xres_virtual = w;
+    fb->vi.yres = h;
+    fb->vi.yres_virtual = h * NUM_BUFFERS;
+    fb->vi.bits_per_pixel = PIXEL_SIZE * 8;
+    // fb_vsync_init() derives the frame interval from pixclock
+    if(hz > 0)
+        fb->vi.pixclock = 1000000000000ULL / ((uint64_t)hz * w * h);
+
+    fb->fi.line_length = w * PIXEL_SIZE;
+    fb->fi.smem_len = fb->fi.line_length * fb->vi.yres_virtual;
+    strcpy(fb->fi.id, "headless");
+
+    data = mzalloc(sizeof(struct fb_headless_data));
+    data->mem = calloc(1, fb->fi.smem_len);
+    if(!data->mem)
+    {
+        free(data);
+        return -1;
+    }
+
+    data->buffers[0] = data->mem;
+    data->buffers[1] = (px_type*)(((uint8_t*)data->mem) + fb->vi.yres * fb->fi.line_length);
+
+    if(hz > 0)
+    {
+        data->vsync_period_ns = 1000000000LL / hz;
+        clock_gettime(CLOCK_MONOTONIC, &data->vsync_start);
+    }
+
+    if(dump && strcmp(dump, "png") == 0)
+        data->dump = DUMP_PNG;
+    else if(dump && strcmp(dump, "raw") == 0)
+        data->dump = DUMP_RAW;
+    snprintf(data->dump_dir, sizeof(data->dump_dir), "%s", dump_dir ? dump_dir : DEFAULT_DUMP_DIR);
+
+    fb->impl_data = data;
+    fb->num_buffers = NUM_BUFFERS;
+
+    INFO("Headless framebuffer: %dx%d @ %dbpp, %d Hz\n", w, h, fb->vi.bits_per_pixel, imax(hz, 0));
+    return 0;
+}
+
+static void impl_close(struct framebuffer *fb)
+{
+    struct fb_headless_data *data = fb->impl_data;
+    if(data)
+    {
+        free(data->mem);
+        free(data);
+        fb->impl_data = NULL;
+    }
+}
+
+static int dump_raw(const char *path, struct framebuffer *fb, px_type *frame)
+{
+    uint32_t y;
+    const size_t row_len = fb->vi.xres * PIXEL_SIZE;
+    FILE *f = fopen(path, "we");
+    if(!f)
+    {
+        ERROR("Failed to open %s for writing: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    for(y = 0; y < fb->vi.yres; ++y)
+    {
+        if(fwrite(frame + y*fb->stride, 1, row_len, f) != row_len)
+        {
+            ERROR("Failed to write %s\n", path);
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static int impl_update(struct framebuffer *fb)
+{
+    struct fb_headless_data *data = fb->impl_data;
+    px_type *frame = data->buffers[data->active_buff];
+    char path[192];
+
+    fb->vi.yoffset = data->active_buff * fb->vi.yres;
+    ++data->frame_cnt;
+
+    switch(data->dump)
+    {
+        case DUMP_PNG:
+            snprintf(path, sizeof(path), "%s/frame_%06u.png", data->dump_dir, data->frame_cnt);
+            return fb_png_save_img(path, fb->vi.xres, fb->vi.yres, fb->stride, frame);
+        case DUMP_RAW:
+            snprintf(path, sizeof(path), "%s/frame_%06u.raw", data->dump_dir, data->frame_cnt);
+            return dump_raw(path, fb, frame);
+    }
+    return 0;
+}
+
+// Sleeps until the next multiple of the refresh period since open
+static int impl_wait_vsync(struct framebuffer *fb)
+{
+    struct fb_headless_data *data = fb->impl_data;
+    struct timespec now, next;
+    int64_t elapsed, target;
+
+    if(data->vsync_period_ns == 0)
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = ((int64_t)(now.tv_sec - data->vsync_start.tv_sec))*1000000000LL +
+            (now.tv_nsec - data->vsync_start.tv_nsec);
+    target = (elapsed / data->vsync_period_ns + 1) * data->vsync_period_ns;
+
+    next.tv_sec = data->vsync_start.tv_sec + target / 1000000000LL;
+    next.tv_nsec = data->vsync_start.tv_nsec + target % 1000000000LL;
+    if(next.tv_nsec >= 1000000000L)
+    {
+        ++next.tv_sec;
+        next.tv_nsec -= 1000000000L;
+    }
+
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+    return 0;
+}
+
+static void *impl_get_frame_dest(struct framebuffer *fb)
+{
+    struct fb_headless_data *data = fb->impl_data;
+    data->active_buff = !data->active_buff;
+    return data->buffers[data->active_buff];
+}
+
+const struct fb_impl fb_impl_headless = {
+    .name = "Headless",
+    .impl_id = FB_IMPL_HEADLESS,
+
+    .open = impl_open,
+    .close = impl_close,
+    .update = impl_update,
+    .get_frame_dest = impl_get_frame_dest,
+    .wait_vsync = impl_wait_vsync,
+};
@@ -25,9 +25,11 @@
 #include <signal.h>
 #include <pthread.h>
 #include <png.h>
+#include <zlib.h>
 
 #include "log.h"
 #include "framebuffer.h"
+#include "framebuffer_priv.h"
 #include "util.h"
 #include "containers.h"
 
@@ -44,6 +46,7 @@ struct png_cache_entry
     int width;
     int height;
     int refcnt;
+    int opaque;
 };
 
 static struct png_cache_entry **png_cache = NULL;
@@ -95,7 +98,7 @@ static px_type *scale_png_img(px_type *fi_data, int orig_w, int orig_h, int new_
     return (px_type*)out;
 }
 
-static px_type *load_png(const char *path, int destW, int destH)
+static px_type *load_png(const char *path, int destW, int destH, int *opaque)
 {
     FILE *fp;
     unsigned char header[8];
@@ -172,6 +175,7 @@ static px_type *load_png(const char *path, int destW, int destH)
     data_dest = malloc(PIXEL_SIZE * width * height);
 #endif
     data_itr = data_dest;
+    *opaque = 1;
 
     bytes_per_row = png_get_rowbytes(png_ptr, info_ptr);
     rows = malloc(sizeof(png_bytep)*height);
@@ -187,6 +191,8 @@ static px_type *load_png(const char *path, int destW, int destH)
             {
                 src_pix = ((uint32_t*)rows[y])[i];
                 src_pix = (src_pix & 0xFF00FF00) | ((src_pix & 0xFF0000) >> 16) | ((src_pix & 0xFF) << 16);
+                if((src_pix >> 24) != 0xFF)
+                    *opaque = 0;
             }
             else //if(channels == 3) - no other option
             {
@@ -221,6 +227,7 @@ exit:
 static void destroy_png_cache_entry(void *entry)
 {
     struct png_cache_entry *e = (struct png_cache_entry*)entry;
+    fb_stats_cache_resize(FB_CACHE_PNG, -1, -e->width*e->height*4);
     free(e->path);
     free(e->data);
     free(e);
@@ -235,13 +242,16 @@ px_type *fb_png_get(const char *path, int w, int h)
         if((*itr)->width == w && (*itr)->height == h && strcmp(path, (*itr)->path) == 0)
         {
             ++(*itr)->refcnt;
+            fb_stats_cache_lookup(FB_CACHE_PNG, 1);
             PNG_LOG("PNG %s (%dx%d) %p found in cache, refcnt increased to %d\n", path, w, h, (*itr)->data, (*itr)->refcnt);
             return (*itr)->data;
         }
     }
 
     // not in cache yet, load and create cache entry
-    px_type *data = load_png(path, w, h);
+    fb_stats_cache_lookup(FB_CACHE_PNG, 0);
+    int opaque = 0;
+    px_type *data = load_png(path, w, h, &opaque);
     if(!data)
     {
         PNG_LOG("PNG %s (%dx%d) failed to load\n", path, w, h);
@@ -255,8 +265,10 @@ px_type *fb_png_get(const char *path, int w, int h)
     e->width = w;
     e->height = h;
     e->refcnt = 1;
+    e->opaque = opaque;
 
     list_add(&png_cache, e);
+    fb_stats_cache_resize(FB_CACHE_PNG, 1, w*h*4);
     PNG_LOG("PNG %s (%dx%d) %p added into cache\n", path, w, h, data);
     return data;
 }
@@ -276,6 +288,17 @@ void fb_png_release(px_type *data)
     PNG_LOG("PNG %p not found in cache!\n", data);
 }
 
+int fb_png_is_opaque(px_type *data)
+{
+    struct png_cache_entry **itr;
+    for(itr = png_cache; itr && *itr; ++itr)
+    {
+        if((*itr)->data == data)
+            return (*itr)->opaque;
+    }
+    return 0;
+}
+
 void fb_png_drop_unused(void)
 {
     struct png_cache_entry **itr;
@@ -294,11 +317,14 @@ void fb_png_drop_unused(void)
     }
 }
 
-static inline void convert_fb_px_to_rgb888(px_type src, uint8_t *dest)
+void fb_png_convert_row(uint8_t *dst, const px_type *src, int count)
 {
-    dest[0] = PX_GET_R(src);
-    dest[1] = PX_GET_G(src);
-    dest[2] = PX_GET_B(src);
+    for(; count > 0; --count, ++src, dst += 3)
+    {
+        dst[0] = PX_GET_R(*src);
+        dst[1] = PX_GET_G(*src);
+        dst[2] = PX_GET_B(*src);
+    }
 }
 
 int fb_png_save_img(const char *path, int w, int h, int stride, px_type *data)
@@ -307,10 +333,8 @@ int fb_png_save_img(const char *path, int w, int h, int stride, px_type *data)
     png_structp png_ptr = NULL;
     png_infop info_ptr = NULL;
     int res = -1;
-    int y, x;
+    int y;
     uint8_t *row = NULL;
-    const int stride_leftover = stride - w;
-    const int w_png_bytes = w * 3;
     px_type * volatile itr = data;
 
     fp = fopen(path, "we");
@@ -332,6 +356,12 @@ int fb_png_save_img(const char *path, int w, int h, int stride, px_type *data)
         goto exit;
 
     png_init_io(png_ptr, fp);
+
+    // Screenshots and dumped frames are mostly flat areas, the fastest
+    // zlib level and the cheap SUB filter compress those well enough
+    png_set_compression_level(png_ptr, Z_BEST_SPEED);
+    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_SUB);
+
     png_set_IHDR(png_ptr, info_ptr, w, h,
          8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
          PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
@@ -340,23 +370,16 @@ int fb_png_save_img(const char *path, int w, int h, int stride, px_type *data)
     row = malloc(w*3);
     for(y = 0; y < h; ++y)
     {
-        for(x = 0; x < w_png_bytes; x += 3)
-        {
-            convert_fb_px_to_rgb888(*itr, row + x);
-            ++itr;
-        }
-        itr += stride_leftover;
-
+        fb_png_convert_row(row, itr, w);
+        itr += stride;
         png_write_row(png_ptr, row);
     }
 
     png_write_end(png_ptr, NULL);
     res = 0;
 exit:
-    if(info_ptr)
-        png_free_data(png_ptr, info_ptr, PNG_FREE_ALL, -1);
     if(png_ptr)
-        png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+        png_destroy_write_struct(&png_ptr, &info_ptr);
     if(fp)
         fclose(fp);
     if(row)
@@ -0,0 +1,120 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_FRAMEBUFFER_PRIV
+#define H_FRAMEBUFFER_PRIV
+
+#include "framebuffer.h"
+
+// Damaged region of the screen, in fb_width x fb_height coordinates.
+// It is kept as a short list of rectangles, neighbouring ones are merged
+// together and when the list is full, the new rectangle is merged into
+// the one which grows the least.
+#define FB_DAMAGE_MAX_RECTS 8
+
+typedef struct
+{
+    fb_item_pos rects[FB_DAMAGE_MAX_RECTS];
+    int count;
+} fb_damage;
+
+void fb_damage_clear(fb_damage *d);
+void fb_damage_add(fb_damage *d, int x, int y, int w, int h);
+void fb_damage_add_pos(fb_damage *d, const fb_item_pos *p);
+void fb_damage_add_damage(fb_damage *d, const fb_damage *src);
+void fb_damage_set_full(fb_damage *d);
+int fb_damage_is_full(const fb_damage *d);
+void fb_damage_get_bounds(const fb_damage *d, fb_item_pos *res);
+// returns 1 if p lies entirely within one of d's rectangles
+int fb_damage_covers(const fb_damage *d, const fb_item_pos *p);
+// returns 1 if p overlaps any of d's rectangles
+int fb_damage_intersects(const fb_damage *d, const fb_item_pos *p);
+
+static inline int fb_damage_is_empty(const fb_damage *d)
+{
+    return d->count == 0;
+}
+
+// returns 0 if a and b do not intersect
+int fb_pos_intersect(const fb_item_pos *a, const fb_item_pos *b, fb_item_pos *res);
+
+// Blending kernels from framebuffer_blend.c, they process one row of pixels.
+// fb_blend_img_row's src is in the fb_img data format, RGB565 images have
+// 5 and 6 bit alpha in the two bytes following each pixel.
+void fb_blend_rect_row(px_type *dst, px_type color, uint8_t alpha, int count);
+void fb_blend_img_row(px_type *dst, const px_type *src, int count);
+// Solid color blended with alpha scaled by per-pixel coverage from mask
+void fb_blend_mask_row(px_type *dst, px_type color, uint8_t alpha, const uint8_t *mask, int count);
+// Text: blends like fb_blend_img_row would an image of color with alpha
+// from mask, color's own alpha is ignored.
+void fb_blend_coverage_row(px_type *dst, px_type color, const uint8_t *mask, int count);
+
+// Coverage of the top left rounded corner of fb_shape items, shared by all
+// shapes with the same radius. From framebuffer_shape.c.
+struct fb_shape_mask
+{
+    int radius2; // in 1/2 of a pixel
+    int size;    // the corner is size x size pixels
+    int refcnt;
+    uint8_t *coverage;
+    uint8_t *coverage_mirrored; // each row reversed, for the right corners
+    int *span_start; // per row, first pixel with non-zero coverage
+    int *span_solid; // per row, start of the fully covered rest of the row
+};
+
+fb_shape_mask *fb_shape_mask_get(int radius2);
+void fb_shape_mask_release(fb_shape_mask *mask);
+
+// The draw thread renders frames from a snapshot of the items, data
+// the items point to must not be changed in place while it is in use.
+// Frees data an item has stopped using once the frame is done,
+// fb_ctx.mutex must be locked.
+void fb_defer_free(void *data);
+
+// Copies rectangle r of the width x height src into dst, which is src
+// rotated by 90, 180 or 270 degrees. Strides are in pixels.
+void fb_rotate_rect(px_type *dst, int dst_stride, const px_type *src, int src_stride,
+        int width, int height, int rotation, const fb_item_pos *r);
+
+// Frame statistics, framebuffer_stats.c. The draw thread brackets each
+// frame with begin and end, the rest may be called from any thread.
+void fb_stats_frame_begin(void);
+void fb_stats_frame_end(void);
+void fb_stats_add_present(uint32_t us);
+void fb_stats_add_items(uint32_t items, uint32_t blended_px);
+void fb_stats_add_capture(uint32_t us);
+void fb_stats_add_pool_cpu(uint32_t us);
+void fb_stats_cache_lookup(int cache, int hit);
+void fb_stats_cache_resize(int cache, int entries, int bytes);
+void fb_stats_cache_evict(int cache);
+
+// Converts count pixels to RGB888, framebuffer_png.c
+void fb_png_convert_row(uint8_t *dst, const px_type *src, int count);
+
+// Frame capture, framebuffer_capture.c. Called by the draw thread with
+// each presented frame and its damaged rectangles in device coordinates.
+void fb_capture_frame(const px_type *buffer, int stride, const fb_item_pos *rects, int rect_cnt);
+
+// Render thread pool, framebuffer_render.c
+typedef void (*fb_band_job)(const fb_item_pos *band, void *data);
+void fb_render_pool_start(void);
+void fb_render_pool_stop(void);
+// Splits area into horizontal bands and runs job on each of them in
+// parallel, returns after all bands are finished.
+void fb_render_pool_run(fb_band_job job, void *data, const fb_item_pos *area);
+
+#endif
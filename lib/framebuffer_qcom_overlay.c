@@ -544,6 +544,7 @@ static int impl_open(struct framebuffer *fb)
     data->vsync = fb_qcom_vsync_init(fb->fd);
 
     fb->impl_data = data;
+    fb->num_buffers = NUM_BUFFERS;
     return 0;
 
 fail:
@@ -0,0 +1,213 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "log.h"
+#include "framebuffer.h"
+#include "framebuffer_priv.h"
+#include "util.h"
+
+/*
+ * Pool of render threads for fb_draw(). An area is cut into bands which
+ * are handed out to the pool threads and the calling thread,
+ * fb_render_pool_run() returns once all of them are done. The bands are
+ * rows of the display's buffer, so that each thread writes whole rows:
+ * if the display is rotated by 90 or 270 degrees, they are columns of
+ * the area.
+ */
+
+#define FB_RENDER_MAX_THREADS 8
+// Bands thinner than this aren't worth the synchronization
+#define FB_RENDER_MIN_BAND 32
+
+struct fb_render_pool
+{
+    pthread_t threads[FB_RENDER_MAX_THREADS];
+    int thread_cnt;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    volatile int run;
+
+    // current job, protected by mutex
+    uint32_t generation;
+    fb_band_job job;
+    void *job_data;
+    fb_item_pos area;
+    int columns;
+    int band_size;
+    int band_cnt;
+    int next_band;
+    int bands_left;
+};
+
+static struct fb_render_pool pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .work_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+    .thread_cnt = 0,
+    .run = 0,
+};
+
+// pool.mutex must be locked. Returns 0 if there are no bands left.
+static int fb_render_pool_take_band(fb_item_pos *band)
+{
+    if(pool.next_band >= pool.band_cnt)
+        return 0;
+
+    *band = pool.area;
+    if(pool.columns)
+    {
+        band->x += pool.next_band*pool.band_size;
+        band->w = imin(pool.band_size, pool.area.x + pool.area.w - band->x);
+    }
+    else
+    {
+        band->y += pool.next_band*pool.band_size;
+        band->h = imin(pool.band_size, pool.area.y + pool.area.h - band->y);
+    }
+    ++pool.next_band;
+    return 1;
+}
+
+// pool.mutex must be locked, it is unlocked while the job runs. The CPU
+// time of pool threads goes to the frame's stats, the calling thread's
+// is counted by the stats themselves.
+static void fb_render_pool_do_bands(int pool_thread)
+{
+    fb_item_pos band;
+    fb_band_job job = pool.job;
+    void *data = pool.job_data;
+    struct timespec start, end;
+
+    while(fb_render_pool_take_band(&band))
+    {
+        pthread_mutex_unlock(&pool.mutex);
+        if(pool_thread)
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+        job(&band, data);
+
+        if(pool_thread)
+        {
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+            fb_stats_add_pool_cpu(((int64_t)(end.tv_sec - start.tv_sec))*1000000 + (end.tv_nsec - start.tv_nsec)/1000);
+        }
+        pthread_mutex_lock(&pool.mutex);
+
+        if(--pool.bands_left == 0)
+            pthread_cond_broadcast(&pool.done_cond);
+    }
+}
+
+static void *fb_render_thread_work(UNUSED void *cookie)
+{
+    uint32_t seen_generation = 0;
+
+    pthread_mutex_lock(&pool.mutex);
+    while(1)
+    {
+        while(pool.run && seen_generation == pool.generation)
+            pthread_cond_wait(&pool.work_cond, &pool.mutex);
+
+        if(!pool.run)
+            break;
+
+        seen_generation = pool.generation;
+        fb_render_pool_do_bands(1);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+    return NULL;
+}
+
+void fb_render_pool_start(void)
+{
+    int i;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(pool.run)
+        return;
+
+    // the calling thread renders as well
+    pool.thread_cnt = imin(imax(cpus, 1), FB_RENDER_MAX_THREADS) - 1;
+    pool.generation = 0;
+    pool.run = 1;
+
+    for(i = 0; i < pool.thread_cnt; ++i)
+    {
+        if(pthread_create(&pool.threads[i], NULL, fb_render_thread_work, NULL) != 0)
+        {
+            ERROR("Failed to create render thread %d\n", i);
+            break;
+        }
+    }
+    pool.thread_cnt = i;
+
+    INFO("Framebuffer render pool: %d threads\n", pool.thread_cnt+1);
+}
+
+void fb_render_pool_stop(void)
+{
+    int i;
+
+    if(!pool.run)
+        return;
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.run = 0;
+    pthread_cond_broadcast(&pool.work_cond);
+    pthread_mutex_unlock(&pool.mutex);
+
+    for(i = 0; i < pool.thread_cnt; ++i)
+        pthread_join(pool.threads[i], NULL);
+    pool.thread_cnt = 0;
+}
+
+void fb_render_pool_run(fb_band_job job, void *data, const fb_item_pos *area)
+{
+    const int columns = (fb_rotation == 90 || fb_rotation == 270);
+    const int len = columns ? area->w : area->h;
+    const int band_cnt = imin(pool.thread_cnt + 1, len / FB_RENDER_MIN_BAND);
+
+    if(!pool.run || band_cnt <= 1)
+    {
+        job(area, data);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.job = job;
+    pool.job_data = data;
+    pool.area = *area;
+    pool.band_cnt = band_cnt;
+    pool.columns = columns;
+    pool.band_size = (len + band_cnt - 1) / band_cnt;
+    pool.next_band = 0;
+    pool.bands_left = band_cnt;
+    ++pool.generation;
+    pthread_cond_broadcast(&pool.work_cond);
+
+    fb_render_pool_do_bands(0);
+
+    while(pool.bands_left > 0)
+        pthread_cond_wait(&pool.done_cond, &pool.mutex);
+    pthread_mutex_unlock(&pool.mutex);
+}
@@ -0,0 +1,321 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+  #include <arm_neon.h>
+  #define FB_ROT_NEON
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+  #define FB_ROT_SSE2
+#endif
+
+#include "framebuffer.h"
+#include "framebuffer_priv.h"
+#include "util.h"
+
+/*
+ * 90 and 270 degree rotations are transposes with one of the axes
+ * flipped, which is done by walking the source or destination rows
+ * backwards (negative stride). The transpose is split into tiles small
+ * enough to keep both the source rows and destination rows in cache,
+ * and each tile is made of blocks transposed in registers, so every
+ * write into the (usually uncached) framebuffer memory is one full
+ * 16 byte row of a block.
+ */
+
+// Tile size in pixels, 16 rows of 16 px fit into L1 on every device
+#define ROT_TILE 16
+// Block size in pixels, one 128bit register per block row
+#define ROT_BLOCK (16 / PIXEL_SIZE)
+
+// dst[x*dst_stride + y] = src[y*src_stride + x] for one ROT_BLOCK^2 block
+static inline void transpose_block(px_type *dst, int dst_stride, const px_type *src, int src_stride)
+{
+#if PIXEL_SIZE == 4 && defined(FB_ROT_NEON)
+    const uint32x4_t r0 = vld1q_u32(src);
+    const uint32x4_t r1 = vld1q_u32(src + src_stride);
+    const uint32x4_t r2 = vld1q_u32(src + src_stride*2);
+    const uint32x4_t r3 = vld1q_u32(src + src_stride*3);
+    const uint32x4x2_t a = vtrnq_u32(r0, r1);
+    const uint32x4x2_t b = vtrnq_u32(r2, r3);
+    vst1q_u32(dst,                vcombine_u32(vget_low_u32(a.val[0]), vget_low_u32(b.val[0])));
+    vst1q_u32(dst + dst_stride,   vcombine_u32(vget_low_u32(a.val[1]), vget_low_u32(b.val[1])));
+    vst1q_u32(dst + dst_stride*2, vcombine_u32(vget_high_u32(a.val[0]), vget_high_u32(b.val[0])));
+    vst1q_u32(dst + dst_stride*3, vcombine_u32(vget_high_u32(a.val[1]), vget_high_u32(b.val[1])));
+#elif PIXEL_SIZE == 4 && defined(FB_ROT_SSE2)
+    const __m128i r0 = _mm_loadu_si128((const __m128i*)src);
+    const __m128i r1 = _mm_loadu_si128((const __m128i*)(src + src_stride));
+    const __m128i r2 = _mm_loadu_si128((const __m128i*)(src + src_stride*2));
+    const __m128i r3 = _mm_loadu_si128((const __m128i*)(src + src_stride*3));
+    const __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+    const __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+    const __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+    const __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+    _mm_storeu_si128((__m128i*)dst,                  _mm_unpacklo_epi64(t0, t1));
+    _mm_storeu_si128((__m128i*)(dst + dst_stride),   _mm_unpackhi_epi64(t0, t1));
+    _mm_storeu_si128((__m128i*)(dst + dst_stride*2), _mm_unpacklo_epi64(t2, t3));
+    _mm_storeu_si128((__m128i*)(dst + dst_stride*3), _mm_unpackhi_epi64(t2, t3));
+#elif PIXEL_SIZE == 2 && defined(FB_ROT_NEON)
+    const uint16x8x2_t t0 = vtrnq_u16(vld1q_u16(src),                vld1q_u16(src + src_stride));
+    const uint16x8x2_t t1 = vtrnq_u16(vld1q_u16(src + src_stride*2), vld1q_u16(src + src_stride*3));
+    const uint16x8x2_t t2 = vtrnq_u16(vld1q_u16(src + src_stride*4), vld1q_u16(src + src_stride*5));
+    const uint16x8x2_t t3 = vtrnq_u16(vld1q_u16(src + src_stride*6), vld1q_u16(src + src_stride*7));
+    const uint32x4x2_t u0 = vtrnq_u32(vreinterpretq_u32_u16(t0.val[0]), vreinterpretq_u32_u16(t1.val[0]));
+    const uint32x4x2_t u1 = vtrnq_u32(vreinterpretq_u32_u16(t0.val[1]), vreinterpretq_u32_u16(t1.val[1]));
+    const uint32x4x2_t u2 = vtrnq_u32(vreinterpretq_u32_u16(t2.val[0]), vreinterpretq_u32_u16(t3.val[0]));
+    const uint32x4x2_t u3 = vtrnq_u32(vreinterpretq_u32_u16(t2.val[1]), vreinterpretq_u32_u16(t3.val[1]));
+#define STORE_ROW(idx, half, a, b) \
+    vst1q_u16(dst + dst_stride*idx, vreinterpretq_u16_u32(vcombine_u32(vget_ ## half ## _u32(a), vget_ ## half ## _u32(b))))
+    STORE_ROW(0, low,  u0.val[0], u2.val[0]);
+    STORE_ROW(1, low,  u1.val[0], u3.val[0]);
+    STORE_ROW(2, low,  u0.val[1], u2.val[1]);
+    STORE_ROW(3, low,  u1.val[1], u3.val[1]);
+    STORE_ROW(4, high, u0.val[0], u2.val[0]);
+    STORE_ROW(5, high, u1.val[0], u3.val[0]);
+    STORE_ROW(6, high, u0.val[1], u2.val[1]);
+    STORE_ROW(7, high, u1.val[1], u3.val[1]);
+#undef STORE_ROW
+#elif PIXEL_SIZE == 2 && defined(FB_ROT_SSE2)
+    __m128i r[8], a[8], b[8];
+    int i;
+    for(i = 0; i < 8; ++i)
+        r[i] = _mm_loadu_si128((const __m128i*)(src + src_stride*i));
+    for(i = 0; i < 4; ++i)
+    {
+        a[i*2]   = _mm_unpacklo_epi16(r[i*2], r[i*2+1]);
+        a[i*2+1] = _mm_unpackhi_epi16(r[i*2], r[i*2+1]);
+    }
+    b[0] = _mm_unpacklo_epi32(a[0], a[2]);
+    b[1] = _mm_unpackhi_epi32(a[0], a[2]);
+    b[2] = _mm_unpacklo_epi32(a[1], a[3]);
+    b[3] = _mm_unpackhi_epi32(a[1], a[3]);
+    b[4] = _mm_unpacklo_epi32(a[4], a[6]);
+    b[5] = _mm_unpackhi_epi32(a[4], a[6]);
+    b[6] = _mm_unpacklo_epi32(a[5], a[7]);
+    b[7] = _mm_unpackhi_epi32(a[5], a[7]);
+    for(i = 0; i < 4; ++i)
+    {
+        _mm_storeu_si128((__m128i*)(dst + dst_stride*(i*2)),   _mm_unpacklo_epi64(b[i], b[i+4]));
+        _mm_storeu_si128((__m128i*)(dst + dst_stride*(i*2+1)), _mm_unpackhi_epi64(b[i], b[i+4]));
+    }
+#else
+    int x, y;
+    for(x = 0; x < ROT_BLOCK; ++x)
+        for(y = 0; y < ROT_BLOCK; ++y)
+            dst[x*dst_stride + y] = src[y*src_stride + x];
+#endif
+}
+
+// dst[x*dst_stride + y] = src[y*src_stride + x] for w x h source pixels
+static void transpose(px_type *dst, int dst_stride, const px_type *src, int src_stride, int w, int h)
+{
+    int tx, ty, x, y, x_end, y_end;
+
+    for(ty = 0; ty < h; ty += ROT_TILE)
+    {
+        y_end = imin(ty + ROT_TILE, h);
+        for(tx = 0; tx < w; tx += ROT_TILE)
+        {
+            x_end = imin(tx + ROT_TILE, w);
+
+            for(y = ty; y + ROT_BLOCK <= y_end; y += ROT_BLOCK)
+            {
+                for(x = tx; x + ROT_BLOCK <= x_end; x += ROT_BLOCK)
+                    transpose_block(dst + x*dst_stride + y, dst_stride, src + y*src_stride + x, src_stride);
+
+                // leftover columns of this block row
+                for(; x < x_end; ++x)
+                {
+                    px_type *d = dst + x*dst_stride + y;
+                    const px_type *s = src + y*src_stride + x;
+                    int i;
+                    for(i = 0; i < ROT_BLOCK; ++i)
+                        d[i] = s[i*src_stride];
+                }
+            }
+
+            // leftover rows of this tile
+            for(; y < y_end; ++y)
+                for(x = tx; x < x_end; ++x)
+                    dst[x*dst_stride + y] = src[y*src_stride + x];
+        }
+    }
+}
+
+// Source pixel [x; y] goes to dst row x, column height-1-y
+static void rotate_90deg(px_type *dst, int dst_stride, const px_type *src, int src_stride,
+        int height, const fb_item_pos *r)
+{
+    // read the source rows bottom to top
+    transpose(dst + r->x*dst_stride + (height - r->y - r->h), dst_stride,
+            src + (r->y + r->h - 1)*src_stride + r->x, -src_stride, r->w, r->h);
+}
+
+// Source pixel [x; y] goes to dst row width-1-x, column y
+static void rotate_270deg(px_type *dst, int dst_stride, const px_type *src, int src_stride,
+        int width, const fb_item_pos *r)
+{
+    // write the destination rows bottom to top
+    transpose(dst + (width - 1 - r->x)*dst_stride + r->y, -dst_stride,
+            src + r->y*src_stride + r->x, src_stride, r->w, r->h);
+}
+
+// Source pixel [x; y] goes to dst row height-1-y, column width-1-x
+static void rotate_180deg(px_type *dst, int dst_stride, const px_type *src, int src_stride,
+        int width, int height, const fb_item_pos *r)
+{
+    int32_t x, y;
+    px_type *d;
+    const px_type *s;
+
+    for(y = r->y; y < r->y + r->h; ++y)
+    {
+        s = src + y*src_stride + r->x + r->w;
+        d = dst + (height - 1 - y)*dst_stride + (width - r->x - r->w);
+        for(x = 0; x < r->w; ++x)
+            *d++ = *(--s);
+    }
+}
+
+void fb_rotate_rect(px_type *dst, int dst_stride, const px_type *src, int src_stride,
+        int width, int height, int rotation, const fb_item_pos *r)
+{
+    switch(rotation)
+    {
+        case 90:
+            rotate_90deg(dst, dst_stride, src, src_stride, height, r);
+            break;
+        case 180:
+            rotate_180deg(dst, dst_stride, src, src_stride, width, height, r);
+            break;
+        case 270:
+            rotate_270deg(dst, dst_stride, src, src_stride, width, r);
+            break;
+    }
+}
+
+/*
+ * Benchmark of the rotation, compares it with the old row-pointer
+ * implementation which walks the source column by column.
+ */
+
+static void rotate_ref(px_type *dst, int dst_stride, const px_type *src, int src_stride,
+        int width, int height, int rotation, const px_type **helpers)
+{
+    int x, y;
+
+    if(rotation == 90)
+    {
+        for(y = 0; y < height; ++y)
+            helpers[y] = src + y*src_stride;
+
+        for(x = 0; x < width; ++x)
+        {
+            px_type *d = dst + x*dst_stride;
+            for(y = height-1; y >= 0; --y)
+                *d++ = *(helpers[y]++);
+        }
+    }
+    else
+    {
+        for(y = 0; y < height; ++y)
+            helpers[y] = src + y*src_stride + width - 1;
+
+        for(x = 0; x < width; ++x)
+        {
+            px_type *d = dst + x*dst_stride;
+            for(y = 0; y < height; ++y)
+                *d++ = *(helpers[y]--);
+        }
+    }
+}
+
+static uint64_t bench_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
+void fb_rotate_benchmark(void)
+{
+    // logical (rotated) sizes of common panels mounted in landscape
+    static const int sizes[][2] = {
+        { 1280, 720 },
+        { 1280, 800 },
+        { 1920, 1080 },
+        { 1920, 1200 },
+        { 2560, 1440 },
+    };
+    static const int rotations[] = { 90, 270 };
+    const int iterations = 30;
+    size_t s, r;
+    int i;
+
+    printf("Framebuffer rotation benchmark, %d bytes per pixel, %d iterations\n", PIXEL_SIZE, iterations);
+    printf("%10s %4s %12s %12s %8s\n", "size", "rot", "old [us]", "tiled [us]", "speedup");
+
+    for(s = 0; s < sizeof(sizes)/sizeof(sizes[0]); ++s)
+    {
+        const int width = sizes[s][0];
+        const int height = sizes[s][1];
+        const fb_item_pos full = { 0, 0, width, height };
+        px_type *src = malloc(width*height*PIXEL_SIZE);
+        px_type *dst_ref = malloc(width*height*PIXEL_SIZE);
+        px_type *dst = malloc(width*height*PIXEL_SIZE);
+        const px_type **helpers = malloc(height*sizeof(px_type*));
+        char size_str[32];
+
+        for(i = 0; i < width*height; ++i)
+            src[i] = (px_type)(i*2654435761u);
+
+        snprintf(size_str, sizeof(size_str), "%dx%d", width, height);
+
+        for(r = 0; r < sizeof(rotations)/sizeof(rotations[0]); ++r)
+        {
+            uint64_t start, ref_us, tiled_us;
+
+            // device framebuffer is height px wide
+            start = bench_now_us();
+            for(i = 0; i < iterations; ++i)
+                rotate_ref(dst_ref, height, src, width, width, height, rotations[r], helpers);
+            ref_us = (bench_now_us() - start)/iterations;
+
+            start = bench_now_us();
+            for(i = 0; i < iterations; ++i)
+                fb_rotate_rect(dst, height, src, width, width, height, rotations[r], &full);
+            tiled_us = (bench_now_us() - start)/iterations;
+
+            printf("%10s %4d %12llu %12llu %7.2fx%s\n", size_str, rotations[r],
+                    (unsigned long long)ref_us, (unsigned long long)tiled_us,
+                    tiled_us ? (double)ref_us/tiled_us : 0.0,
+                    memcmp(dst, dst_ref, width*height*PIXEL_SIZE) == 0 ? "" : " MISMATCH!");
+        }
+
+        free(src);
+        free(dst_ref);
+        free(dst);
+        free(helpers);
+    }
+    fflush(stdout);
+}
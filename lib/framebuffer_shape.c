@@ -0,0 +1,157 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "framebuffer.h"
+#include "framebuffer_priv.h"
+#include "containers.h"
+#include "util.h"
+
+/*
+ * Coverage masks of the rounded corners used by fb_shape items. A mask
+ * holds the top left corner, the exact area of each pixel covered by
+ * a quarter of the circle, and is shared by all shapes with the same
+ * radius.
+ */
+
+static fb_shape_mask **mask_cache = NULL;
+static pthread_mutex_t mask_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Area of the circle with radius r centered at [0, 0] which lies
+// in the rectangle [0, 0] - [a, b], a and b must not be negative
+static double quadrant_area(double r, double a, double b)
+{
+    double u_flat, u_end, res = 0;
+
+    a = fmin(a, r);
+    b = fmin(b, r);
+
+    // up to u_flat, the circle is above b
+    u_flat = sqrt(r*r - b*b);
+    if(a <= u_flat)
+        return a*b;
+
+    res = u_flat*b;
+    u_end = a;
+
+    // integral of sqrt(r^2 - u^2) from u_flat to u_end
+#define CIRCLE_INTEGRAL(u) (((u)*sqrt(r*r - (u)*(u)) + r*r*asin((u)/r))/2)
+    res += CIRCLE_INTEGRAL(u_end) - CIRCLE_INTEGRAL(u_flat);
+#undef CIRCLE_INTEGRAL
+    return res;
+}
+
+static double signed_quadrant_area(double r, double a, double b)
+{
+    const double res = quadrant_area(r, fabs(a), fabs(b));
+    return ((a < 0) != (b < 0)) ? -res : res;
+}
+
+// Area of the circle with radius r centered at [0, 0] which lies
+// in the rectangle [u0, v0] - [u1, v1]
+static double rect_area(double r, double u0, double v0, double u1, double v1)
+{
+    return signed_quadrant_area(r, u1, v1) - signed_quadrant_area(r, u0, v1)
+            - signed_quadrant_area(r, u1, v0) + signed_quadrant_area(r, u0, v0);
+}
+
+static fb_shape_mask *fb_shape_mask_create(int radius2)
+{
+    int x, y, cov;
+    double area;
+    const double r = radius2/2.0;
+    fb_shape_mask *m = mzalloc(sizeof(fb_shape_mask));
+
+    m->radius2 = radius2;
+    m->size = (radius2 + 1)/2;
+    m->refcnt = 1;
+    m->coverage = malloc(m->size*m->size);
+    m->coverage_mirrored = malloc(m->size*m->size);
+    m->span_start = malloc(m->size*sizeof(int));
+    m->span_solid = malloc(m->size*sizeof(int));
+
+    // The circle's center is at [r, r]
+    for(y = 0; y < m->size; ++y)
+    {
+        m->span_start[y] = m->size;
+        m->span_solid[y] = m->size;
+
+        for(x = 0; x < m->size; ++x)
+        {
+            area = rect_area(r, x - r, y - r, x + 1 - r, y + 1 - r);
+            cov = (int)(area*255 + 0.5);
+            cov = imin(imax(cov, 0), 255);
+
+            m->coverage[y*m->size + x] = cov;
+            m->coverage_mirrored[y*m->size + m->size - 1 - x] = cov;
+
+            if(cov != 0 && m->span_start[y] == m->size)
+                m->span_start[y] = x;
+            if(cov != 255)
+                m->span_solid[y] = m->size;
+            else if(m->span_solid[y] == m->size)
+                m->span_solid[y] = x;
+        }
+    }
+    return m;
+}
+
+static void fb_shape_mask_destroy(void *mask)
+{
+    fb_shape_mask *m = mask;
+    free(m->coverage);
+    free(m->coverage_mirrored);
+    free(m->span_start);
+    free(m->span_solid);
+    free(m);
+}
+
+fb_shape_mask *fb_shape_mask_get(int radius2)
+{
+    fb_shape_mask **itr;
+    fb_shape_mask *res;
+
+    pthread_mutex_lock(&mask_cache_mutex);
+    for(itr = mask_cache; itr && *itr; ++itr)
+    {
+        if((*itr)->radius2 == radius2)
+        {
+            res = *itr;
+            ++res->refcnt;
+            pthread_mutex_unlock(&mask_cache_mutex);
+            return res;
+        }
+    }
+
+    res = fb_shape_mask_create(radius2);
+    list_add(&mask_cache, res);
+    pthread_mutex_unlock(&mask_cache_mutex);
+    return res;
+}
+
+void fb_shape_mask_release(fb_shape_mask *mask)
+{
+    pthread_mutex_lock(&mask_cache_mutex);
+    if(--mask->refcnt <= 0)
+        list_rm(&mask_cache, mask, &fb_shape_mask_destroy);
+    pthread_mutex_unlock(&mask_cache_mutex);
+}
@@ -0,0 +1,290 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "framebuffer.h"
+#include "framebuffer_priv.h"
+#include "mrom_data.h"
+#include "util.h"
+
+/*
+ * Statistics of the frames drawn by the draw thread. Each frame is one
+ * record in a ring, which is written only by the draw thread and can be
+ * read from any thread without locking: a record's sequence number is
+ * odd while it is being written, readers skip records which were changed
+ * while they were copying them.
+ */
+
+#define FB_STATS_FRAMES 512
+#define FB_STATS_HIST_MS 34
+
+struct fb_stats_slot
+{
+    volatile uint32_t seq;
+    fb_frame_stats s;
+};
+
+static struct
+{
+    struct fb_stats_slot ring[FB_STATS_FRAMES];
+    volatile uint32_t head; // number of frames written
+
+    // the frame in progress, start, start_cpu and cache_hits_last are
+    // draw thread only
+    struct timespec start;
+    struct timespec start_cpu;
+    uint32_t cache_hits_last;
+    volatile uint32_t present_us;
+    volatile uint32_t capture_us;
+    volatile uint32_t pool_cpu_us;
+    volatile uint32_t items;
+    volatile uint32_t blended_px;
+
+    volatile uint32_t cache_hits[FB_CACHE_CNT];
+    volatile uint32_t cache_misses[FB_CACHE_CNT];
+    volatile uint32_t cache_evictions[FB_CACHE_CNT];
+    volatile int32_t cache_entries[FB_CACHE_CNT];
+    volatile int32_t cache_bytes[FB_CACHE_CNT];
+} stats;
+
+static uint32_t fb_stats_elapsed_us(const struct timespec *from, const struct timespec *to)
+{
+    return ((int64_t)(to->tv_sec - from->tv_sec))*1000000 + (to->tv_nsec - from->tv_nsec)/1000;
+}
+
+static uint32_t fb_stats_cache_hits_total(void)
+{
+    int i;
+    uint32_t res = 0;
+    for(i = 0; i < FB_CACHE_CNT; ++i)
+        res += stats.cache_hits[i];
+    return res;
+}
+
+void fb_stats_frame_begin(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &stats.start);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &stats.start_cpu);
+    __sync_fetch_and_and(&stats.present_us, 0);
+    __sync_fetch_and_and(&stats.capture_us, 0);
+    __sync_fetch_and_and(&stats.pool_cpu_us, 0);
+    __sync_fetch_and_and(&stats.items, 0);
+    __sync_fetch_and_and(&stats.blended_px, 0);
+}
+
+void fb_stats_frame_end(void)
+{
+    struct timespec now, now_cpu;
+    struct fb_stats_slot *slot;
+    fb_frame_stats rec;
+    uint32_t total_us, hits;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now_cpu);
+    total_us = fb_stats_elapsed_us(&stats.start, &now);
+    hits = fb_stats_cache_hits_total();
+
+    rec.time_us = ((uint64_t)stats.start.tv_sec)*1000000 + stats.start.tv_nsec/1000;
+    rec.present_us = imin(__sync_fetch_and_and(&stats.present_us, 0), total_us);
+    rec.capture_us = imin(__sync_fetch_and_and(&stats.capture_us, 0), total_us - rec.present_us);
+    rec.composite_us = total_us - rec.present_us - rec.capture_us;
+    // the pool's threads are done with the frame's bands by now
+    rec.pool_cpu_us = __sync_fetch_and_and(&stats.pool_cpu_us, 0);
+    rec.cpu_us = fb_stats_elapsed_us(&stats.start_cpu, &now_cpu) + rec.pool_cpu_us;
+    rec.items = stats.items;
+    rec.blended_px = stats.blended_px;
+    rec.cache_hits = hits - stats.cache_hits_last;
+    stats.cache_hits_last = hits;
+
+    slot = &stats.ring[stats.head % FB_STATS_FRAMES];
+    __sync_fetch_and_add(&slot->seq, 1);
+    slot->s = rec;
+    __sync_fetch_and_add(&slot->seq, 1);
+    __sync_fetch_and_add(&stats.head, 1);
+}
+
+void fb_stats_add_present(uint32_t us)
+{
+    __sync_fetch_and_add(&stats.present_us, us);
+}
+
+void fb_stats_add_capture(uint32_t us)
+{
+    __sync_fetch_and_add(&stats.capture_us, us);
+}
+
+void fb_stats_add_pool_cpu(uint32_t us)
+{
+    __sync_fetch_and_add(&stats.pool_cpu_us, us);
+}
+
+void fb_stats_add_items(uint32_t items, uint32_t blended_px)
+{
+    __sync_fetch_and_add(&stats.items, items);
+    __sync_fetch_and_add(&stats.blended_px, blended_px);
+}
+
+void fb_stats_cache_lookup(int cache, int hit)
+{
+    if(hit)
+        __sync_fetch_and_add(&stats.cache_hits[cache], 1);
+    else
+        __sync_fetch_and_add(&stats.cache_misses[cache], 1);
+}
+
+void fb_stats_cache_resize(int cache, int entries, int bytes)
+{
+    __sync_fetch_and_add(&stats.cache_entries[cache], entries);
+    __sync_fetch_and_add(&stats.cache_bytes[cache], bytes);
+}
+
+void fb_stats_cache_evict(int cache)
+{
+    __sync_fetch_and_add(&stats.cache_evictions[cache], 1);
+}
+
+int fb_stats_get_frames(fb_frame_stats *dst, int max)
+{
+    struct fb_stats_slot *slot;
+    uint32_t i, seq;
+    const uint32_t head = __sync_fetch_and_add(&stats.head, 0);
+    const uint32_t cnt = imin(imin(head, FB_STATS_FRAMES), max);
+    int res = 0;
+
+    for(i = head - cnt; i != head; ++i)
+    {
+        slot = &stats.ring[i % FB_STATS_FRAMES];
+        seq = __sync_fetch_and_add(&slot->seq, 0);
+        dst[res] = slot->s;
+        __sync_synchronize();
+        if((seq & 1) == 0 && seq == slot->seq)
+            ++res;
+    }
+    return res;
+}
+
+void fb_stats_get_cache(int cache, fb_cache_stats *res)
+{
+    res->hits = stats.cache_hits[cache];
+    res->misses = stats.cache_misses[cache];
+    res->evictions = stats.cache_evictions[cache];
+    res->entries = stats.cache_entries[cache];
+    res->bytes = stats.cache_bytes[cache];
+}
+
+static int fb_stats_cmp(const void *a, const void *b)
+{
+    const uint32_t x = *((const uint32_t*)a);
+    const uint32_t y = *((const uint32_t*)b);
+    return (x > y) - (x < y);
+}
+
+// Sorts vals and prints their 50th, 95th and 99th percentile and maximum
+static void fb_stats_print_row(FILE *f, const char *name, uint32_t *vals, int cnt)
+{
+    static const int pct[] = { 50, 95, 99 };
+    int i;
+
+    qsort(vals, cnt, sizeof(uint32_t), fb_stats_cmp);
+
+    fprintf(f, "%-14s", name);
+    for(i = 0; i < (int)(sizeof(pct)/sizeof(pct[0])); ++i)
+        fprintf(f, " %9u", vals[imax((cnt*pct[i] + 99)/100 - 1, 0)]);
+    fprintf(f, " %9u\n", vals[cnt-1]);
+}
+
+int fb_stats_dump(void)
+{
+    static const char *cache_names[FB_CACHE_CNT] = { "text", "png" };
+    fb_frame_stats *frames;
+    fb_cache_stats cs;
+    uint32_t *vals;
+    uint32_t hist[FB_STATS_HIST_MS] = { 0 };
+    char path[256];
+    int i, cnt;
+    FILE *f;
+
+    frames = malloc(FB_STATS_FRAMES*sizeof(fb_frame_stats));
+    vals = malloc(FB_STATS_FRAMES*sizeof(uint32_t));
+    cnt = fb_stats_get_frames(frames, FB_STATS_FRAMES);
+
+    snprintf(path, sizeof(path), "%s/fb_stats.txt", mrom_dir());
+    f = fopen(path, "we");
+    if(!f)
+    {
+        ERROR("Failed to open %s for writing\n", path);
+        free(frames);
+        free(vals);
+        return -1;
+    }
+
+    fprintf(f, "frames: %d\n", cnt);
+    if(cnt > 0)
+    {
+        fprintf(f, "%-14s %9s %9s %9s %9s\n", "", "p50", "p95", "p99", "max");
+
+#define PRINT_ROW(name, expr) \
+        for(i = 0; i < cnt; ++i) \
+            vals[i] = (expr); \
+        fb_stats_print_row(f, name, vals, cnt);
+
+        PRINT_ROW("frame_us", frames[i].composite_us + frames[i].present_us + frames[i].capture_us);
+        PRINT_ROW("composite_us", frames[i].composite_us);
+        PRINT_ROW("present_us", frames[i].present_us);
+        PRINT_ROW("capture_us", frames[i].capture_us);
+        PRINT_ROW("cpu_us", frames[i].cpu_us);
+        PRINT_ROW("pool_cpu_us", frames[i].pool_cpu_us);
+        PRINT_ROW("items", frames[i].items);
+        PRINT_ROW("blended_px", frames[i].blended_px);
+        PRINT_ROW("cache_hits", frames[i].cache_hits);
+#undef PRINT_ROW
+
+        for(i = 0; i < cnt; ++i)
+            ++hist[imin((frames[i].composite_us + frames[i].present_us + frames[i].capture_us)/1000, FB_STATS_HIST_MS-1)];
+
+        fprintf(f, "\nframe time histogram:\n");
+        for(i = 0; i < FB_STATS_HIST_MS; ++i)
+        {
+            if(hist[i] == 0)
+                continue;
+            if(i == FB_STATS_HIST_MS-1)
+                fprintf(f, "  >= %2d ms: %u\n", i, hist[i]);
+            else
+                fprintf(f, "  %2d-%2d ms: %u\n", i, i+1, hist[i]);
+        }
+    }
+
+    fprintf(f, "\n");
+    for(i = 0; i < FB_CACHE_CNT; ++i)
+    {
+        fb_stats_get_cache(i, &cs);
+        fprintf(f, "%s cache: %d entries, %d bytes, %u hits, %u misses, %u evictions\n",
+                cache_names[i], cs.entries, cs.bytes, cs.hits, cs.misses, cs.evictions);
+    }
+
+    fclose(f);
+    free(frames);
+    free(vals);
+
+    INFO("Frame statistics written to %s\n", path);
+    return 0;
+}
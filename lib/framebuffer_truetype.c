@@ -20,15 +20,21 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <pthread.h>
 #include <ft2build.h>
 #include FT_FREETYPE_H
-#include FT_GLYPH_H
+#include FT_OUTLINE_H
+#include FT_SIZES_H
 
 #include "log.h"
 #include "framebuffer.h"
+#include "framebuffer_priv.h"
 #include "util.h"
 #include "containers.h"
 #include "mrom_data.h"
@@ -51,32 +57,120 @@ static const char *FONT_FILES[STYLE_COUNT] = {
     "OxygenMono-Regular.ttf", // STYLE_MONOSPACE
 };
 
+/*
+ * Rendered glyphs are kept in atlas pages, one set for each style and
+ * size. A page is a square of 8-bit coverage, packed into shelves: rows
+ * as high as the tallest glyph in them, filled from left to right. The
+ * glyphs' metrics are allocated in blocks of ATLAS_GLYPH_BLOCK and found
+ * through a table indexed by the char, texts are one byte per char.
+ */
+#define ATLAS_GLYPH_BLOCK 64
+#define ATLAS_MIN_PAGE 256
+#define ATLAS_MAX_PAGE 2048
+// shelves are this much higher than the glyph which opened them, so
+// that slightly smaller glyphs can share them
+#define ATLAS_SHELF_SLACK 4
+
+struct atlas_glyph
+{
+    int page; // -1 if the glyph has no pixels, e.g. space
+    int x, y, w, h; // in the page
+    int left, top; // of the bitmap, from the pen position
+    int y_min, y_max; // control box, in pixels
+    int advance;
+    FT_UInt ft_idx; // for kerning
+};
+
+struct atlas_shelf
+{
+    int y, h;
+    int x; // first free column
+};
+
+struct atlas_page
+{
+    uint8_t *data; // page_size*page_size
+    struct atlas_shelf *shelves;
+    int shelves_cnt;
+    int next_y; // first row which is not in a shelf
+};
+
 struct glyphs_entry
 {
     FT_Face face;
-    imap *glyphs;
+    FT_Size size; // has to be active when the face is used
+    struct atlas_glyph *glyphs[256]; // by the char's byte value
+    struct atlas_glyph **blocks;
+    int glyphs_cnt;
+    int page_size;
+    struct atlas_page **pages;
 };
 
+/*
+ * Rendered strings are kept in a hash table, keyed by everything their
+ * coverage depends on. Strings which are not used by any text anymore
+ * stay cached on a LRU list, the least recently used ones are dropped
+ * when the cache grows over MR_TEXT_CACHE_KB.
+ */
+#ifndef MR_TEXT_CACHE_KB
+#define MR_TEXT_CACHE_KB 1024
+#endif
+#define STRINGS_MIN_BUCKETS 64
+
 struct strings_entry
 {
-    px_type *data;
+    uint8_t *data;
     int w, h;
     int baseline;
     int refcnt;
-    px_type color;
+
+    uint32_t hash;
+    char *text;
+    int size, style, justify, wrap_w;
+
+    struct strings_entry *next; // in the bucket
+    struct strings_entry *lru_prev, *lru_next; // if refcnt is 0
+};
+
+struct strings_cache
+{
+    struct strings_entry **buckets;
+    int buckets_cnt;
+    int entries;
+    int bytes;
+    struct strings_entry *lru_first; // least recently used
+    struct strings_entry *lru_last;
+};
+
+/*
+ * Each style's font file is mapped into memory and opened as one face,
+ * the sizes in its glyph cache are FT_Size objects of that face.
+ */
+struct font_file
+{
+    FT_Face face;
+    void *data;
+    size_t data_size;
 };
 
 struct text_cache
 {
     imap *glyphs[STYLE_COUNT];
-    imap *strings;
+    struct font_file fonts[STYLE_COUNT];
+    struct strings_cache strings;
     FT_Library ft_lib;
+    // Texts are rendered from more threads (e.g. the perf HUD's worker),
+    // this guards the caches and the faces' active sizes. It is taken
+    // after fb_ctx's mutex if both are needed.
+    pthread_mutex_t mutex;
 };
 
 static struct text_cache cache = {
     .glyphs = { 0 },
-    .strings = 0,
-    .ft_lib = NULL
+    .fonts = { { 0 } },
+    .strings = { 0 },
+    .ft_lib = NULL,
+    .mutex = PTHREAD_MUTEX_INITIALIZER
 };
 
 struct text_line
@@ -91,7 +185,7 @@ struct text_line
 typedef struct
 {
     char *text;
-    px_type color;
+    struct strings_entry *sen; // the coverage in img->data
     int size;
     int justify;
     int style;
@@ -99,50 +193,227 @@ typedef struct
     int wrap_w;
 } text_extra;
 
-static int convert_ft_bitmap(FT_BitmapGlyph bit, px_type color, px_type *res_data, int stride, struct text_line *line, FT_Vector *pos)
+// Copies the glyph to [dst_x; dst_y] of the stride x height string coverage
+static void blit_glyph(struct glyphs_entry *en, struct atlas_glyph *g, uint8_t *res_data, int stride, int height, int dst_x, int dst_y)
 {
-    int x, y;
-    uint8_t *buff;
-    px_type *res_itr;
+    int y, src_x = 0, src_y = 0, w, h;
+    uint8_t *buff, *res_itr;
 
-    if(bit->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY)
+    // Glyphs can reach out of the bitmap, e.g. 'j' with negative left
+    // at the start of the line or italics at its end
+    if(dst_x < 0)
     {
-        ERROR("Unsupported pixel mode in FT_BitmapGlyph %d\n", bit->bitmap.pixel_mode);
+        src_x = -dst_x;
+        dst_x = 0;
+    }
+    if(dst_y < 0)
+    {
+        src_y = -dst_y;
+        dst_y = 0;
+    }
+    w = imin(g->w - src_x, stride - dst_x);
+    h = imin(g->h - src_y, height - dst_y);
+    if(w <= 0 || h <= 0)
+        return;
+
+    buff = en->pages[g->page]->data + (g->y + src_y)*en->page_size + g->x + src_x;
+    res_itr = res_data + dst_y*stride + dst_x;
+
+    for(y = 0; y < h; ++y)
+    {
+        memcpy(res_itr, buff, w);
+        buff += en->page_size;
+        res_itr += stride;
+    }
+}
+
+// Finds space for a w x h glyph, on the shelf which wastes the least rows
+static int atlas_alloc(struct glyphs_entry *en, int w, int h, int *res_x, int *res_y)
+{
+    struct atlas_page *page;
+    struct atlas_shelf *s, *best;
+    int p, i;
+
+    if(w > en->page_size || h > en->page_size)
         return -1;
+
+    for(p = 0; en->pages && en->pages[p]; ++p)
+    {
+        page = en->pages[p];
+        best = NULL;
+        for(i = 0; i < page->shelves_cnt; ++i)
+        {
+            s = &page->shelves[i];
+            if(s->h >= h && s->x + w <= en->page_size && (!best || s->h < best->h))
+                best = s;
+        }
+
+        if(!best && page->next_y + h <= en->page_size)
+        {
+            page->shelves = realloc(page->shelves, (page->shelves_cnt+1)*sizeof(struct atlas_shelf));
+            best = &page->shelves[page->shelves_cnt++];
+            best->y = page->next_y;
+            best->h = imin(h + ATLAS_SHELF_SLACK, en->page_size - page->next_y);
+            best->x = 0;
+            page->next_y += best->h;
+        }
+
+        if(best)
+        {
+            *res_x = best->x;
+            *res_y = best->y;
+            best->x += w;
+            return p;
+        }
+    }
+
+    page = mzalloc(sizeof(struct atlas_page));
+    page->data = mzalloc(en->page_size*en->page_size);
+    list_add(&en->pages, page);
+    return atlas_alloc(en, w, h, res_x, res_y);
+}
+
+static inline void activate_size(struct glyphs_entry *en)
+{
+    if(en->face->size != en->size)
+        FT_Activate_Size(en->size);
+}
+
+static struct atlas_glyph *atlas_add_glyph(struct glyphs_entry *en, int c, int ft_idx)
+{
+    FT_GlyphSlot slot = en->face->glyph;
+    FT_BBox cbox;
+    struct atlas_glyph *g;
+    uint8_t *dst;
+    int y;
+
+    activate_size(en);
+    if(FT_Load_Glyph(en->face, ft_idx, FT_LOAD_DEFAULT) != 0)
+        return NULL;
+
+    // same as FT_Glyph_Get_CBox with ft_glyph_bbox_pixels
+    if(slot->format == FT_GLYPH_FORMAT_OUTLINE)
+    {
+        FT_Outline_Get_CBox(&slot->outline, &cbox);
+        cbox.yMin = (cbox.yMin & ~63) >> 6;
+        cbox.yMax = ((cbox.yMax + 63) & ~63) >> 6;
+    }
+
+    if(FT_Render_Glyph(slot, FT_RENDER_MODE_NORMAL) != 0)
+        return NULL;
+
+    if(slot->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY)
+    {
+        ERROR("Unsupported pixel mode in FT_Bitmap %d\n", slot->bitmap.pixel_mode);
+        return NULL;
     }
 
-    //INFO("Bitmap w %d baseline %d pos [%d; %d] left %d top %d rows %d cols %d pitch %d\n", line->w, line->base, pos->x, pos->y, bit->left, bit->top, bit->bitmap.rows, bit->bitmap.width, bit->bitmap.pitch);
+    if((en->glyphs_cnt % ATLAS_GLYPH_BLOCK) == 0)
+        list_add(&en->blocks, malloc(ATLAS_GLYPH_BLOCK*sizeof(struct atlas_glyph)));
 
-    buff = (uint8_t*)bit->bitmap.buffer;
-    res_itr = (px_type*)(((uint32_t*)res_data) + (line->offY + line->base - bit->top)*stride + (line->offX + pos->x + bit->left));
+    g = &en->blocks[en->glyphs_cnt / ATLAS_GLYPH_BLOCK][en->glyphs_cnt % ATLAS_GLYPH_BLOCK];
+    ++en->glyphs_cnt;
 
-    // FIXME: if bit->left is negative and everything else is 0 (e.g. letter 'j' in Roboto-Regular),
-    // the result might end up being before the buffer - I'm not sure how to properly handle this.
-    if(res_itr < res_data)
-        res_itr = res_data;
+    g->w = slot->bitmap.width;
+    g->h = slot->bitmap.rows;
+    g->left = slot->bitmap_left;
+    g->top = slot->bitmap_top;
+    g->advance = slot->advance.x >> 6;
+    g->ft_idx = ft_idx;
+    g->page = -1;
 
-    for(y = 0; y < bit->bitmap.rows; ++y)
+    if(slot->format == FT_GLYPH_FORMAT_OUTLINE)
+    {
+        g->y_min = cbox.yMin;
+        g->y_max = cbox.yMax;
+    }
+    else
     {
-        for(x = 0; x < bit->bitmap.width; ++x)
+        g->y_min = g->top - g->h;
+        g->y_max = g->top;
+    }
+
+    if(g->w > 0 && g->h > 0)
+    {
+        g->page = atlas_alloc(en, g->w, g->h, &g->x, &g->y);
+        if(g->page == -1)
+            ERROR("Glyph %d is too big for the atlas (%dx%d)\n", c, g->w, g->h);
+        else
         {
-#if PIXEL_SIZE == 4
-            *res_itr++ = color | (buff[x] << ((PX_IDX_A*8)));
-#else
-            *res_itr++ = color;
-            ((uint8_t*)res_itr)[0] = ((((buff[x]*100)/0xFF)*31)/100);
-            ((uint8_t*)res_itr)[1] = ((((buff[x]*100)/0xFF)*63)/100);
-            ++res_itr;
-#endif
+            dst = en->pages[g->page]->data + g->y*en->page_size + g->x;
+            for(y = 0; y < g->h; ++y)
+                memcpy(dst + y*en->page_size, slot->bitmap.buffer + y*slot->bitmap.pitch, g->w);
         }
-        buff += bit->bitmap.pitch;
-        res_itr = (px_type*)(((uint32_t*)res_itr) + stride - bit->bitmap.width);
     }
-    return 0;
+
+    en->glyphs[(uint8_t)c] = g;
+    return g;
+}
+
+static FT_Face get_font_face(int style)
+{
+    struct font_file *f = &cache.fonts[style];
+    struct stat info;
+    char buff[128];
+    int fd, error;
+
+    if(f->face)
+        return f->face;
+
+    snprintf(buff, sizeof(buff), "%s/res/%s", mrom_dir(), FONT_FILES[style]);
+    fd = open(buff, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        ERROR("failed to open font %s: %s\n", buff, strerror(errno));
+        return NULL;
+    }
+
+    if(fstat(fd, &info) < 0 || info.st_size <= 0)
+    {
+        ERROR("failed to stat font %s\n", buff);
+        close(fd);
+        return NULL;
+    }
+
+    f->data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(f->data == MAP_FAILED)
+    {
+        ERROR("failed to mmap font %s: %s\n", buff, strerror(errno));
+        f->data = NULL;
+        return NULL;
+    }
+    f->data_size = info.st_size;
+
+    error = FT_New_Memory_Face(cache.ft_lib, f->data, f->data_size, 0, &f->face);
+    if(error)
+    {
+        ERROR("font style %d load failed with %d\n", style, error);
+        munmap(f->data, f->data_size);
+        f->data = NULL;
+        f->face = NULL;
+        return NULL;
+    }
+    return f->face;
+}
+
+static void close_font_faces(void)
+{
+    size_t s;
+    for(s = 0; s < STYLE_COUNT; ++s)
+    {
+        if(!cache.fonts[s].face)
+            continue;
+        FT_Done_Face(cache.fonts[s].face);
+        munmap(cache.fonts[s].data, cache.fonts[s].data_size);
+        memset(&cache.fonts[s], 0, sizeof(struct font_file));
+    }
 }
 
 static struct glyphs_entry *get_cache_for_size(int style, const int size)
 {
     int error;
+    FT_Face face;
     struct glyphs_entry *res;
 
     if(!cache.ft_lib)
@@ -158,112 +429,233 @@ static struct glyphs_entry *get_cache_for_size(int style, const int size)
     if(!cache.glyphs[style])
         cache.glyphs[style] = imap_create();
 
-retry_load:
     res = imap_get_val(cache.glyphs[style], size);
     if(!res)
     {
-        char buff[128];
+        face = get_font_face(style);
+        if(!face && style != STYLE_NORMAL)
+        {
+            ERROR("Retrying with STYLE_NORMAL instead.\n");
+            face = get_font_face(STYLE_NORMAL);
+        }
+
+        if(!face)
+            return NULL;
+
         res = mzalloc(sizeof(struct glyphs_entry));
-        snprintf(buff, sizeof(buff), "%s/res/%s", mrom_dir(), FONT_FILES[style]);
-        error = FT_New_Face(cache.ft_lib, buff, 0, &res->face);
+        res->face = face;
+        error = FT_New_Size(face, &res->size);
         if(error)
         {
-            ERROR("font style %d load failed with %d\n", style, error);
+            ERROR("failed to create font size with %d\n", error);
             free(res);
-
-            if(style != STYLE_NORMAL)
-            {
-                ERROR("Retrying with STYLE_NORMAL instead.");
-                style = STYLE_NORMAL;
-                goto retry_load;
-            }
-
             return NULL;
         }
 
-        error = FT_Set_Char_Size(res->face, 0, size*16, MR_DPI_FONT, MR_DPI_FONT);
+        FT_Activate_Size(res->size);
+        error = FT_Set_Char_Size(face, 0, size*16, MR_DPI_FONT, MR_DPI_FONT);
         if(error)
         {
             ERROR("failed to set font size with %d\n", error);
-            FT_Done_Face(res->face);
+            FT_Done_Size(res->size);
             free(res);
             return NULL;
         }
 
-        res->glyphs = imap_create();
+        res->page_size = ATLAS_MIN_PAGE;
+        while(res->page_size < ATLAS_MAX_PAGE && res->page_size < 8*(res->size->metrics.height >> 6))
+            res->page_size *= 2;
         imap_add_not_exist(cache.glyphs[style], size, res);
     }
 
     return res;
 }
 
-static struct strings_entry *get_cache_for_string(text_extra *ex)
+static uint32_t strings_hash(text_extra *ex)
 {
-    if(!cache.strings)
-        return NULL;
+    uint32_t hash = 2166136261u;
+    const char *c;
 
-    map *c = imap_get_val(cache.strings, ex->size);
-    if(!c)
-        return NULL;
+    for(c = ex->text; *c; ++c)
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
 
-    struct strings_entry *sen = map_get_val(c, ex->text);
-    if(sen && sen->color == ex->color)
-        return sen;
-    return NULL;
+    hash = (hash ^ ex->size) * 16777619u;
+    hash = (hash ^ ex->style) * 16777619u;
+    hash = (hash ^ ex->justify) * 16777619u;
+    hash = (hash ^ ex->wrap_w) * 16777619u;
+    return hash;
 }
 
-static void add_to_strings(fb_img *img)
+static void strings_lru_rm(struct strings_entry *sen)
 {
-    text_extra *ex = img->extra;
+    if(sen->lru_prev)
+        sen->lru_prev->lru_next = sen->lru_next;
+    else
+        cache.strings.lru_first = sen->lru_next;
+
+    if(sen->lru_next)
+        sen->lru_next->lru_prev = sen->lru_prev;
+    else
+        cache.strings.lru_last = sen->lru_prev;
 
-    if(!cache.strings)
-        cache.strings = imap_create();
+    sen->lru_prev = sen->lru_next = NULL;
+}
+
+static void strings_lru_append(struct strings_entry *sen)
+{
+    sen->lru_prev = cache.strings.lru_last;
+    sen->lru_next = NULL;
+    if(cache.strings.lru_last)
+        cache.strings.lru_last->lru_next = sen;
+    else
+        cache.strings.lru_first = sen;
+    cache.strings.lru_last = sen;
+}
 
-    map *c = imap_get_val(cache.strings, ex->size);
-    if(!c)
+static struct strings_entry *strings_find(text_extra *ex, uint32_t hash)
+{
+    struct strings_entry *sen;
+
+    if(!cache.strings.buckets)
+        return NULL;
+
+    sen = cache.strings.buckets[hash & (cache.strings.buckets_cnt - 1)];
+    for(; sen; sen = sen->next)
     {
-        c = map_create();
-        imap_add_not_exist(cache.strings, ex->size, c);
+        if(sen->hash == hash && sen->size == ex->size && sen->style == ex->style &&
+            sen->justify == ex->justify && sen->wrap_w == ex->wrap_w && strcmp(sen->text, ex->text) == 0)
+        {
+            return sen;
+        }
     }
-    else if(map_find(c, ex->text) != -1)
+    return NULL;
+}
+
+static void strings_rehash(int buckets_cnt)
+{
+    struct strings_entry **buckets = mzalloc(buckets_cnt*sizeof(struct strings_entry*));
+    struct strings_entry *sen, *next;
+    int i;
+
+    for(i = 0; i < cache.strings.buckets_cnt; ++i)
     {
-        return;
+        for(sen = cache.strings.buckets[i]; sen; sen = next)
+        {
+            next = sen->next;
+            sen->next = buckets[sen->hash & (buckets_cnt - 1)];
+            buckets[sen->hash & (buckets_cnt - 1)] = sen;
+        }
     }
 
-    struct strings_entry *sen = mzalloc(sizeof(struct strings_entry));
-    sen->data = img->data;
+    free(cache.strings.buckets);
+    cache.strings.buckets = buckets;
+    cache.strings.buckets_cnt = buckets_cnt;
+}
+
+static struct strings_entry *strings_add(fb_img *img, uint32_t hash)
+{
+    text_extra *ex = img->extra;
+    struct strings_entry *sen;
+    int idx;
+
+    if(cache.strings.entries >= cache.strings.buckets_cnt)
+        strings_rehash(imax(STRINGS_MIN_BUCKETS, cache.strings.buckets_cnt*2));
+
+    sen = mzalloc(sizeof(struct strings_entry));
+    sen->data = (uint8_t*)img->data;
     sen->refcnt = 1;
     sen->w = img->w;
     sen->h = img->h;
-    sen->color = ex->color;
     sen->baseline = ex->baseline;
-    map_add_not_exist(c, ex->text, sen);
+    sen->hash = hash;
+    sen->text = strdup(ex->text);
+    sen->size = ex->size;
+    sen->style = ex->style;
+    sen->justify = ex->justify;
+    sen->wrap_w = ex->wrap_w;
+
+    idx = hash & (cache.strings.buckets_cnt - 1);
+    sen->next = cache.strings.buckets[idx];
+    cache.strings.buckets[idx] = sen;
+
+    ++cache.strings.entries;
+    cache.strings.bytes += sen->w*sen->h;
+    fb_stats_cache_resize(FB_CACHE_TEXT, 1, sen->w*sen->h);
 
     TT_LOG("CACHE: add %02d 0x%08X\n", ex->size, (uint32_t)img->data);
+    return sen;
 }
 
-static int unlink_from_caches(text_extra *ex)
+static void strings_release(struct strings_entry *sen)
 {
-    struct glyphs_entry *en;
-    struct strings_entry *sen;
+    TT_LOG("CACHE: drop %02d 0x%08X\n", sen->size, (uint32_t)sen->data);
+    pthread_mutex_lock(&cache.mutex);
+    if(--sen->refcnt == 0)
+        strings_lru_append(sen);
+    pthread_mutex_unlock(&cache.mutex);
+}
 
-    sen = get_cache_for_string(ex);
-    if(sen)
+// Drops unused strings, least recently used first, until the cache is
+// no bigger than budget bytes. The draw thread may still be drawing
+// a dropped string, so its data goes to fb_defer_free().
+static void strings_evict(int budget)
+{
+    struct strings_entry *sen, **itr;
+
+    fb_items_lock();
+    pthread_mutex_lock(&cache.mutex);
+    while(cache.strings.bytes > budget && cache.strings.lru_first)
     {
-        --sen->refcnt;
-        TT_LOG("CACHE: drop %02d 0x%08X\n", ex->size, (uint32_t)sen->data);
-        return 1;
+        sen = cache.strings.lru_first;
+        strings_lru_rm(sen);
+
+        itr = &cache.strings.buckets[sen->hash & (cache.strings.buckets_cnt - 1)];
+        while(*itr != sen)
+            itr = &(*itr)->next;
+        *itr = sen->next;
+
+        TT_LOG("CACHE: evict %02d \"%s\"\n", sen->size, sen->text);
+
+        --cache.strings.entries;
+        cache.strings.bytes -= sen->w*sen->h;
+        fb_stats_cache_resize(FB_CACHE_TEXT, -1, -sen->w*sen->h);
+        fb_stats_cache_evict(FB_CACHE_TEXT);
+
+        fb_defer_free(sen->data);
+        free(sen->text);
+        free(sen);
+    }
+
+    if(cache.strings.entries == 0)
+    {
+        free(cache.strings.buckets);
+        cache.strings.buckets = NULL;
+        cache.strings.buckets_cnt = 0;
     }
-    return 0;
+    pthread_mutex_unlock(&cache.mutex);
+    fb_items_unlock();
+}
+
+// The string stays in the cache, see strings_evict()
+static void unlink_from_caches(fb_img *img)
+{
+    text_extra *ex = img->extra;
+
+    if(ex->sen)
+        strings_release(ex->sen);
+
+    ex->sen = NULL;
+    img->w = img->h = 0;
+    img->data = NULL;
 }
 
 static int measure_line(struct text_line *line, struct glyphs_entry **gen, int8_t *style_map, text_extra *ex)
 {
-    int i, penX, penY, idx, prev_idx, error, last_space, wrapped;
+    int i, penX, penY, idx, prev_idx, last_space, wrapped;
     FT_Vector delta;
-    FT_Glyph glyph;
+    struct atlas_glyph *glyph;
     struct glyphs_entry *en;
-    FT_BBox bbox, glyph_bbox;
+    FT_BBox bbox;
     bbox.yMin = LONG_MAX;
     bbox.yMax = LONG_MIN;
 
@@ -276,10 +668,12 @@ static int measure_line(struct text_line *line, struct glyphs_entry **gen, int8_
             continue;
 
         en = gen[*style_map];
-        idx = FT_Get_Char_Index(en->face, line->text[i]);
+        glyph = en->glyphs[(uint8_t)line->text[i]];
+        idx = glyph ? glyph->ft_idx : FT_Get_Char_Index(en->face, line->text[i]);
 
         if(FT_HAS_KERNING(en->face) && prev_idx && idx)
         {
+            activate_size(en);
             FT_Get_Kerning(en->face, prev_idx, idx, FT_KERNING_DEFAULT, &delta);
             penX += delta.x >> 6;
         }
@@ -298,28 +692,16 @@ static int measure_line(struct text_line *line, struct glyphs_entry **gen, int8_
         if(isspace(line->text[i]))
             last_space = i;
 
-        glyph = imap_get_val(en->glyphs, (int)line->text[i]);
-        if(!glyph)
-        {
-            error = FT_Load_Glyph(en->face, idx, FT_LOAD_DEFAULT);
-            if(error)
-                continue;
-
-            error = FT_Get_Glyph(en->face->glyph, &glyph);
-            if(error)
-                continue;
-
-            imap_add_not_exist(en->glyphs, (int)line->text[i], glyph);
-        }
+        if(!glyph && !(glyph = atlas_add_glyph(en, line->text[i], idx)))
+            continue;
 
-        FT_Glyph_Get_CBox(glyph, ft_glyph_bbox_pixels, &glyph_bbox);
-        bbox.yMin = imin(bbox.yMin, glyph_bbox.yMin);
-        bbox.yMax = imax(bbox.yMax, glyph_bbox.yMax);
+        bbox.yMin = imin(bbox.yMin, glyph->y_min);
+        bbox.yMax = imax(bbox.yMax, glyph->y_max);
 
         line->pos[i].x = penX;
         line->pos[i].y = penY;
 
-        penX += glyph->advance.x >> 16;
+        penX += glyph->advance;
         prev_idx = idx;
     }
 
@@ -332,25 +714,20 @@ static int measure_line(struct text_line *line, struct glyphs_entry **gen, int8_
     return wrapped;
 }
 
-static void render_line(struct text_line *line, struct glyphs_entry **gen, int8_t *style_map, px_type *res_data, int stride, px_type converted_color)
+static void render_line(struct text_line *line, struct glyphs_entry **gen, int8_t *style_map, uint8_t *res_data, int stride, int height)
 {
-    int i, error;
-    FT_Glyph *image;
-    FT_BitmapGlyph bit;
-    struct glyphs_entry *en;
+    int i;
+    struct atlas_glyph *g;
 
     for(i = 0; i < line->len; ++i, ++style_map)
     {
         if(*style_map == -1)
             continue;
 
-        image = imap_get_ref(gen[*style_map]->glyphs, (int)line->text[i]); // pre-cached from measure_line()
-        error = FT_Glyph_To_Bitmap(image, FT_RENDER_MODE_NORMAL, NULL, 1);
-        if(error == 0)
-        {
-            bit = (FT_BitmapGlyph)(*image);
-            convert_ft_bitmap(bit, converted_color, res_data, stride, line, &line->pos[i]);
-        }
+        g = gen[*style_map]->glyphs[(uint8_t)line->text[i]]; // pre-cached from measure_line()
+        if(g && g->page != -1)
+            blit_glyph(gen[*style_map], g, res_data, stride, height,
+                    line->offX + line->pos[i].x + g->left, line->offY + line->base - g->top);
     }
 }
 
@@ -434,44 +811,19 @@ fail:
     return NULL;
 }
 
-static void fb_text_render(fb_img *img)
+// Splits the text into lines, wrapped at ex->wrap_w, and measures them
+static int layout_lines(text_extra *ex, int8_t *style_map, struct glyphs_entry **gen,
+        struct text_line ***lines, int *max_w, int *max_h)
 {
-    int maxW, maxH, totalH, i, lineH, lines_cnt;
-    struct glyphs_entry *gen[STYLE_COUNT] = { 0 };
-    struct strings_entry *sen;
-    struct text_line **lines = NULL;
+    int lines_cnt = 0;
     char *start, *end;
-    px_type *res_data;
-    text_extra *ex = img->extra;
-    int8_t *style_map = NULL;
-
-    sen = get_cache_for_string(ex);
-    if(sen)
-    {
-        img->w = sen->w;
-        img->h = sen->h;
-        img->data = sen->data;
-        ex->baseline = sen->baseline;
-        ++sen->refcnt;
+    struct text_line *line;
 
-        TT_LOG("CACHE: use %02d 0x%08X\n", ex->size, (uint32_t)sen->data);
-        TT_LOG("Getting string %dx%d %s from cache\n", img->w, img->h, ex->text);
-        return;
-    }
-
-    if(!build_style_map(ex, &style_map, gen))
-    {
-        TT_LOG("Failed to build style map for string %s\n", ex->text);
-        return;
-    }
-
-    TT_LOG("Rendering string %s\n", ex->text);
-
-    maxW = maxH = lines_cnt = 0;
+    *max_w = *max_h = 0;
     start = ex->text;
     while(start && *start)
     {
-        struct text_line *line = mzalloc(sizeof(struct text_line));
+        line = mzalloc(sizeof(struct text_line));
         line->text = start;
 
         end = strchr(start, '\n');
@@ -491,12 +843,54 @@ static void fb_text_render(fb_img *img)
         if(measure_line(line, gen, style_map + (line->text - ex->text), ex))
             start = line->text + line->len;
 
-        maxW = imax(maxW, line->w);
-        maxH = imax(maxH, line->h);
+        *max_w = imax(*max_w, line->w);
+        *max_h = imax(*max_h, line->h);
 
-        list_add(&lines, line);
+        list_add(lines, line);
         ++lines_cnt;
     }
+    return lines_cnt;
+}
+
+static void fb_text_render_locked(fb_img *img)
+{
+    int maxW, maxH, totalH, i, lineH, lines_cnt;
+    struct glyphs_entry *gen[STYLE_COUNT] = { 0 };
+    struct strings_entry *sen;
+    struct text_line **lines = NULL;
+    uint8_t *res_data;
+    text_extra *ex = img->extra;
+    int8_t *style_map = NULL;
+    const uint32_t hash = strings_hash(ex);
+
+    sen = strings_find(ex, hash);
+    if(sen)
+    {
+        img->w = sen->w;
+        img->h = sen->h;
+        img->data = (px_type*)sen->data;
+        ex->baseline = sen->baseline;
+        ex->sen = sen;
+        if(sen->refcnt++ == 0)
+            strings_lru_rm(sen);
+        fb_stats_cache_lookup(FB_CACHE_TEXT, 1);
+
+        TT_LOG("CACHE: use %02d 0x%08X\n", ex->size, (uint32_t)sen->data);
+        TT_LOG("Getting string %dx%d %s from cache\n", img->w, img->h, ex->text);
+        return;
+    }
+
+    fb_stats_cache_lookup(FB_CACHE_TEXT, 0);
+
+    if(!build_style_map(ex, &style_map, gen))
+    {
+        TT_LOG("Failed to build style map for string %s\n", ex->text);
+        return;
+    }
+
+    TT_LOG("Rendering string %s\n", ex->text);
+
+    lines_cnt = layout_lines(ex, style_map, gen, &lines, &maxW, &maxH);
 
     lineH = maxH * LINE_SPACING;
     totalH = 0;
@@ -523,21 +917,30 @@ static void fb_text_render(fb_img *img)
 
     img->w = img->h = 0;
 
-    // always 4 bytes per pixel cause of fb_img data structure
-    img->data = mzalloc(maxW*totalH*4);
+    // coverage only, the color is applied when the text is drawn
+    res_data = mzalloc(maxW*totalH);
 
     for(i = 0; i < lines_cnt; ++i)
-        render_line(lines[i], gen, style_map + (lines[i]->text - ex->text), img->data, maxW, ex->color);
+        render_line(lines[i], gen, style_map + (lines[i]->text - ex->text), res_data, maxW, totalH);
+
+    img->data = (px_type*)res_data;
 
     img->w = maxW;
     img->h = totalH;
 
-    add_to_strings(img);
+    ex->sen = strings_add(img, hash);
 
     list_clear(&lines, &destroy_line);
     free(style_map);
 }
 
+static void fb_text_render(fb_img *img)
+{
+    pthread_mutex_lock(&cache.mutex);
+    fb_text_render_locked(img);
+    pthread_mutex_unlock(&cache.mutex);
+}
+
 fb_img *fb_add_text(int x, int y, uint32_t color, int size, const char *fmt, ...)
 {
     int ret;
@@ -592,11 +995,11 @@ fb_img *fb_text_finalize(fb_text_proto *p)
     result->y = p->y;
     result->img_type = FB_IMG_TYPE_TEXT;
     result->data = NULL;
+    // set color's alpha to 0 because data from the font will act as alpha
+    result->color = fb_convert_color(p->color & ~(0xFF << 24));
     result->extra = mzalloc(sizeof(text_extra));
 
     text_extra *extras = result->extra;
-    // set color's alpha to 0 because data from the font will act as alpha
-    extras->color = fb_convert_color(p->color & ~(0xFF << 24));
     extras->size = p->size;
     extras->justify = p->justify;
     extras->style = p->style;
@@ -607,61 +1010,23 @@ fb_img *fb_text_finalize(fb_text_proto *p)
 
     fb_text_render(result);
     fb_ctx_add_item(result);
+    strings_evict(MR_TEXT_CACHE_KB*1024);
 
     return result;
 }
 
 void fb_text_set_color(fb_img *img, uint32_t color)
 {
-    text_extra *extras = img->extra;
-    int copy = 0;
     const px_type converted_color = fb_convert_color(color & ~(0xFF << 24));
 
-    if(extras->color == converted_color)
+    if(img->color == converted_color)
         return;
 
-    struct strings_entry *sen = get_cache_for_string(extras);
-    if(sen)
-    {
-        if(sen->refcnt == 1)
-            sen->color = converted_color;
-        else
-        {
-            copy = 1;
-            --sen->refcnt;
-        }
-    }
-
-    extras->color = converted_color;
-
+    // the coverage stays the same, the draw thread colors it
     fb_items_lock();
-
-    px_type *itr = img->data;
-    if(copy)
-    {
-        img->data = malloc(img->w*img->h*4);
-        memcpy(img->data, itr, img->w*img->h*4);
-        itr = img->data;
-    }
-
-    const px_type *end = (px_type*)(((uint32_t*)itr) + img->w * img->h);
-    int alpha;
-
-    while(itr != end)
-    {
-#if PIXEL_SIZE == 4
-        alpha = *itr & (0xFF << PX_IDX_A*8);
-        if(alpha != 0)
-            *itr = converted_color | alpha;
-        ++itr;
-#else
-        if(itr[1] != 0)
-            *itr = converted_color;
-        itr += 2;
-#endif
-    }
-
+    img->color = converted_color;
     fb_items_unlock();
+    fb_item_damage(img);
 }
 
 void fb_text_set_size(fb_img *img, int size)
@@ -672,16 +1037,13 @@ void fb_text_set_size(fb_img *img, int size)
         return;
 
     fb_items_lock();
-    if(unlink_from_caches(ex) == 0)
-    {
-        img->w = img->h = 0;
-        free(img->data);
-        img->data = NULL;
-    }
+    unlink_from_caches(img);
 
     ex->size = size;
     fb_text_render(img);
     fb_items_unlock();
+    fb_item_damage(img);
+    strings_evict(MR_TEXT_CACHE_KB*1024);
 }
 
 void fb_text_set_content(fb_img *img, const char *text)
@@ -692,17 +1054,14 @@ void fb_text_set_content(fb_img *img, const char *text)
         return;
 
     fb_items_lock();
-    if(unlink_from_caches(ex) == 0)
-    {
-        img->w = img->h = 0;
-        free(img->data);
-        img->data = NULL;
-    }
+    unlink_from_caches(img);
 
     ex->text = realloc(ex->text, strlen(text)+1);
     strcpy(ex->text, text);
     fb_text_render(img);
     fb_items_unlock();
+    fb_item_damage(img);
+    strings_evict(MR_TEXT_CACHE_KB*1024);
 }
 
 char *fb_text_get_content(fb_img *img)
@@ -711,6 +1070,12 @@ char *fb_text_get_content(fb_img *img)
     return ex->text;
 }
 
+int fb_text_get_baseline(fb_img *img)
+{
+    text_extra *ex = img->extra;
+    return ex->baseline;
+}
+
 inline void center_text(fb_img *text, int targetX, int targetY, int targetW, int targetH)
 {
     text_extra *ex = text->extra;
@@ -726,23 +1091,23 @@ void fb_text_destroy(fb_img *i)
 {
     text_extra *ex = i->extra;
 
-    struct strings_entry *sen = get_cache_for_string(ex);
-    if(sen)
-    {
-        TT_LOG("CACHE: drop %02d 0x%08X\n", ex->size, (uint32_t)sen->data);
-        --sen->refcnt;
-    }
-    else
-    {
-        TT_LOG("CACHE: free %02d 0x%08X\n", ex->size, (uint32_t)i->data);
-        free(i->data);
-    }
+    // the data is freed by strings_evict()
+    if(ex->sen)
+        strings_release(ex->sen);
 
     free(ex->text);
     free(ex);
     // fb_img is freed in fb_destroy_item
 }
 
+static void destroy_atlas_page(void *page)
+{
+    struct atlas_page *p = page;
+    free(p->data);
+    free(p->shelves);
+    free(p);
+}
+
 static int drop_glyphs_cache(imap *g_cache)
 {
     size_t i;
@@ -750,54 +1115,20 @@ static int drop_glyphs_cache(imap *g_cache)
     {
         const int key = g_cache->keys[i];
         struct glyphs_entry *en = g_cache->values[i];
-        imap_destroy(en->glyphs, (void*)&FT_Done_Glyph);
-        FT_Done_Face(en->face);
+        list_clear(&en->blocks, &free);
+        list_clear(&en->pages, &destroy_atlas_page);
+        FT_Done_Size(en->size);
         imap_rm(g_cache, key, &free);
     }
     return g_cache->size == 0;
 }
 
-static int drop_strings_cache(imap *s_cache)
-{
-    size_t i, x;
-    for(i = 0; i < s_cache->size; )
-    {
-        const int key = s_cache->keys[i];
-        map *size_c = s_cache->values[i];
-        TT_LOG("Dropping unused string caches for size %d\n", key);
-
-        for(x = 0; x < size_c->size; )
-        {
-            char *s_key = size_c->keys[x];
-            struct strings_entry *sen = size_c->values[x];
-
-            TT_LOG("strings_entry size %d str \"%s\" has refcnt %d\n", key, s_key, sen->refcnt);
-            if(sen->refcnt == 0)
-            {
-                free(sen->data);
-                map_rm(size_c, s_key, &free);
-            }
-            else
-                ++x;
-        }
-
-        if(size_c->size == 0)
-        {
-            TT_LOG("Removing string cache for size %d\n", key);
-            map_destroy(size_c, &free);
-            imap_rm(s_cache, key, NULL);
-        }
-        else
-            ++i;
-    }
-    return s_cache->size == 0;
-}
-
 void fb_text_drop_cache_unused(void)
 {
     size_t s;
     int free_ft_lib = 1;
 
+    pthread_mutex_lock(&cache.mutex);
     for(s = 0; s < STYLE_COUNT; ++s)
     {
         if(cache.glyphs[s])
@@ -813,20 +1144,136 @@ void fb_text_drop_cache_unused(void)
         }
     }
 
-    if(cache.strings)
-    {
-        if(drop_strings_cache(cache.strings))
-        {
-            TT_LOG("Whole string cache was freed.\n");
-            imap_destroy(cache.strings, NULL);
-            cache.strings = NULL;
-        }
-    }
-
     if(free_ft_lib && cache.ft_lib)
     {
         TT_LOG("Freeing libfreetype\n");
+        close_font_faces();
         FT_Done_FreeType(cache.ft_lib);
         cache.ft_lib = NULL;
     }
+    pthread_mutex_unlock(&cache.mutex);
+
+    strings_evict(MR_TEXT_CACHE_KB*1024);
+}
+
+/*
+ * Benchmark of the text layout, on strings like the ones the UI shows.
+ * The glyphs are cached before the measurements, as they mostly are when
+ * the UI runs, and the string cache is not used. Glyph lookups are also
+ * compared with the imap which was used before the lookup table.
+ */
+
+static uint64_t bench_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
+void fb_text_benchmark(void)
+{
+    static const struct
+    {
+        const char *text;
+        int size;
+        int style;
+        int wrap; // at the width of notification card's text
+    } samples[] = {
+        { "Internal", SIZE_NORMAL, STYLE_MEDIUM, 0 },
+        { "Ubuntu_Touch_15.04", SIZE_BIG, STYLE_NORMAL, 0 },
+        { "COPY LOG TO /SDCARD", SIZE_NORMAL, STYLE_NORMAL, 0 },
+        { "Battery: 87%", SIZE_SMALL, STYLE_NORMAL, 0 },
+        { "MultiROM v33 with trampoline v27.", SIZE_SMALL, STYLE_NORMAL, 0 },
+        { "Auto-boot", SIZE_EXTRA, STYLE_MEDIUM, 1 },
+        { "\n<b>ROM:</b> <y>Ubuntu_Touch_15.04</y>\n\nBooting in 5 seconds.", SIZE_NORMAL, STYLE_NORMAL, 1 },
+        { "Kexec-hardboot support is required to boot this ROM.\n\n"
+          "Install kernel with kexec-hardboot support to your Internal ROM!", SIZE_NORMAL, STYLE_NORMAL, 1 },
+        { "This list is refreshed automagically, just plug in the USB drive and wait.", SIZE_NORMAL, STYLE_NORMAL, 1 },
+    };
+    const int iterations = 1000;
+    const int wrap_w = (fb_width ? fb_width : 1080) - 160*DPI_MUL;
+    struct glyphs_entry *gen[STYLE_COUNT];
+    struct text_line **lines = NULL;
+    imap *ref[STYLE_COUNT];
+    int8_t *style_map;
+    text_extra ex;
+    uint64_t start, ref_ns, table_ns, layout_us, chars = 0, total_us = 0;
+    volatile int found = 0;
+    size_t s;
+    int i, c, n, len, lines_cnt, max_w, max_h;
+
+    printf("Text layout benchmark, %d iterations\n", iterations);
+    printf("%-20s %5s %5s %10s %10s %11s %8s\n", "string", "chars", "lines",
+            "imap [ns]", "table [ns]", "layout [us]", "chars/ms");
+
+    pthread_mutex_lock(&cache.mutex);
+    for(s = 0; s < sizeof(samples)/sizeof(samples[0]); ++s)
+    {
+        memset(&ex, 0, sizeof(ex));
+        memset(gen, 0, sizeof(gen));
+        ex.text = (char*)samples[s].text;
+        ex.size = samples[s].size;
+        ex.style = samples[s].style;
+        ex.wrap_w = samples[s].wrap ? wrap_w : 0;
+        len = strlen(ex.text);
+
+        if(!build_style_map(&ex, &style_map, gen))
+        {
+            printf("Failed to load fonts from %s/res\n", mrom_dir());
+            break;
+        }
+
+        // caches the glyphs
+        lines_cnt = layout_lines(&ex, style_map, gen, &lines, &max_w, &max_h);
+        list_clear(&lines, &destroy_line);
+
+        for(i = 0; i < STYLE_COUNT; ++i)
+        {
+            ref[i] = imap_create();
+            for(c = 0; gen[i] && c < 256; ++c)
+                if(gen[i]->glyphs[c])
+                    imap_add_not_exist(ref[i], (char)c, gen[i]->glyphs[c]);
+        }
+
+        start = bench_now_us();
+        for(n = 0; n < iterations; ++n)
+            for(i = 0; i < len; ++i)
+                if(style_map[i] != -1)
+                    found += imap_get_val(ref[style_map[i]], ex.text[i]) != NULL;
+        ref_ns = (bench_now_us() - start)*1000/iterations;
+
+        start = bench_now_us();
+        for(n = 0; n < iterations; ++n)
+            for(i = 0; i < len; ++i)
+                if(style_map[i] != -1)
+                    found += gen[style_map[i]]->glyphs[(uint8_t)ex.text[i]] != NULL;
+        table_ns = (bench_now_us() - start)*1000/iterations;
+
+        start = bench_now_us();
+        for(n = 0; n < iterations; ++n)
+        {
+            layout_lines(&ex, style_map, gen, &lines, &max_w, &max_h);
+            list_clear(&lines, &destroy_line);
+        }
+        layout_us = bench_now_us() - start;
+
+        printf("%-20.20s %5d %5d %10llu %10llu %11.2f %8llu\n", ex.text + (ex.text[0] == '\n'),
+                len, lines_cnt, (unsigned long long)ref_ns, (unsigned long long)table_ns,
+                (double)layout_us/iterations,
+                layout_us ? (unsigned long long)len*iterations*1000/layout_us : 0ULL);
+
+        chars += len*iterations;
+        total_us += layout_us;
+
+        for(i = 0; i < STYLE_COUNT; ++i)
+            imap_destroy(ref[i], NULL);
+        free(style_map);
+    }
+    pthread_mutex_unlock(&cache.mutex);
+
+    if(total_us)
+        printf("Total: %llu chars/ms\n", (unsigned long long)(chars*1000/total_us));
+    fflush(stdout);
+
+    fb_text_drop_cache_unused();
 }
@@ -36,6 +36,7 @@
 #include "workers.h"
 #include "containers.h"
 #include "notification_card.h"
+#include "perf_hud.h"
 
 // for touch calculation
 int mt_screen_res[2] = { 0 };
@@ -173,20 +174,53 @@ static int ev_get(struct input_event *ev, unsigned dont_wait)
 
 #define IS_KEY_HANDLED(key) (key >= KEY_VOLUMEDOWN && key <= KEY_POWER)
 
-static int screenshot_trigger_handle_keyevent(int code, int pressed)
+#define CAPTURE_BUDGET_KB (16*1024)
+
+static void key_chord_toggle_capture(void)
+{
+    if(fb_capture_is_active())
+        fb_capture_save();
+    else
+        fb_capture_start(CAPTURE_BUDGET_KB);
+}
+
+// POWER + VOLUME DOWN takes a screenshot, POWER + VOLUME UP toggles the performance HUD,
+// VOLUME UP + VOLUME DOWN starts a frame capture and the next one saves it
+static int key_chord_handle_keyevent(int code, int pressed)
 {
     static int power_pressed = 0;
+    static int up_pressed = 0;
+    static int down_pressed = 0;
     switch(code)
     {
         case KEY_POWER:
             power_pressed = pressed;
             break;
         case KEY_VOLUMEDOWN:
+            down_pressed = pressed;
             if(power_pressed && pressed)
             {
                 fb_save_screenshot();
                 return 0;
             }
+            if(up_pressed && pressed)
+            {
+                key_chord_toggle_capture();
+                return 0;
+            }
+            break;
+        case KEY_VOLUMEUP:
+            up_pressed = pressed;
+            if(power_pressed && pressed)
+            {
+                perf_hud_toggle();
+                return 0;
+            }
+            if(down_pressed && pressed)
+            {
+                key_chord_toggle_capture();
+                return 0;
+            }
             break;
     }
     return -1;
@@ -197,7 +231,7 @@ static void handle_key_event(struct input_event *ev)
     if(!IS_KEY_HANDLED(ev->code))
         return;
 
-    if(screenshot_trigger_handle_keyevent(ev->code, (ev->value != 0)) != -1)
+    if(key_chord_handle_keyevent(ev->code, (ev->value != 0)) != -1)
         return;
 
     if(keyaction_handle_keyevent(ev->code, (ev->value != 0)) != -1)
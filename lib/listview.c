@@ -104,6 +104,7 @@ void listview_destroy(listview *view)
     fb_rm_rect(view->overscroll_marks[0]);
     fb_rm_rect(view->overscroll_marks[1]);
     fb_rm_rect(view->scroll_line);
+    fb_rm_layer(view->items_layer);
 
     fb_ctx_rm_item(view);
 
@@ -170,6 +171,14 @@ void listview_update_ui_args(listview *view, int only_if_moved, int mutex_locked
     if(!mutex_locked)
         fb_batch_start();
 
+    if(view->items_layer)
+    {
+        view->items_layer->x = view->x;
+        view->items_layer->y = view->y;
+        view->items_layer->w = view->w;
+        view->items_layer->h = view->h;
+    }
+
     for(i = 0; view->items && view->items[i]; ++i)
     {
         it = view->items[i];
@@ -224,6 +233,11 @@ void listview_enable_scroll(listview *view, int enable)
         view->overscroll_marks[1] = fb_add_rect(view->x, view->y+view->h-OVERSCROLL_MARK_H,
                                                 0, OVERSCROLL_MARK_H, C_HIGHLIGHT_BG);
         view->overscroll_marks[1]->parent = (fb_item_pos*)view;
+
+        listview_adopt_item(view, view->scroll_mark);
+        listview_adopt_item(view, view->scroll_line);
+        listview_adopt_item(view, view->overscroll_marks[0]);
+        listview_adopt_item(view, view->overscroll_marks[1]);
         workers_add(listview_bounceback, view);
     }
     else
@@ -522,6 +536,18 @@ void listview_update_keyact_frame(listview *view)
     listview_update_ui(view);
 }
 
+void listview_set_layer(listview *view, uint32_t background)
+{
+    if(!view->items_layer)
+        view->items_layer = fb_add_layer_lvl(view->level, view->x, view->y, view->w, view->h, background);
+}
+
+void listview_adopt_item(listview *view, void *item)
+{
+    if(view->items_layer)
+        fb_layer_add_item(view->items_layer, item);
+}
+
 #define ROM_ITEM_H (110*DPI_MUL)
 #define ROM_ITEM_SHADOW (7*DPI_MUL)
 #define ROM_ITEM_SEL_W (8*DPI_MUL)
@@ -598,6 +624,8 @@ static void rom_item_select(int x, int y, int w, int item_h, listview_item *it,
     d->sel_rect_sh->parent = it->parent_rect;
     d->sel_rect = fb_add_rect(baseX, baseY, 1, 1, C_ROM_HIGHLIGHT);
     d->sel_rect->parent = it->parent_rect;
+    listview_adopt_item((listview*)it->parent_rect, d->sel_rect_sh);
+    listview_adopt_item((listview*)it->parent_rect, d->sel_rect);
 
     item_anim *anim = item_anim_create(d->sel_rect, 300, INTERPOLATOR_ACCEL_DECEL);
     anim->start_offset = 0;
@@ -658,6 +686,7 @@ void rom_item_draw(int x, int y, int w, listview_item *it)
         p->style = STYLE_CONDENSED;
         d->text_it = fb_text_finalize(p);
         d->text_it->parent = it->parent_rect;
+        listview_adopt_item((listview*)it->parent_rect, d->text_it);
 
         while((d->text_it->w + ROM_TEXT_PADDING_L) >= (w - ROM_TEXT_PADDING_R) && d->rom_name_size > 3)
             fb_text_set_size(d->text_it, --d->rom_name_size);
@@ -666,12 +695,14 @@ void rom_item_draw(int x, int y, int w, listview_item *it)
         {
             d->icon = fb_add_png_img(x+ROM_ICON_PADDING, 0, ROM_ICON_H, ROM_ICON_H, d->icon_path);
             d->icon->parent = it->parent_rect;
+            listview_adopt_item((listview*)it->parent_rect, d->icon);
         }
 
         if(d->partition)
         {
             d->part_it = fb_add_text(x+ROM_TEXT_PADDING_L, 0, C_TEXT_SECONDARY, SIZE_SMALL, d->partition);
             d->part_it->parent = it->parent_rect;
+            listview_adopt_item((listview*)it->parent_rect, d->part_it);
         }
     }
 
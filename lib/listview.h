@@ -73,6 +73,8 @@ typedef struct
 
     listview_touch_data touch;
     touch_tracker *tracker;
+
+    fb_layer *items_layer;
 } listview;
 
 int listview_touch_handler(touch_event *ev, void *data);
@@ -93,6 +95,10 @@ int listview_ensure_selected_visible(listview *view);
 listview_item *listview_item_at(listview *view, int y_pos);
 inline int listview_select_item(listview *view, listview_item *it);
 void listview_update_keyact_frame(listview *view);
+// Caches the items drawn by the view in a layer, background is the color
+// behind the view. Must be called before any items are added.
+void listview_set_layer(listview *view, uint32_t background);
+void listview_adopt_item(listview *view, void *item);
 int listview_keyaction_call(void *data, int act);
 
 void *rom_item_create(const char *text, const char *partition, const char *icon);
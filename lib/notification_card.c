@@ -107,6 +107,11 @@ void ncard_set_from_black(ncard_builder *b, int from_black)
     b->reveal_from_black = from_black;
 }
 
+void ncard_set_use_layer(ncard_builder *b, int use_layer)
+{
+    b->use_layer = use_layer;
+}
+
 static int ncard_calc_pos(ncard_builder* b, int max_y)
 {
     if(b->pos == NCARD_POS_AUTO)
@@ -135,6 +140,7 @@ struct ncard
     fb_rect *alpha_bg;
     fb_text **texts;
     fb_rect *hover_rect;
+    fb_layer *layer;
     struct ncard_btn btns[BTN_COUNT];
     int active_btns;
     int pos;
@@ -158,6 +164,7 @@ struct ncard
     .top_offset = 0,
     .hiding = 0,
     .hover_rect = NULL,
+    .layer = NULL,
     .touch_handler_registered = 0,
     .touch_id = -1,
     .hover_btn = 0,
@@ -168,6 +175,18 @@ struct ncard
     .mutex = PTHREAD_MUTEX_INITIALIZER,
 };
 
+// The layer covers the card's background, which is moved by animations
+static void ncard_layer_follow_bg(struct ncard *c)
+{
+    if(!c->layer)
+        return;
+
+    c->layer->x = c->bg->x;
+    c->layer->y = c->bg->y;
+    c->layer->w = c->bg->w;
+    c->layer->h = c->bg->h;
+}
+
 static int ncard_touch_handler(touch_event *ev, void *data)
 {
     struct ncard *c = data;
@@ -189,6 +208,8 @@ static int ncard_touch_handler(touch_event *ev, void *data)
                 if(c->pos == NCARD_POS_CENTER)
                     level += LEVEL_NCARD_CENTER_OFFSET;
                 c->hover_rect = fb_add_rect_lvl(level, c->btns[i].pos.x, c->btns[i].pos.y, c->btns[i].pos.w, c->btns[i].pos.h, C_NCARD_SHADOW);
+                if(c->layer)
+                    fb_layer_add_item(c->layer, c->hover_rect);
 
                 c->touch_id = ev->id;
                 c->hover_btn = i;
@@ -259,6 +280,7 @@ static void ncard_move_step(void *data, float interpolated)
     if(c->hover_rect)
         c->hover_rect->y += diff;
     c->last_y = c->bg->y;
+    ncard_layer_follow_bg(c);
 
     if(c->alpha_bg && (c->hiding || (c->alpha_bg->color & (0xFF << 24)) != 0xCC000000))
     {
@@ -283,6 +305,7 @@ static void ncard_reveal_finished(UNUSED void *data)
     pthread_mutex_lock(&ncard.mutex);
     ncard.bg->h = ncard.targetH;
     ncard.shadow->h = ncard.targetH;
+    ncard_layer_follow_bg(&ncard);
     pthread_mutex_unlock(&ncard.mutex);
 }
 
@@ -293,6 +316,7 @@ static void ncard_hide_finished(void *data)
     fb_rm_rect(c->shadow);
     fb_rm_rect(c->alpha_bg);
     fb_rm_rect(c->hover_rect);
+    fb_rm_layer(c->layer);
     free(c);
 }
 
@@ -455,6 +479,24 @@ void ncard_show(ncard_builder *b, int destroy_builder)
 
     ncard.shadow->y = ncard.pos == NCARD_POS_BOTTOM ? ncard.bg->y - CARD_SHADOW_OFF : ncard.bg->y + CARD_SHADOW_OFF;
 
+    if(b->use_layer && !ncard.layer)
+    {
+        ncard.layer = fb_add_layer_lvl(ncard.bg->level, ncard.bg->x, ncard.bg->y, ncard.bg->w, ncard.bg->h, C_NCARD_BG);
+        fb_layer_add_item(ncard.layer, ncard.bg);
+    }
+    else if(!b->use_layer && ncard.layer)
+    {
+        fb_rm_layer(ncard.layer);
+        ncard.layer = NULL;
+    }
+
+    if(ncard.layer)
+    {
+        ncard_layer_follow_bg(&ncard);
+        for(i = 0; ncard.texts && ncard.texts[i]; ++i)
+            fb_layer_add_item(ncard.layer, ncard.texts[i]);
+    }
+
     ncard.last_y = ncard.bg->y;
     ncard.cancelable = b->cancelable;
     ncard.on_hidden_call = b->on_hidden_call;
@@ -501,7 +543,9 @@ void ncard_hide(void)
     c->texts = ncard.texts;
     c->last_y = c->bg->y;
     c->alpha_bg = ncard.alpha_bg;
+    c->layer = ncard.layer;
     c->hiding = 1;
+    ncard.layer = NULL;
     ncard.shadow = NULL;
     ncard.hover_rect = NULL;
     ncard.bg = NULL;
@@ -56,6 +56,7 @@ typedef struct
     ncard_callback on_hidden_call;
     void *on_hidden_data;
     int reveal_from_black;
+    int use_layer;
 } ncard_builder;
 
 ncard_builder *ncard_create_builder(void);
@@ -67,6 +68,8 @@ void ncard_avoid_item(ncard_builder *b, void *item);
 void ncard_add_btn(ncard_builder *b, int btn_type, const char *text, ncard_callback callback, void *callback_data);
 void ncard_set_on_hidden(ncard_builder *b, ncard_callback callback, void *data);
 void ncard_set_from_black(ncard_builder *b, int from_black);
+// Caches the card's content in a layer, it is re-rendered only when it changes
+void ncard_set_use_layer(ncard_builder *b, int use_layer);
 
 void ncard_set_top_offset(int offset);
 void ncard_show(ncard_builder *b, int destroy_builder);
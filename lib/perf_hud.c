@@ -0,0 +1,342 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "perf_hud.h"
+#include "framebuffer.h"
+#include "workers.h"
+#include "containers.h"
+#include "util.h"
+#include "log.h"
+
+/*
+ * The HUD is a layer, so the frames it reports on only copy its cached
+ * pixels. The text is a grid of one character items in monospace font:
+ * updating it only swaps the characters which have changed and those
+ * all come from the text cache, so the HUD doesn't grow it.
+ *
+ * The HUD's items belong to the fb context which was active when they
+ * were created. A context can be pushed away and popped back (pong does
+ * that), so views of the HUD are found by the id of their layer and
+ * the one in the current context is reused.
+ */
+
+#define HUD_LEVEL 100000
+#define HUD_ROWS 3
+#define HUD_COLS 24
+#define HUD_GRAPH_BARS 48
+#define HUD_GRAPH_ROWS 3
+#define HUD_REFRESH_MS 500
+#define HUD_MAX_VIEWS 4
+#define HUD_STATS_FRAMES 128
+#define HUD_FRAME_BUDGET_US 16667
+#define HUD_PADDING (6*DPI_MUL)
+
+#define HUD_BG 0xFF202020
+#define HUD_FG 0xFFFFFFFF
+#define HUD_BAR_OK 0xFF4CAF50
+#define HUD_BAR_SLOW 0xFFF44336
+#define HUD_BUDGET 0xFF808080
+
+typedef struct
+{
+    int layer_id;
+    fb_layer *layer;
+    fb_img *cells[HUD_ROWS][HUD_COLS];
+    char text[HUD_ROWS][HUD_COLS];
+    fb_rect *bars[HUD_GRAPH_BARS];
+    fb_rect *budget;
+} hud_view;
+
+static struct
+{
+    volatile int visible;
+    int worker_added;
+    int shown;
+    uint32_t since_refresh;
+    hud_view **views;
+    int cell_w, cell_h, baseline;
+    int graph_y, graph_h;
+    // the HUD's own text cache lookups, which are left out of the hit rate
+    uint32_t own_hits, own_misses;
+    fb_frame_stats frames[HUD_STATS_FRAMES];
+} hud;
+
+static pthread_mutex_t hud_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void perf_hud_measure_cell(void)
+{
+    fb_text_proto *p = fb_text_create(0, 0, HUD_FG, SIZE_SMALL, "0000000000");
+    fb_img *t;
+
+    p->style = STYLE_MONOSPACE;
+    t = fb_text_finalize(p);
+    hud.cell_w = imax(t->w/10, 1);
+    hud.cell_h = t->h + 2*DPI_MUL;
+    hud.baseline = fb_text_get_baseline(t);
+    fb_rm_text(t);
+}
+
+static int perf_hud_row_y(int row)
+{
+    if(row == 0)
+        return HUD_PADDING;
+    return hud.graph_y + hud.graph_h + HUD_PADDING + (row-1)*hud.cell_h;
+}
+
+static hud_view *perf_hud_view_create(void)
+{
+    int i, w, h, bar_w;
+    hud_view *v = mzalloc(sizeof(hud_view));
+
+    if(hud.cell_w == 0)
+        perf_hud_measure_cell();
+
+    hud.graph_y = HUD_PADDING + hud.cell_h;
+    hud.graph_h = HUD_GRAPH_ROWS*hud.cell_h;
+
+    w = HUD_COLS*hud.cell_w + 2*HUD_PADDING;
+    h = perf_hud_row_y(HUD_ROWS) + HUD_PADDING;
+
+    v->layer = fb_add_layer_lvl(HUD_LEVEL, 0, 0, w, h, HUD_BG);
+    v->layer_id = v->layer->id;
+    memset(v->text, ' ', sizeof(v->text));
+
+    bar_w = (w - 2*HUD_PADDING)/HUD_GRAPH_BARS;
+    for(i = 0; i < HUD_GRAPH_BARS; ++i)
+    {
+        v->bars[i] = fb_add_rect_lvl(HUD_LEVEL, HUD_PADDING + i*bar_w, hud.graph_y + hud.graph_h,
+                imax(bar_w - 1, 1), 0, HUD_BAR_OK);
+        fb_layer_add_item(v->layer, v->bars[i]);
+    }
+
+    // bars reach half of the graph at the frame budget
+    v->budget = fb_add_rect_lvl(HUD_LEVEL, HUD_PADDING, hud.graph_y + hud.graph_h/2,
+            w - 2*HUD_PADDING, imax(DPI_MUL, 1), HUD_BUDGET);
+    fb_layer_add_item(v->layer, v->budget);
+
+    list_add(&hud.views, v);
+
+    // The oldest views are in contexts which were pushed away or are gone
+    // already. Forgetting one only means it stays frozen if it comes back.
+    if(list_item_count(hud.views) > HUD_MAX_VIEWS)
+        list_rm_noreorder(&hud.views, hud.views[0], &free);
+
+    return v;
+}
+
+static void perf_hud_view_destroy(void *view)
+{
+    hud_view *v = view;
+    int r, c;
+
+    for(r = 0; r < HUD_ROWS; ++r)
+        for(c = 0; c < HUD_COLS; ++c)
+            if(v->cells[r][c])
+                fb_rm_text(v->cells[r][c]);
+
+    for(c = 0; c < HUD_GRAPH_BARS; ++c)
+        fb_rm_rect(v->bars[c]);
+    fb_rm_rect(v->budget);
+    fb_rm_layer(v->layer);
+    free(v);
+}
+
+// Removes the HUD's views from the current context, except for the one
+// which is returned if keep is set. Views in other contexts are left alone.
+static hud_view *perf_hud_sweep(int keep)
+{
+    hud_view *res = NULL;
+    int i;
+
+    for(i = 0; hud.views && hud.views[i];)
+    {
+        if(!fb_find_item(hud.views[i]->layer_id))
+            ++i;
+        else if(keep && !res)
+            res = hud.views[i++];
+        else
+            list_rm_at(&hud.views, i, &perf_hud_view_destroy);
+    }
+    return res;
+}
+
+static void perf_hud_set_row(hud_view *v, int row, const char *text)
+{
+    char ch[2] = { 0, 0 };
+    fb_text_proto *p;
+    fb_img **cell;
+    int c;
+
+    for(c = 0; c < HUD_COLS; ++c)
+    {
+        ch[0] = *text ? *text++ : ' ';
+        if(ch[0] == v->text[row][c])
+            continue;
+
+        v->text[row][c] = ch[0];
+        cell = &v->cells[row][c];
+        if(*cell)
+            fb_text_set_content(*cell, ch);
+        else
+        {
+            p = fb_text_create(0, 0, HUD_FG, SIZE_SMALL, ch);
+            p->level = HUD_LEVEL;
+            p->style = STYLE_MONOSPACE;
+            *cell = fb_text_finalize(p);
+            fb_layer_add_item(v->layer, *cell);
+        }
+        // glyphs have different heights, line them up on the baseline
+        center_text(*cell, HUD_PADDING + c*hud.cell_w, -1, hud.cell_w, -1);
+        (*cell)->y = perf_hud_row_y(row) + hud.baseline - fb_text_get_baseline(*cell);
+    }
+}
+
+static void perf_hud_cache_row(char *buff, int size, const char *name, int cache)
+{
+    fb_cache_stats cs;
+    uint32_t lookups;
+
+    fb_stats_get_cache(cache, &cs);
+    if(cache == FB_CACHE_TEXT)
+    {
+        cs.hits -= hud.own_hits;
+        cs.misses -= hud.own_misses;
+    }
+
+    lookups = cs.hits + cs.misses;
+    snprintf(buff, size, "%-4s %4d %6dK %3u%%", name, cs.entries, cs.bytes/1024,
+            lookups ? (cs.hits*100)/lookups : 0);
+}
+
+static void perf_hud_update(hud_view *v)
+{
+    char rows[HUD_ROWS][HUD_COLS+1];
+    struct timespec now;
+    uint64_t now_us;
+    uint32_t frame_us, worst_us = 0, cpu_us = 0;
+    int i, idx, cnt, fps = 0, bar_h;
+    fb_frame_stats *f;
+    fb_cache_stats before, after;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    now_us = ((uint64_t)now.tv_sec)*1000000 + now.tv_nsec/1000;
+
+    cnt = fb_stats_get_frames(hud.frames, HUD_STATS_FRAMES);
+    for(i = 0; i < cnt; ++i)
+    {
+        f = &hud.frames[i];
+        if(f->time_us + 1000000 < now_us)
+            continue;
+        ++fps;
+        cpu_us += f->cpu_us;
+        worst_us = imax(worst_us, f->composite_us + f->present_us + f->capture_us);
+    }
+
+    for(i = 0; i < HUD_GRAPH_BARS; ++i)
+    {
+        idx = cnt - HUD_GRAPH_BARS + i;
+        frame_us = idx >= 0 ? hud.frames[idx].composite_us + hud.frames[idx].present_us +
+                hud.frames[idx].capture_us : 0;
+        bar_h = imin(((int64_t)frame_us)*hud.graph_h/(2*HUD_FRAME_BUDGET_US), hud.graph_h);
+
+        v->bars[i]->y = hud.graph_y + hud.graph_h - bar_h;
+        v->bars[i]->h = bar_h;
+        v->bars[i]->color = frame_us > HUD_FRAME_BUDGET_US ? HUD_BAR_SLOW : HUD_BAR_OK;
+    }
+
+    // the row is exactly HUD_COLS wide with three digits in each field
+    fps = imin(fps, 999);
+    if(worst_us > 999999)
+        worst_us = 999999;
+    if(cpu_us > 9999999)
+        cpu_us = 9999999;
+
+    snprintf(rows[0], sizeof(rows[0]), "%3d fps %3u.%ums %3u%% cpu", fps,
+            worst_us/1000, (worst_us/100)%10, cpu_us/10000);
+    perf_hud_cache_row(rows[1], sizeof(rows[1]), "text", FB_CACHE_TEXT);
+    perf_hud_cache_row(rows[2], sizeof(rows[2]), "png", FB_CACHE_PNG);
+
+    fb_stats_get_cache(FB_CACHE_TEXT, &before);
+    for(i = 0; i < HUD_ROWS; ++i)
+        perf_hud_set_row(v, i, rows[i]);
+    fb_stats_get_cache(FB_CACHE_TEXT, &after);
+
+    hud.own_hits += after.hits - before.hits;
+    hud.own_misses += after.misses - before.misses;
+}
+
+static int perf_hud_worker(uint32_t diff, UNUSED void *data)
+{
+    hud_view *v;
+    const int visible = hud.visible;
+    int res = 0;
+
+    hud.since_refresh += diff;
+    if(visible == hud.shown && hud.since_refresh < HUD_REFRESH_MS)
+        return 0;
+    hud.since_refresh = 0;
+
+    fb_batch_start();
+    v = perf_hud_sweep(visible);
+    if(visible)
+    {
+        if(!v)
+            v = perf_hud_view_create();
+        perf_hud_update(v);
+    }
+    fb_batch_end();
+
+    hud.shown = visible;
+    fb_request_draw();
+
+    // keep watching for views which come back with a popped context
+    pthread_mutex_lock(&hud_mutex);
+    if(!hud.visible && !hud.views)
+    {
+        hud.worker_added = 0;
+        res = 1;
+    }
+    pthread_mutex_unlock(&hud_mutex);
+    return res;
+}
+
+void perf_hud_toggle(void)
+{
+    int add, visible;
+
+    pthread_mutex_lock(&hud_mutex);
+    hud.visible = !hud.visible;
+    visible = hud.visible;
+    add = !hud.worker_added;
+    hud.worker_added = 1;
+    pthread_mutex_unlock(&hud_mutex);
+
+    INFO("Performance HUD %s\n", visible ? "shown" : "hidden");
+
+    // keep the frames the HUD was showing for a closer look
+    if(!visible)
+        fb_stats_dump();
+
+    if(add)
+        workers_add(perf_hud_worker, NULL);
+}
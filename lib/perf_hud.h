@@ -0,0 +1,26 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PERF_HUD_H
+#define PERF_HUD_H
+
+// Shows or hides the overlay with frame rate, frame times and cache
+// statistics. It is refreshed from the workers thread, which must be running.
+// Hiding it writes the recent frames out with fb_stats_dump().
+void perf_hud_toggle(void);
+
+#endif
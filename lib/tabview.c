@@ -166,6 +166,7 @@ tabview *tabview_create(int x, int y, int w, int h)
 void tabview_destroy(tabview *t)
 {
     rm_touch_handler(&tabview_touch_handler, t);
+    fb_rm_layer(t->layer);
     pthread_mutex_destroy(&t->mutex);
     list_clear(&t->pages, tabview_page_destroy);
     touch_tracker_destroy(t->tracker);
@@ -205,6 +206,11 @@ void tabview_add_item(tabview *t, int page_idx, void *fb_item)
 
     pthread_mutex_lock(&t->mutex);
     list_add(&t->pages[page_idx]->items, fb_item);
+    if(t->layer)
+    {
+        void *items[] = { fb_item, NULL };
+        fb_layer_add_items(t->layer, items);
+    }
     pthread_mutex_unlock(&t->mutex);
 }
 
@@ -215,6 +221,8 @@ void tabview_add_items(tabview *t, int page_idx, void *fb_items)
 
     pthread_mutex_lock(&t->mutex);
     list_add_from_list(&t->pages[page_idx]->items, fb_items);
+    if(t->layer)
+        fb_layer_add_items(t->layer, fb_items);
     pthread_mutex_unlock(&t->mutex);
 }
 
@@ -225,6 +233,8 @@ void tabview_rm_item(tabview *t, int page_idx, void *fb_item)
 
     pthread_mutex_lock(&t->mutex);
     list_rm(&t->pages[page_idx]->items, fb_item, NULL);
+    if(t->layer)
+        fb_layer_rm_item(t->layer, fb_item);
     pthread_mutex_unlock(&t->mutex);
 }
 
@@ -286,3 +296,19 @@ void tabview_set_active_page(tabview *t, int page_idx, int anim_duration)
     t->anim_id = a->id;
     call_anim_add(a);
 }
+
+void tabview_set_layer(tabview *t, int level, uint32_t background)
+{
+    int i;
+
+    pthread_mutex_lock(&t->mutex);
+    if(!t->layer)
+    {
+        t->layer = fb_add_layer_lvl(level, t->x, t->y, t->w, t->h, background);
+
+        // Items which aren't fb items, like buttons, are refused by the layer
+        for(i = 0; i < t->count; ++i)
+            fb_layer_add_items(t->layer, t->pages[i]->items);
+    }
+    pthread_mutex_unlock(&t->mutex);
+}
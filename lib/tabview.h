@@ -48,6 +48,8 @@ typedef struct {
     int touch_id;
     int touch_moving;
     touch_tracker *tracker;
+
+    fb_layer *layer;
 } tabview;
 
 tabview *tabview_create(int x, int y, int w, int h);
@@ -60,5 +62,7 @@ void tabview_add_items(tabview *t, int page_idx, void *fb_items);
 void tabview_rm_item(tabview *t, int page_idx, void *fb_item);
 void tabview_update_positions(tabview *t);
 void tabview_set_active_page(tabview *t, int page_idx, int anim_duration);
+// Caches the pages' items in a layer, background is the color behind them
+void tabview_set_layer(tabview *t, int level, uint32_t background);
 
 #endif
@@ -60,6 +60,21 @@ int main(int argc, const char *argv[])
             fflush(stdout);
             return 0;
         }
+        else if(strcmp(argv[i], "--fb-benchmark") == 0)
+        {
+            fb_rotate_benchmark();
+            return 0;
+        }
+        else if(strcmp(argv[i], "--text-benchmark") == 0)
+        {
+            if(multirom_find_base_dir() == -1)
+            {
+                printf("MultiROM folder was not found!\n");
+                return 1;
+            }
+            fb_text_benchmark();
+            return 0;
+        }
         else if(strncmp(argv[i], "--boot-rom=", sizeof("--boot-rom")) == 0)
         {
             rom_to_boot = argv[i] + sizeof("--boot-rom");
@@ -512,6 +512,7 @@ void *multirom_ui_tab_rom_init(int tab_type)
     cur_theme->tab_rom_init(themes_info->data, t, tab_type);
 
     listview_init_ui(t->list);
+    listview_set_layer(t->list, C_BACKGROUND);
     tabview_add_item(themes_info->data->tabs, tab_type, t->list);
 
     if(tab_type == TAB_INTERNAL)